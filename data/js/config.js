@@ -6,6 +6,9 @@
       $("tUsage").checked = !!c.show_usage_graph;
       $("tPrioS").checked = !!c.show_prio_status;
       $("tPrioC").checked = !!c.show_prio_controls;
+      $("tPq").checked = !!c.pq_log;
+      $("cfgMqttHost").value = c.mqtt_host || "";
+      $("cfgMqttPort").value = c.mqtt_port || 1883;
       $("msgAuth").textContent = "";
       $("msgOpt").textContent = "";
     }catch(e){
@@ -28,9 +31,13 @@
     const show_usage_graph = $("tUsage").checked;
     const show_prio_status = $("tPrioS").checked;
     const show_prio_controls = $("tPrioC").checked;
+    const pq_log = $("tPq").checked;
+    const mqtt_host = $("cfgMqttHost").value.trim();
+    const mqtt_port = parseInt($("cfgMqttPort").value || "1883", 10);
     if(isNaN(budget_kwh) || budget_kwh<=0){ $("msgOpt").textContent="Invalid budget"; return; }
+    if(isNaN(mqtt_port) || mqtt_port<1 || mqtt_port>65535){ $("msgOpt").textContent="Invalid MQTT port"; return; }
     try{
-      await apiPost("/api/config",{ budget_kwh, show_usage_graph, show_prio_status, show_prio_controls });
+      await apiPost("/api/config",{ budget_kwh, show_usage_graph, show_prio_status, show_prio_controls, pq_log, mqtt_host, mqtt_port });
       $("msgOpt").textContent="Saved.";
     }catch(e){ $("msgOpt").textContent=e.message; }
   }
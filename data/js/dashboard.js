@@ -7,7 +7,7 @@ const state = {
   showPrioStatus: true,
   showPrioControls: false,
   budgetKwh: 0,
-  graph: { used: [], rem: [], t: [], pxPerSample: 4, capMin: 60 },
+  graph: { used: [], rem: [], t: [], seq: 0, pxPerSample: 4, capMin: 60 },
 };
 
 // ---------- Small UI helpers ----------
@@ -69,6 +69,30 @@ function trimToCapacity() {
   }
 }
 
+// ---------- Graph history (device-side ring, incremental by seq) ----------
+async function fetchHistory() {
+  const h = await apiGet(
+    `/api/history/recent?since=${state.graph.seq}&max=${computeCapacity()}`
+  );
+  const seq = Number(h.seq) || 0;
+  if (seq < state.graph.seq) {
+    // device rebooted: its ring restarted, drop what we have
+    state.graph.t = [];
+    state.graph.used = [];
+    state.graph.rem = [];
+  }
+  const samples = h.samples || [];
+  const period = Number(h.period_ms) || 1000;
+  const now = Date.now();
+  samples.forEach(([used, rem], i) => {
+    state.graph.t.push(now - (samples.length - 1 - i) * period);
+    state.graph.used.push(used || 0);
+    state.graph.rem.push(rem || 0);
+  });
+  state.graph.seq = seq;
+  trimToCapacity();
+}
+
 // ---------- Poll + render ----------
 async function fetchStatusAndRender() {
   try {
@@ -88,10 +112,9 @@ async function fetchStatusAndRender() {
 
     state.budgetKwh = Number(s.budget) || 0;
 
-    state.graph.t.push(Date.now());
-    state.graph.used.push(s.usedKWh || 0);
-    state.graph.rem.push(s.remKWh || 0);
-    trimToCapacity();
+    try {
+      await fetchHistory();
+    } catch {}
 
     state.showGraph = !!s.show_usage_graph;
     state.showPrioStatus = !!s.show_prio_status;
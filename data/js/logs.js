@@ -5,27 +5,80 @@ function toISOLocal(dt){ const pad=v=>String(v).padStart(2,"0"); return dt.getFu
 function getRange(){ const f=$("dtFrom").value, t=$("dtTo").value, p=new URLSearchParams(); if(f) p.set("from",f+":00"); if(t) p.set("to",t+":59"); return p.toString(); }
 function setDefaultRange(){ const now=new Date(), from=new Date(now); from.setHours(0,0,0,0); $("dtFrom").value=toISOLocal(from); $("dtTo").value=toISOLocal(now); $("hint").textContent="Showing local time (Asia/Manila)."; }
 
-function renderRows(items){
-  const tb=$("rows"); tb.innerHTML="";
-  const nf6=new Intl.NumberFormat(undefined,{minimumFractionDigits:6, maximumFractionDigits:6});
-  for(const r of items){
-    const tr=document.createElement("tr");
-    tr.innerHTML = `
-      <td style="padding:8px;border-bottom:1px solid var(--border)">${r.timestamp}</td>
-      <td style="padding:8px;border-bottom:1px solid var(--border);text-align:right">${nf6.format(r.budget_kwh)}</td>
-      <td style="padding:8px;border-bottom:1px solid var(--border);text-align:right">${nf6.format(r.remaining_kwh)}</td>
-      <td style="padding:8px;border-bottom:1px solid var(--border);text-align:right">${nf6.format(r.used_kwh)}</td>`;
-    tb.appendChild(tr);
+/* ---------- Virtualized table fed by keyset pages ----------
+   Only the rows in view (plus a margin) are in the DOM; the next page is
+   fetched with the server's cursor when the scroll nears the loaded end. */
+const ROW_H = 37, OVERSCAN = 10, PAGE = 200, MAX_ROWS = 50000;
+const view = { rows: [], next: null, done: true, loading: false, gen: 0, res: "hour", partial: false };
+// Column headers and row keys per resolution; summaries come whole (one
+// request, no cursor) from the same endpoint with res=hour|day.
+const COLS = {
+  raw:  [["Timestamp","timestamp"],["Budget (kWh)","budget_kwh"],["Remaining (kWh)","remaining_kwh"],["Used (kWh)","used_kwh"]],
+  sum:  [["Start","start"],["Consumed (kWh)","kwh"],["Min remaining (kWh)","rem_min_kwh"],["Used at end (kWh)","used_last_kwh"]],
+};
+function cols(){ return view.res==="raw" ? COLS.raw : COLS.sum; }
+function renderHead(){
+  $("head").innerHTML=cols().map(([t],i)=>`<th style="text-align:${i?"right":"left"}; padding:8px; border-bottom:1px solid #243149">${t}</th>`).join("");
+}
+const nf6 = new Intl.NumberFormat(undefined,{minimumFractionDigits:6, maximumFractionDigits:6});
+const cell = "padding:8px;border-bottom:1px solid var(--border);height:20px;white-space:nowrap";
+
+function renderWindow(){
+  const sc=$("scroller"), tb=$("rows"), n=view.rows.length;
+  const first=Math.max(0, Math.floor(sc.scrollTop/ROW_H)-OVERSCAN);
+  const last=Math.min(n, first+Math.ceil(sc.clientHeight/ROW_H)+2*OVERSCAN);
+  let html=`<tr style="height:${first*ROW_H}px"></tr>`;
+  for(let i=first;i<last;i++){
+    const r=view.rows[i], [[,k0],...rest]=cols();
+    html+=`<tr><td style="${cell}">${r[k0]}</td>`
+        +rest.map(([,k])=>`<td style="${cell};text-align:right">${nf6.format(r[k])}</td>`).join("")+`</tr>`;
   }
-  $("meta").textContent = `${items.length} row(s)`;
+  html+=`<tr style="height:${(n-last)*ROW_H}px"></tr>`;
+  tb.innerHTML=html;
+  const capped = n>=MAX_ROWS ? " — limit reached, narrow the range"
+               : view.partial ? " — partial: the device stopped early without a cursor, narrow the range" : "";
+  const unit = view.res==="raw" ? "row(s)" : view.res==="hour" ? "hour(s)" : "day(s)";
+  $("meta").textContent = `${n} ${unit}${view.done ? "" : "+"}${capped}`;
+  if(!view.done && !view.loading && last+OVERSCAN>=n) fetchPage();
 }
 
-async function load(){
-  const q = getRange(); const res = await fetch(`/api/logs/query?${q}`,{credentials:"include"});
-  if(!res.ok){ alert(await res.text()||"Failed to load"); return; }
-  const json = await res.json(); renderRows(json.items||[]);
+async function fetchPage(){
+  const gen=view.gen; view.loading=true;
+  try{
+    const p=new URLSearchParams(getRange());
+    if(view.res==="raw"){ p.set("limit",PAGE); if(view.next) p.set("after",view.next); } else p.set("res",view.res);
+    const res=await fetch(`/api/logs/query?${p}`,{credentials:"include"});
+    if(gen!==view.gen) return;
+    if(res.status===503){                      // admission control: come back later
+      const wait=(parseInt(res.headers.get("Retry-After"))||2)*1000;
+      setTimeout(()=>{ if(gen===view.gen){ view.loading=false; renderWindow(); } }, wait);
+      return;
+    }
+    if(!res.ok){ view.done=true; view.loading=false; alert(await res.text()||"Failed to load"); return; }
+    const json=await res.json();
+    if(gen!==view.gen) return;
+    for(const r of (json.items||[])) view.rows.push(r);
+    view.next=json.next||null;
+    if(json.truncated && !view.next) view.partial=true;   // firmware that slices without a cursor
+    view.done=!view.next || view.rows.length>=MAX_ROWS;
+    view.loading=false;
+    renderWindow();
+  }catch(e){ if(gen===view.gen){ view.loading=false; view.done=true; alert(e); } }
 }
 
+function load(){
+  view.gen++; view.rows=[]; view.next=null; view.done=false; view.loading=false; view.partial=false; view.res=$("res").value;
+  renderHead();
+  $("scroller").scrollTop=0;
+  renderWindow();
+}
+
+let scrollQueued=false;
+$("scroller").addEventListener("scroll",()=>{
+  if(scrollQueued) return; scrollQueued=true;
+  requestAnimationFrame(()=>{ scrollQueued=false; renderWindow(); });
+});
+
 $("btnLoad").onclick=load;
 $("btnExport").onclick=()=>{ const q=getRange(); const a=document.createElement("a"); a.href=`/api/logs/export.xls?${q}`; a.download="smartload_logs.xls"; document.body.appendChild(a); a.click(); a.remove(); };
 $("btnPrint").onclick=()=>{ const q=getRange(); window.open(`/logs_print.html?${q}`,"_blank"); };
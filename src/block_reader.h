@@ -0,0 +1,94 @@
+#pragma once
+// Line reader over large, block-aligned reads, shared by the firmware's SD
+// reader (SdBlockReader in main.cpp) and tools/reader_bench.cpp, so the host
+// benchmark measures the same code. Plain C++ only.
+//
+// `Src` provides  int read(uint8_t* dst, size_t n)  (bytes read, <= 0 at end)
+// and  bool seek(uint32_t off).  Lines come back as NUL-terminated views into
+// the caller's buffer (valid until the next call); a partial line at the end
+// of a block is carried to the front of the next.
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+static const size_t BLOCK_READ_SIZE  = 8192;   // 16 sectors
+static const size_t BLOCK_LINE_MAX   = 256;    // longest line carried across blocks
+static const size_t BLOCK_READER_MEM = BLOCK_LINE_MAX + BLOCK_READ_SIZE + 1;
+
+template<typename Src>
+class BlockLineReader {
+public:
+  // `mem` holds BLOCK_READER_MEM bytes (or is null: every read fails);
+  // `start` is the source's current offset.
+  BlockLineReader(Src& s, uint8_t* m, uint32_t start) : src(s), mem(m), nextOff(start) {}
+
+  // Next line with '\n' and trailing '\r' removed; nullptr at end of file.
+  const char* next(size_t* lenOut=nullptr){
+    if(!mem) return nullptr;
+    for(;;){
+      uint8_t* nl = (uint8_t*)memchr(mem + pos, '\n', end - pos);
+      if(nl || (eof && pos < end)){
+        char*  line = (char*)mem + pos;
+        size_t len  = (nl ? nl - mem : end) - pos;
+        lineOff = fileOffsetAt(pos);
+        pos += len + (nl ? 1 : 0);
+        if(len && line[len-1] == '\r') len--;
+        line[len] = 0;
+        if(lenOut) *lenOut = len;
+        return line;
+      }
+      if(eof || !refill()) return nullptr;
+    }
+  }
+  // File offset where the line last returned by next() starts.
+  uint32_t lineOffset() const { return lineOff; }
+  // File offset of the next unread byte.
+  uint32_t tell() const { return fileOffsetAt(pos); }
+
+  // Raw copy for streaming; returns 0 at end of file.
+  size_t read(uint8_t* dst, size_t n){
+    if(!mem) return 0;
+    if(pos == end && (eof || !refill())) return 0;
+    if(n > end - pos) n = end - pos;
+    memcpy(dst, mem + pos, n); pos += n;
+    return n;
+  }
+  size_t buffered() const { return end - pos; }
+
+  // Positions at `off`, reading from the enclosing block boundary.
+  bool seek(uint32_t off){
+    if(!mem) return false;
+    uint32_t aligned = off - (off % BLOCK_READ_SIZE);
+    if(!src.seek(aligned)) return false;
+    nextOff = aligned; pos = end = BLOCK_LINE_MAX; eof = false;
+    if(!refill()) return off == aligned;
+    pos += (size_t)(off - aligned);
+    if(pos > end) pos = end;
+    return true;
+  }
+
+protected:
+  Src&     src;
+  uint8_t* mem;
+
+private:
+  size_t   pos = BLOCK_LINE_MAX, end = BLOCK_LINE_MAX;  // unread window in mem
+  uint32_t blockOff = 0;      // file offset of mem[BLOCK_LINE_MAX]
+  uint32_t nextOff  = 0;      // file offset of the next block to read
+  uint32_t lineOff  = 0;
+  bool     eof = false;
+
+  uint32_t fileOffsetAt(size_t idx) const { return blockOff + (uint32_t)idx - (uint32_t)BLOCK_LINE_MAX; }
+
+  bool refill(){
+    size_t carry = end - pos;
+    if(carry > BLOCK_LINE_MAX) carry = 0;                 // runaway line: drop it
+    memmove(mem + BLOCK_LINE_MAX - carry, mem + end - carry, carry);
+    int n = src.read(mem + BLOCK_LINE_MAX, BLOCK_READ_SIZE);
+    if(n < 0) n = 0;
+    blockOff = nextOff; nextOff += n;
+    pos = BLOCK_LINE_MAX - carry; end = BLOCK_LINE_MAX + n;
+    if(n == 0){ eof = true; return carry > 0; }
+    return true;
+  }
+};
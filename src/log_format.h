@@ -0,0 +1,271 @@
+#pragma once
+// On-SD log record formats shared by the firmware and the host tools.
+// Plain C++ only (no Arduino headers) so it also builds with a desktop g++.
+#include <stdint.h>
+#include <stddef.h>
+
+/* ===================== Varints ===================== */
+static inline size_t putVarint(uint8_t* p, uint64_t v){
+  size_t n = 0;
+  while(v >= 0x80){ p[n++] = (uint8_t)v | 0x80; v >>= 7; }
+  p[n++] = (uint8_t)v;
+  return n;
+}
+// Returns the byte after the varint, or nullptr if it runs past `end`.
+static inline const uint8_t* getVarint(const uint8_t* p, const uint8_t* end, uint64_t& v){
+  v = 0;
+  for(int shift = 0; p < end && shift < 64; shift += 7){
+    uint8_t b = *p++;
+    v |= (uint64_t)(b & 0x7F) << shift;
+    if(!(b & 0x80)) return p;
+  }
+  return nullptr;
+}
+static inline uint64_t zigzag(int64_t v){ return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static inline int64_t  unzigzag(uint64_t v){ return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+/* ===================== Daily log archive (.lga) ===================== */
+// A closed day's hourly CSVs folded into one file:
+//   [block 0][block 1]...[ArchiveBlockIdx x blocks][ArchiveTrailer]
+// A block is up to ARCHIVE_BLOCK_ROWS rows, each stored as zigzag varint
+// deltas from the previous row of the same block (the first from zero):
+// epoch seconds, then budget/remaining/used in micro-kWh, i.e. exactly the
+// six decimals the CSV carries. Blocks decode independently; the index gives
+// each one's epoch range, so readers seek by time without touching the rest.
+// Epochs are local wall time read as if it were UTC, as in the CSV.
+static const uint32_t ARCHIVE_MAGIC       = 0x31414C53;   // "SLA1"
+static const uint16_t ARCHIVE_BLOCK_ROWS  = 256;
+static const size_t   ARCHIVE_BLOCK_BYTES = 2048;         // soft limit; flush past this
+static const size_t   ARCHIVE_ROW_MAX     = 4 * 10;       // four worst-case varints
+static const size_t   ARCHIVE_BUF_BYTES   = ARCHIVE_BLOCK_BYTES + ARCHIVE_ROW_MAX;
+
+struct __attribute__((packed)) ArchiveBlockIdx {
+  uint32_t lo, hi;       // epoch range of the rows in the block
+  uint32_t off;          // file offset
+  uint16_t len, rows;
+  uint32_t crc;          // CRC32 of the block bytes
+};
+struct __attribute__((packed)) ArchiveTrailer {
+  uint32_t indexOff;
+  uint32_t blocks;
+  uint32_t rows;
+  uint32_t day;          // YYYYMMDD
+  uint32_t indexCrc;     // CRC32 of the index
+  uint32_t magic;
+};
+
+struct ArchiveRow { uint32_t epoch; int64_t budget, rem, used; };   // kWh * 1e6
+
+class ArchiveBlockWriter {
+public:
+  uint8_t  buf[ARCHIVE_BUF_BYTES];
+  size_t   len = 0;
+  uint16_t rows = 0;
+  uint32_t lo = 0, hi = 0;
+
+  bool full() const { return rows >= ARCHIVE_BLOCK_ROWS || len >= ARCHIVE_BLOCK_BYTES; }
+  void reset(){ len = 0; rows = 0; prev = ArchiveRow{0, 0, 0, 0}; }
+  void add(const ArchiveRow& r){
+    if(!rows || r.epoch < lo) lo = r.epoch;
+    if(!rows || r.epoch > hi) hi = r.epoch;
+    len += putVarint(buf + len, zigzag((int64_t)r.epoch - (int64_t)prev.epoch));
+    len += putVarint(buf + len, zigzag(r.budget - prev.budget));
+    len += putVarint(buf + len, zigzag(r.rem    - prev.rem));
+    len += putVarint(buf + len, zigzag(r.used   - prev.used));
+    prev = r; rows++;
+  }
+private:
+  ArchiveRow prev{0, 0, 0, 0};
+};
+
+// Decodes the next row of a block into `prev` (start it zeroed at the block
+// head). Returns the position after the row, or nullptr on corrupt data.
+static inline const uint8_t* archiveDecodeRow(const uint8_t* p, const uint8_t* end, ArchiveRow& prev){
+  uint64_t v;
+  if(!(p = getVarint(p, end, v))) return nullptr;
+  prev.epoch = (uint32_t)((int64_t)prev.epoch + unzigzag(v));
+  if(!(p = getVarint(p, end, v))) return nullptr;
+  prev.budget += unzigzag(v);
+  if(!(p = getVarint(p, end, v))) return nullptr;
+  prev.rem += unzigzag(v);
+  if(!(p = getVarint(p, end, v))) return nullptr;
+  prev.used += unzigzag(v);
+  return p;
+}
+
+/* ===================== Budget zones ===================== */
+// Zone by remaining budget percentage, with hysteresis between bands. Lives
+// here so host tools classify logged rows exactly as the controller did.
+// 4 = all loads, 3 = P4 off, 2 = P1+P2 only, 1 = P1 only, 0 = cut off.
+static const float ZONE_BAND_HYST = 2.0f;
+static const float ZONE_PCT_EPS   = 0.0001f;
+static inline uint8_t zoneForPct(float pct, uint8_t prev){
+  const float H = ZONE_BAND_HYST;
+  if(pct <= ZONE_PCT_EPS) return 0;
+  switch(prev){
+    case 4: if(pct < 69.0f - H) return 3;  return 4;
+    case 3: if(pct >= 70.0f + H) return 4; if(pct < 39.0f - H) return 2; if(pct <= H) return 0; return 3;
+    case 2: if(pct >= 40.0f + H) return 3; if(pct < 9.0f - H) return 1;  if(pct <= H) return 0; return 2;
+    case 1: if(pct >= 10.0f + H) return 2; if(pct <= H) return 0; return 1;
+    case 0: if(pct > H) return 1; return 0;
+  }
+  return prev;
+}
+
+/* ===================== Event journal (.bin) ===================== */
+// /events/ev_YYYYMM.bin: back-to-back fixed 16-byte records, appended as
+// control decisions happen. Each record carries the zone and pause/relay
+// state in force after it, so state can be rebuilt from any record onward.
+enum EventType : uint8_t {
+  EV_BOOT = 1,      // from = reset reason; the gap before it is unknown
+  EV_MARK,          // hourly heartbeat, bounds that gap
+  EV_ZONE,          // from/to = zone
+  EV_RELAYS,        // from/to = relay output mask (bit0 = P1)
+  EV_MANUAL,        // from/to = manual override mask
+  EV_STOP, EV_RESUME, EV_RESTART,
+  EV_PZEM_STALE,    // to = 1 entering soft integration, 0 leaving
+};
+struct __attribute__((packed)) EventRec {
+  uint32_t epoch;     // local wall time, as in the CSV
+  uint32_t meter;     // meter total (incl. soft-integrated energy) at the event, see eventMeterDWh
+  uint16_t seq;
+  uint8_t  type;
+  uint8_t  from, to;
+  uint8_t  zone;      // zone in force after the event
+  uint8_t  state;     // bit0 paused, bit1 EV_STATE_DWH, bits 4..7 relay outputs
+  uint8_t  check;     // low byte of CRC32 over the first 15 bytes
+};
+static_assert(sizeof(EventRec) == 16, "EventRec must stay 16 bytes");
+// `meter` is in 0.1 Wh when this is set (427 MWh before it wraps); records
+// written before it existed carry whole Wh.
+static const uint8_t EV_STATE_DWH = 0x02;
+static inline uint32_t eventMeterDWh(const EventRec& e){ return (e.state & EV_STATE_DWH) ? e.meter : e.meter * 10u; }
+
+/* ===================== Power-quality samples (.pqb/.pqi) ===================== */
+// /pq/pq_YYYYMMDD.pqb: blocks of meter samples (PqBlockHdr + payload), and
+// /pq/pq_YYYYMMDD.pqi: one PqIdx per block, appended with it (sparse index).
+// In a block the timestamp is a delta-of-delta in ms and every field a delta
+// from the previous row, all zigzag varints, so a steady 1 Hz stream costs
+// about one byte per field. Blocks decode independently.
+static const uint16_t PQ_MAGIC       = 0x5150;   // "PQ"
+static const uint16_t PQ_BLOCK_ROWS  = 240;
+static const size_t   PQ_BLOCK_BYTES = 1536;     // soft limit; flush past this
+static const size_t   PQ_ROW_MAX     = 6 * 10;
+static const size_t   PQ_BUF_BYTES   = PQ_BLOCK_BYTES + PQ_ROW_MAX;
+
+struct __attribute__((packed)) PqBlockHdr {
+  uint16_t magic, rows, len, reserved;
+  int64_t  t0Ms;       // local wall time of the first row, ms
+  uint32_t crc;        // CRC32 of the payload
+};
+struct __attribute__((packed)) PqIdx { uint32_t firstS, off; };
+
+// Meter resolution: 0.1 V, 1 mA, 0.1 W, 0.01 PF, 0.1 Hz.
+struct PqSample { int64_t tMs; int32_t dV, mA, dW, cPf, dHz; };
+
+class PqBlockWriter {
+public:
+  uint8_t  buf[PQ_BUF_BYTES];
+  size_t   len = 0;
+  uint16_t rows = 0;
+  int64_t  t0Ms = 0;
+
+  bool full() const { return rows >= PQ_BLOCK_ROWS || len >= PQ_BLOCK_BYTES; }
+  void reset(){ len = 0; rows = 0; }
+  void add(const PqSample& s){
+    if(!rows){ t0Ms = s.tMs; prev = PqSample{s.tMs, 0, 0, 0, 0, 0}; prevDelta = 0; }
+    int64_t delta = s.tMs - prev.tMs;
+    len += putVarint(buf + len, zigzag(delta - prevDelta));
+    len += putVarint(buf + len, zigzag((int64_t)s.dV  - prev.dV));
+    len += putVarint(buf + len, zigzag((int64_t)s.mA  - prev.mA));
+    len += putVarint(buf + len, zigzag((int64_t)s.dW  - prev.dW));
+    len += putVarint(buf + len, zigzag((int64_t)s.cPf - prev.cPf));
+    len += putVarint(buf + len, zigzag((int64_t)s.dHz - prev.dHz));
+    prev = s; prevDelta = delta; rows++;
+  }
+private:
+  PqSample prev{0, 0, 0, 0, 0, 0};
+  int64_t  prevDelta = 0;
+};
+
+// Decoder state for one block: start with pqDecodeBegin(), then pqDecodeRow()
+// per row. Returns the position after the row, or nullptr on corrupt data.
+struct PqDecodeState { PqSample prev; int64_t prevDelta; };
+static inline void pqDecodeBegin(PqDecodeState& st, int64_t t0Ms){
+  st.prev = PqSample{t0Ms, 0, 0, 0, 0, 0}; st.prevDelta = 0;
+}
+static inline const uint8_t* pqDecodeRow(const uint8_t* p, const uint8_t* end, PqDecodeState& st){
+  uint64_t v;
+  if(!(p = getVarint(p, end, v))) return nullptr;
+  st.prevDelta += unzigzag(v);
+  st.prev.tMs  += st.prevDelta;
+  int32_t* f[5] = { &st.prev.dV, &st.prev.mA, &st.prev.dW, &st.prev.cPf, &st.prev.dHz };
+  for(int i = 0; i < 5; i++){
+    if(!(p = getVarint(p, end, v))) return nullptr;
+    *f[i] = (int32_t)(*f[i] + unzigzag(v));
+  }
+  return p;
+}
+
+/* ===================== Replication stream (/api/replicate) ===================== */
+// The body is a run of frames, each a ReplFrame and `len` payload bytes. Row
+// frames carry up to ARCHIVE_BLOCK_ROWS rows in the archive block encoding
+// (archiveDecodeRow, starting from a zeroed row). The last frame has rows == 0
+// and a ReplCursor payload: pass it back as ?cursor=key.pos.epoch.dup.archive
+// (hex) to get the rows after it; `more` says another batch is ready now.
+static const uint32_t REPL_MAGIC = 0x31524C53;   // "SLR1"
+
+struct __attribute__((packed)) ReplFrame {
+  uint32_t magic;
+  uint16_t rows, len;
+  uint32_t crc;          // CRC32 of the payload
+};
+struct __attribute__((packed)) ReplCursor {
+  uint32_t key;          // YYYYMMDDHH of the file holding the last row sent
+  uint32_t pos;          // that row's position in the file
+  uint32_t epoch;        // its timestamp
+  uint16_t dup;          // rows sent so far with that same timestamp
+  uint8_t  archive;      // pos is an archive row index, not a CSV byte offset
+  uint8_t  more;
+};
+static_assert(sizeof(ReplCursor) == 16, "ReplCursor must stay 16 bytes");
+
+/* ===================== Per-hour log summaries (.sum) ===================== */
+// /archive/logs_YYYYMMDD.sum, next to the day's archive: one LogSummary per
+// hour (rows == 0 for an hour without data), then a SummaryTrailer. Written
+// once the day is closed, so it never changes. Values in micro-kWh as in the
+// archive; `consumed` adds up increases in `used` only, since a cycle restart
+// drops it to zero without any energy having been returned.
+static const uint32_t SUMMARY_MAGIC = 0x31534C53;   // "SLS1"
+
+struct __attribute__((packed)) LogSummary {
+  uint32_t rows;
+  uint32_t firstEpoch, lastEpoch;
+  int64_t  firstUsed, lastUsed;
+  int64_t  consumed;
+  int64_t  minRem;
+};
+struct __attribute__((packed)) SummaryTrailer {
+  uint32_t day;          // YYYYMMDD
+  uint32_t crc;          // CRC32 of the 24 LogSummary records
+  uint32_t magic;
+};
+
+static inline void summaryAdd(LogSummary& s, const ArchiveRow& r){
+  if(!s.rows){ s.firstEpoch = r.epoch; s.firstUsed = r.used; s.minRem = r.rem; s.consumed = 0; }
+  else {
+    if(r.used > s.lastUsed) s.consumed += r.used - s.lastUsed;
+    if(r.rem < s.minRem) s.minRem = r.rem;
+  }
+  s.lastEpoch = r.epoch; s.lastUsed = r.used; s.rows++;
+}
+// Appends `next`, which must follow `into` in time.
+static inline void summaryMerge(LogSummary& into, const LogSummary& next){
+  if(!next.rows) return;
+  if(!into.rows){ into = next; return; }
+  if(next.firstUsed > into.lastUsed) into.consumed += next.firstUsed - into.lastUsed;
+  into.consumed += next.consumed;
+  if(next.minRem < into.minRem) into.minRem = next.minRem;
+  into.lastEpoch = next.lastEpoch; into.lastUsed = next.lastUsed;
+  into.rows += next.rows;
+}
@@ -12,9 +12,24 @@
 #include <math.h>
 #include <vector>
 #include <algorithm>
-#include <DNSServer.h>
-
-DNSServer dnsServer;
+#include <atomic>
+#include <memory>
+#include <new>
+#include "log_format.h"
+#include "block_reader.h"
+#include <lwip/sockets.h>
+#include <esp_idf_version.h>
+#include <esp_partition.h>
+#include <esp_random.h>
+#include <esp_ota_ops.h>
+#include <Update.h>
+#include <Preferences.h>
+#include <mbedtls/sha256.h>
+#if ESP_IDF_VERSION_MAJOR >= 5
+#include <miniz.h>
+#else
+#include <esp32/rom/miniz.h>
+#endif
 
 /* === AP defaults === */
 #define AP_SSID "LoadDroppingWifi"
@@ -69,10 +84,10 @@ uint32_t lastEnergyUpdateMs = 0;
 double   softAccumKWh = 0.0;
 double   lastPowerW    = 0.0;
 double   lastVoltageV  = 0.0;
+double   lastFreqHz    = 0.0;
+double   lastPf        = 0.0;
 double   lastCurrentA  = 0.0;
 
-const float  BAND_HYST = 2.0f;
-const float  PCT_EPS   = 0.0001f;
 const double ENERGY_BACKSTEP_EPS = 0.0005; // kWh
 const uint32_t STALE_MS = 8000;            // hardware energy stale window
 const double POWER_STALE_W = 10.0;         // consider load present
@@ -102,74 +117,632 @@ struct AppConfig {
   bool   show_usage_graph = true;
   bool   show_prio_status = true;
   bool   show_prio_controls = false;
+  bool   pq_log = false;             // 1 Hz power-quality channel
+  String mqtt_host = "";             // empty: MQTT off
+  uint16_t mqtt_port = 1883;
 } appcfg;
 
 /* ===================== FS mount flags ===================== */
 static bool littlefsMounted = false;
 
 /* ===================== readiness / tasks ===================== */
+volatile bool controlReady = false; // meter + fast state restored: relays may run
 volatile bool systemReady = false;  // flips true when slow init completes
 void slowInitTask(void*);
 
 /* ===================== Forwards ===================== */
 double  virtualTotalKWh();
 void    savePauseSnapshot();
+extern volatile uint32_t snapshotDueMs;
 bool    loadPauseSnapshot();
-static  String urlDecode(const String &s);   // forward declare
-static  bool   parseBoolStr(String v);
+static  void   urlDecodeInPlace(char* s);     // forward declare
+static  bool   parseBoolStr(const char* v);
+static  uint32_t logFileKey(const String& name);
+static  bool   latestArchivedRow(double& budget, double& rem, double& used);
+static  void   configCommitMaybe(bool force);
+
+/* ===================== Metrics (counters / histograms) ===================== */
+// Recording is a couple of relaxed atomic adds and never allocates, so it can
+// stay on in production. Scraped as Prometheus text at /metrics.
+static const uint8_t  HIST_BUCKETS = 14;
+static const uint32_t HIST_BOUNDS_US[HIST_BUCKETS] = {
+  50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000
+};
+struct LatencyHist {
+  const char* label  = nullptr;              // op name, or route path for HTTP
+  const char* method = nullptr;              // HTTP only
+  std::atomic<uint32_t> buckets[HIST_BUCKETS + 1];  // last one is +Inf
+  std::atomic<uint32_t> count{0};
+  std::atomic<uint32_t> sumLo{0};            // microseconds, 64-bit split so the
+  std::atomic<uint32_t> sumHi{0};            // adds stay lock-free on Xtensa
+  LatencyHist(){ for(auto& b : buckets) b.store(0, std::memory_order_relaxed); }
+  void observe(uint32_t us){
+    uint8_t i = 0;
+    while(i < HIST_BUCKETS && us > HIST_BOUNDS_US[i]) i++;
+    buckets[i].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    uint32_t prev = sumLo.fetch_add(us, std::memory_order_relaxed);
+    if((uint32_t)(prev + us) < prev) sumHi.fetch_add(1, std::memory_order_relaxed);
+  }
+  uint64_t sumUs() const {
+    uint32_t hi, lo;
+    do { hi = sumHi.load(); lo = sumLo.load(); } while(hi != sumHi.load());
+    return ((uint64_t)hi << 32) | lo;
+  }
+};
+struct ScopedTimer {
+  LatencyHist& h; uint32_t t0;
+  explicit ScopedTimer(LatencyHist& hh) : h(hh), t0(micros()) {}
+  ~ScopedTimer(){ h.observe(micros() - t0); }
+};
+
+// Control-path operations
+static LatencyHist mVirtualTotal, mComputeStatus, mEnforceRelays, mLogWrite, mSnapshotSave;
+static LatencyHist mSdBlockRead;   // defined with the SD reader
+static LatencyHist* const OP_HISTS[] = { &mVirtualTotal, &mComputeStatus, &mEnforceRelays, &mLogWrite, &mSnapshotSave, &mSdBlockRead };
+
+// HTTP handlers: slots are handed out once while routes are registered
+static const uint8_t HTTP_HIST_MAX = 40;
+static LatencyHist httpHists[HTTP_HIST_MAX];
+static uint8_t     httpHistCount = 0;
+
+static std::atomic<uint32_t> pzemReadErrors{0};   // NaN / negative readings
+static std::atomic<uint32_t> pzemStaleEvents{0};  // entries into soft integration
+static bool                  pzemStale = false;
+static bool                  pzemReadOk = false;  // the last read gave V, A, W and Hz
+static std::atomic<uint32_t> exportCount{0}, exportRows{0}, exportBytes{0}, exportMs{0};
+static std::atomic<uint32_t> archiveDays{0}, archiveRowsIn{0}, archiveBytesIn{0}, archiveBytesOut{0};
+static std::atomic<uint32_t> archiveDecodeBytes{0}, archiveDecodeUs{0}, archiveCrcErrors{0};
+static std::atomic<uint32_t> replRows{0}, replBytes{0};
+static std::atomic<uint32_t> mqttPublished{0}, mqttBytes{0}, mqttDropped{0}, mqttSamples{0}, mqttSampleBytes{0}, mqttCoalesced{0}, mqttConnects{0};
+static std::atomic<uint32_t> dnsQueries{0}, dnsAnswered{0}, dnsIgnored{0}, dnsRatePerS{0};
+static std::atomic<uint32_t> otaUpdates{0}, otaFailures{0};
+static std::atomic<uint32_t> configChanges{0}, configCommits{0};
+static std::atomic<uint32_t> qcacheHits{0}, qcacheMisses{0}, sumDaysBuilt{0};
+static TaskHandle_t          loopTaskHandle = nullptr;
+static uint32_t              slowInitStackHwm = 0;   // captured just before it exits
+
+static void metricsInit(){
+  mVirtualTotal.label  = "virtual_total_kwh";
+  mComputeStatus.label = "compute_status";
+  mEnforceRelays.label = "enforce_relays";
+  mLogWrite.label      = "append_log_write";
+  mSnapshotSave.label  = "save_pause_snapshot";
+}
+static LatencyHist* httpHist(const char* path, const char* method){
+  if(httpHistCount >= HTTP_HIST_MAX) return nullptr;
+  httpHists[httpHistCount].label  = path;
+  httpHists[httpHistCount].method = method;
+  return &httpHists[httpHistCount++];
+}
+
+/* ===================== Trace recorder (build flag SMARTLOAD_TRACE) ===================== */
+// Build with -DSMARTLOAD_TRACE=1 and every TRACE_SCOPE lands as one complete
+// event in the ring of the core it ran on; GET /api/trace dumps both rings as
+// Chrome trace_event JSON for Perfetto / chrome://tracing. Recording takes a
+// cycle-counter read at each end, one relaxed fetch_add and a 20-byte store;
+// no locks, no allocation. A scope that runs past TRACE_STALL_US freezes the
+// rings, so a stall and what led up to it on both cores survive until someone
+// fetches them; the dump re-arms. Built without the flag, TRACE_SCOPE is
+// nothing and /api/trace answers 404.
+#ifndef SMARTLOAD_TRACE
+#define SMARTLOAD_TRACE 0
+#endif
+#if SMARTLOAD_TRACE
+static const uint16_t TRACE_EVENTS   = 512;       // per core, power of two
+static const uint32_t TRACE_STALL_US = 250000;
+struct TraceEvent {
+  const char* name;      // nullptr while being written
+  uint32_t    tsUs;      // start, esp_timer µs (wraps after 71 min)
+  uint32_t    durCycles;
+  char        task[8];   // not NUL-terminated when the name fills it
+};
+struct TraceRing {
+  TraceEvent ev[TRACE_EVENTS];
+  std::atomic<uint32_t> head{0};
+  volatile uint32_t anchorCc = 0, anchorUs = 0;   // cycle counter <-> esp_timer, re-taken each second
+};
+static TraceRing         traceRings[2];
+static std::atomic<bool> traceFrozen{false};
+static uint32_t          traceMhz = 240;
+static portMUX_TYPE      traceMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void traceInit(){ traceMhz = getCpuFrequencyMhz(); }
+
+// µs timestamp from this core's cycle counter; `cc` gets the raw count.
+static uint32_t traceNowUs(uint32_t& cc){
+  TraceRing& r = traceRings[xPortGetCoreID()];
+  uint32_t aCc, aUs;
+  do { aCc = r.anchorCc; aUs = r.anchorUs; } while (aCc != r.anchorCc);
+  cc = ESP.getCycleCount();
+  if (!aUs || cc - aCc >= traceMhz * 1000000u){   // before the 17 s wrap at 240 MHz
+    portENTER_CRITICAL(&traceMux);
+    r.anchorCc = aCc = ESP.getCycleCount();
+    r.anchorUs = aUs = (uint32_t)esp_timer_get_time();
+    portEXIT_CRITICAL(&traceMux);
+    cc = aCc;
+  }
+  return aUs + (cc - aCc) / traceMhz;
+}
+static void traceRecord(const char* name, uint32_t tsUs, uint32_t durCycles){
+  if (traceFrozen.load(std::memory_order_relaxed)) return;
+  TraceRing& r = traceRings[xPortGetCoreID()];
+  TraceEvent& e = r.ev[r.head.fetch_add(1, std::memory_order_relaxed) & (TRACE_EVENTS - 1)];
+  e.name = nullptr;
+  e.tsUs = tsUs; e.durCycles = durCycles;
+  strncpy(e.task, pcTaskGetName(nullptr), sizeof(e.task));
+  e.name = name;
+  if (durCycles >= TRACE_STALL_US * traceMhz) traceFrozen.store(true, std::memory_order_relaxed);
+}
+struct TraceScope {
+  const char* name; uint32_t cc0, us0; BaseType_t core;
+  explicit TraceScope(const char* n) : name(n), core(xPortGetCoreID()) { us0 = traceNowUs(cc0); }
+  ~TraceScope(){
+    uint32_t cc1, us1 = traceNowUs(cc1);
+    // a task that moved cores mid-scope can't subtract counts from two clocks
+    traceRecord(name, us0, xPortGetCoreID() == core ? cc1 - cc0 : (us1 - us0) * traceMhz);
+  }
+};
+#define TRACE_CAT2(a, b) a##b
+#define TRACE_CAT(a, b) TRACE_CAT2(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CAT(traceScope_, __LINE__)(name)
+#else
+static void traceInit(){}
+#define TRACE_SCOPE(name) do {} while (0)
+#endif
 
 /* ===================== FS helpers ===================== */
 bool fileExists(fs::FS &fs, const char* path){
   File f = fs.open(path); if(!f) return false; f.close(); return true;
 }
+static uint32_t crc32(const void* data, size_t len, uint32_t crc=0){
+  const uint8_t* p = (const uint8_t*)data;
+  crc = ~crc;
+  while(len--){
+    crc ^= *p++;
+    for(uint8_t k=0;k<8;k++) crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+  }
+  return ~crc;
+}
+
+/* ===================== Storage service (SD) ===================== */
+// Owns the SD mount and the SPI bus. Nobody else calls SD.begin(): callers
+// take an SdLock at a priority, check it, and use SD.* while holding it.
+// Waiters of a higher priority always go first, and bulk readers call
+// yieldToHigher() between rows, so a control-loop log write never queues
+// behind a year-long export. The network task never waits for the bus: from
+// async_tcp an acquire is a single try, and handlers answer 503 + Retry-After
+// (or RESPONSE_TRY_AGAIN mid-stream) when it is taken; a scan there stops when
+// yieldToHigher() says so, and a stream's last file close goes to storageTask
+// (sdDispose) when the bus is taken. Failures mark the card faulted; storageTask then
+// remounts it with exponential backoff (card pulled, re-seated, or swapped).
+enum SdPrio : uint8_t { SD_PRIO_CONTROL=0, SD_PRIO_INTERACTIVE=1, SD_PRIO_BULK=2, SD_PRIO_COUNT };
+enum SdState : uint8_t { SD_UNMOUNTED=0, SD_MOUNTED=1, SD_FAULTED=2 };
+static volatile SdState sdState = SD_UNMOUNTED;
+static SemaphoreHandle_t sdMutex = nullptr;
+static TaskHandle_t      sdHolder = nullptr;
+static TaskHandle_t      sdNetTask = nullptr;   // async_tcp, noted by route()
+static uint8_t           sdDepth  = 0;
+static std::atomic<uint8_t> sdWaiting[SD_PRIO_COUNT];
+static uint32_t sdMountCount = 0, sdFaultCount = 0;
+static uint32_t sdNextRetryMs = 0, sdBackoffMs = 1000;
+static uint32_t logOldestDay = 0;   // first day with logs on the card, 0 = look it up (logFirstKey)
+static const uint32_t SD_BACKOFF_MAX_MS = 60000;
+static const uint32_t SD_PROBE_MS = 10000;
+typedef std::function<void()> SdCloseFn;
+static QueueHandle_t sdCloseQ = nullptr;   // closes handed over by async_tcp
+static const uint8_t SD_CLOSE_QUEUE = 16;
+
+static void storageInit(){
+  sdMutex = xSemaphoreCreateRecursiveMutex();
+  sdCloseQ = xQueueCreate(SD_CLOSE_QUEUE, sizeof(SdCloseFn*));
+  for(auto& w : sdWaiting) w.store(0);
+}
+static bool sdHigherWaiting(SdPrio p){
+  for(uint8_t q=0;q<p;q++) if(sdWaiting[q].load()) return true;
+  return false;
+}
+static bool sdAcquire(SdPrio p, uint32_t waitMs){
+  TRACE_SCOPE("sd_acquire");
+  TaskHandle_t me = xTaskGetCurrentTaskHandle();
+  if(sdHolder == me){ xSemaphoreTakeRecursive(sdMutex, portMAX_DELAY); sdDepth++; return true; }
+  // portMAX_DELAY stays a real wait; async_tcp passes it only as sdDispose's last resort.
+  bool net = me == sdNetTask && waitMs != portMAX_DELAY;
+  if(net) waitMs = 0;
+  uint32_t t0 = millis();
+  bool got = false;
+  sdWaiting[p]++;
+  for(;;){
+    if(!sdHigherWaiting(p)){
+      if(xSemaphoreTakeRecursive(sdMutex, net ? 0 : pdMS_TO_TICKS(2)) == pdTRUE){ got = true; break; }
+    } else if(!net){
+      vTaskDelay(1);
+    }
+    if(millis() - t0 >= waitMs) break;
+  }
+  sdWaiting[p]--;
+  if(got){ sdHolder = me; sdDepth = 1; }
+  return got;
+}
+static void sdRelease(){
+  if(--sdDepth == 0) sdHolder = nullptr;
+  xSemaphoreGiveRecursive(sdMutex);
+}
+
+struct SdLock {
+  SdPrio prio; bool held;
+  explicit SdLock(SdPrio p, uint32_t waitMs=2000) : prio(p), held(sdAcquire(p, waitMs)) {}
+  ~SdLock(){ if(held) sdRelease(); }
+  // true when the bus is ours and the card is mounted
+  explicit operator bool() const { return held && sdState == SD_MOUNTED; }
+  // Bulk readers call this between rows: steps aside if someone more urgent
+  // waits and takes the bus back. async_tcp can't wait for it, so there the bus
+  // is kept and false tells the caller to wind up (and close) and stop.
+  bool yieldToHigher(){
+    if(!held || sdDepth != 1 || !sdHigherWaiting(prio)) return true;
+    if(xTaskGetCurrentTaskHandle() == sdNetTask) return false;
+    sdRelease();
+    held = sdAcquire(prio, portMAX_DELAY);
+    return held;
+  }
+};
+
+// Runs a stream's teardown (file close + delete) under the bus. async_tcp only
+// tries once and otherwise queues it for storageTask; other tasks wait.
+static void sdDispose(SdCloseFn fn){
+  {
+    SdLock l(SD_PRIO_INTERACTIVE, xTaskGetCurrentTaskHandle() == sdNetTask ? 0 : portMAX_DELAY);
+    if(l.held){ fn(); return; }
+  }
+  SdCloseFn* p = new (std::nothrow) SdCloseFn(std::move(fn));
+  if(p && xQueueSend(sdCloseQ, &p, 0) == pdTRUE) return;
+  SdLock l(SD_PRIO_INTERACTIVE, portMAX_DELAY);   // queue full or no memory: better late than a leaked handle
+  if(p){ (*p)(); delete p; } else fn();
+}
+
+// Answer for a handler that found the bus taken or the card missing.
+static void sdBusy(AsyncWebServerRequest* req){
+  AsyncWebServerResponse* r = req->beginResponse(503, "text/plain", sdState == SD_MOUNTED ? "SD busy, retry shortly" : "SD not mounted");
+  r->addHeader("Retry-After", "1");
+  req->send(r);
+}
+
+static void sdFault(const char* where){
+  if(sdState != SD_MOUNTED) return;
+  sdState = SD_FAULTED; sdMounted = false; sdFaultCount++;
+  sdBackoffMs = 1000; sdNextRetryMs = millis() + sdBackoffMs;
+  Serial.printf("[SD] fault in %s, will remount\n", where);
+}
+
+// One mount attempt; caller holds the lock.
+static bool sdTryMount(){
+  SD.end();
+  if(SD.begin(SD_CS, SPI, 20000000) && SD.cardType() != CARD_NONE){
+    sdState = SD_MOUNTED; sdMounted = true; sdMountCount++; sdBackoffMs = 1000;
+    logOldestDay = 0;   // may be another card
+    Serial.println("SD mounted");
+    return true;
+  }
+  return false;
+}
 
 /* ====== Robust SD mount (retries) ====== */
 static void sd_mount_with_retries(uint8_t retries=5, uint32_t firstDelayMs=150, uint32_t betweenMs=200){
+  SdLock lk(SD_PRIO_INTERACTIVE, portMAX_DELAY);
   if (sdMounted) return;
   SPI.end();
   SPI.begin(18,19,23,SD_CS);
   delay(firstDelayMs);
   for (uint8_t i=0;i<retries && !sdMounted;i++){
-    if (SD.begin(SD_CS, SPI, 20000000)){
-      sdMounted = true;
-      Serial.println("SD mounted");
-      break;
-    }
+    if (sdTryMount()) break;
     Serial.printf("SD mount try %u failed\n", (unsigned)i+1);
     delay(betweenMs);
   }
-  if(!sdMounted) Serial.println("SD init failed");
+  if(!sdMounted){
+    Serial.println("SD init failed");
+    sdState = SD_FAULTED; sdNextRetryMs = millis() + sdBackoffMs;
+  }
+}
+
+// Background remount with backoff, plus a cheap periodic probe while mounted,
+// and the file closes async_tcp could not do itself (sdDispose).
+static void storageTask(void*){
+  uint32_t lastProbe = millis();
+  for(;;){
+    SdCloseFn* fn;
+    if(xQueueReceive(sdCloseQ, &fn, pdMS_TO_TICKS(500)) == pdTRUE){
+      SdLock l(SD_PRIO_INTERACTIVE, portMAX_DELAY);
+      do { (*fn)(); delete fn; } while(xQueueReceive(sdCloseQ, &fn, 0) == pdTRUE);
+    }
+    configCommitMaybe(false);
+    if(sdState == SD_FAULTED && (int32_t)(millis() - sdNextRetryMs) >= 0){
+      SdLock lk(SD_PRIO_BULK, 100);
+      if(lk.held && !sdTryMount()){
+        sdBackoffMs = min(sdBackoffMs * 2, SD_BACKOFF_MAX_MS);
+        sdNextRetryMs = millis() + sdBackoffMs;
+      }
+    } else if(sdState == SD_MOUNTED && millis() - lastProbe >= SD_PROBE_MS){
+      lastProbe = millis();
+      SdLock lk(SD_PRIO_BULK, 0);
+      if(lk){ File root = SD.open("/"); if(!root) sdFault("probe"); else root.close(); }
+    }
+  }
+}
+
+/* ===================== Block-buffered SD reader ===================== */
+// Pulls the file in SD_READ_BLOCK-sized reads at block-aligned offsets into a
+// DMA-capable buffer, so FATFS can transfer whole sectors straight into it
+// instead of going through the Stream byte path. The line splitting lives in
+// block_reader.h (shared with tools/reader_bench.cpp); this adds the buffer
+// pool, the File source and the read timing.
+// Callers hold an SdLock around refills (next()/read()/seek()).
+static const size_t  SD_READ_BLOCK  = BLOCK_READ_SIZE;
+static const size_t  SD_READER_MEM  = BLOCK_READER_MEM;
+static const uint8_t SD_READER_POOL = 2;
+static uint8_t* sdReaderBufs[SD_READER_POOL];
+static bool     sdReaderBusy[SD_READER_POOL];
+static portMUX_TYPE sdReaderMux = portMUX_INITIALIZER_UNLOCKED;
+static std::atomic<uint32_t> sdReadBytes{0}, sdReadUs{0};
+
+static void sdReaderInit(){
+  for(auto& b : sdReaderBufs) b = (uint8_t*)heap_caps_malloc(SD_READER_MEM, MALLOC_CAP_DMA|MALLOC_CAP_8BIT);
+  mSdBlockRead.label = "sd_block_read";
+}
+
+// A pooled buffer, else a fresh DMA allocation.
+struct SdReaderBuf {
+  uint8_t* mem = nullptr;
+  int8_t   slot = -1;
+  SdReaderBuf(){
+    portENTER_CRITICAL(&sdReaderMux);
+    for(uint8_t i=0;i<SD_READER_POOL;i++){
+      if(sdReaderBufs[i] && !sdReaderBusy[i]){ sdReaderBusy[i] = true; slot = i; mem = sdReaderBufs[i]; break; }
+    }
+    portEXIT_CRITICAL(&sdReaderMux);
+    if(!mem) mem = (uint8_t*)heap_caps_malloc(SD_READER_MEM, MALLOC_CAP_DMA|MALLOC_CAP_8BIT);
+  }
+  ~SdReaderBuf(){
+    if(slot >= 0){ portENTER_CRITICAL(&sdReaderMux); sdReaderBusy[slot] = false; portEXIT_CRITICAL(&sdReaderMux); }
+    else if(mem) heap_caps_free(mem);
+  }
+};
+struct SdFileSrc {
+  File& f;
+  int read(uint8_t* dst, size_t n){
+    TRACE_SCOPE("sd_block_read");
+    uint32_t t0 = micros();
+    int got = f.read(dst, n);
+    uint32_t dt = micros() - t0;
+    mSdBlockRead.observe(dt);
+    if(got > 0) sdReadBytes.fetch_add(got, std::memory_order_relaxed);
+    sdReadUs.fetch_add(dt, std::memory_order_relaxed);
+    return got;
+  }
+  bool seek(uint32_t off){ return f.seek(off); }
+};
+
+class SdBlockReader : SdReaderBuf, SdFileSrc, public BlockLineReader<SdFileSrc> {
+public:
+  explicit SdBlockReader(File& file)
+    : SdFileSrc{file}, BlockLineReader<SdFileSrc>(*this, SdReaderBuf::mem, file ? file.position() : 0) {}
+  explicit operator bool() const { return SdReaderBuf::mem && f; }
+  using BlockLineReader<SdFileSrc>::read;
+  using BlockLineReader<SdFileSrc>::seek;
+};
+
+// Streams a file to the client through a block reader, taking the bus at bulk
+// priority only when a new block is needed; the file stays open across chunks
+// and closes with the response.
+struct SdStream { File f; SdBlockReader rd; explicit SdStream(File file) : f(file), rd(f) {} };
+static void sdStreamFile(AsyncWebServerRequest* req, const String& path, const char* contentType, const char* downloadName){
+  size_t size = 0;
+  std::shared_ptr<SdStream> st;
+  {
+    SdLock lk(SD_PRIO_INTERACTIVE);
+    if(!lk){ sdBusy(req); return; }
+    if(!SD.exists(path)){ req->send(404, "text/plain", "Not found"); return; }
+    File f = SD.open(path, "r");
+    if(!f){ req->send(500, "text/plain", "Open failed"); return; }
+    size = f.size();
+    // close under the bus lock too when the client goes away mid-transfer
+    st = std::shared_ptr<SdStream>(new SdStream(f), [](SdStream* p){ sdDispose([p]{ p->f.close(); delete p; }); });
+  }
+  AsyncWebServerResponse* res = req->beginResponse(contentType, size,
+    [st](uint8_t* buf, size_t maxLen, size_t) -> size_t {
+      if(st->rd.buffered()) return st->rd.read(buf, maxLen);   // no bus needed
+      SdLock lk(SD_PRIO_BULK, 50);
+      if(!lk.held) return RESPONSE_TRY_AGAIN;   // bus busy: AsyncTCP asks again
+      if(!lk) return 0;
+      return st->rd.read(buf, maxLen);
+    });
+  if(downloadName){
+    String cd = "attachment; filename=\""; cd += downloadName; cd += "\"";
+    res->addHeader("Content-Disposition", cd);
+  }
+  req->send(res);
 }
 
 /* ===================== Config load/save ===================== */
-bool loadConfig(){
-  if(!SD.begin(SD_CS)) { Serial.println("[SD] begin failed in loadConfig"); return false; }
-  if(!fileExists(SD, "/config.csv")){
-    File f = SD.open("/config.csv","w");
-    if(!f) return false;
-    f.printf("username,password,budget_kwh,show_usage_graph,show_prio_status,show_prio_controls\n");
-    f.printf("%s,%s,%.3f,%d,%d,%d\n",
-      appcfg.username.c_str(), appcfg.password.c_str(), appcfg.budget_kwh,
-      appcfg.show_usage_graph?1:0, appcfg.show_prio_status?1:0, appcfg.show_prio_controls?1:0);
-    f.close();
-    return true;
+// appcfg in RAM is the live config. Handlers change it and call
+// configChanged(), which only encodes a ConfigRecord and stamps it dirty;
+// storageTask commits it to NVS once no change has come for CONFIG_SETTLE_MS,
+// so a burst of slider updates costs one flash write, off the network task.
+// /config.csv on the card is a view: rewritten after each commit, and read
+// back only when NVS holds no valid record (first boot, or migrating an
+// older unit) or on POST /api/config/import.
+static const uint16_t CONFIG_MAGIC     = 0x4643;   // "CF"
+static const uint8_t  CONFIG_VERSION   = 1;
+static const uint32_t CONFIG_SETTLE_MS = 1500;
+
+struct __attribute__((packed)) ConfigRecord {
+  uint16_t magic;
+  uint8_t  version;
+  uint8_t  flags;          // bit0 usage graph, 1 prio status, 2 prio controls, 3 pq_log
+  uint16_t size;           // sizeof(ConfigRecord) when written
+  uint16_t mqtt_port;
+  uint32_t seq;
+  float    budget_kwh;
+  char     username[32];
+  char     password[32];
+  char     mqtt_host[64];
+  uint32_t crc;            // over everything above
+};
+static ConfigRecord      cfgPending;            // newest encoded change
+static volatile uint32_t cfgDirtyMs = 0;        // when it was made, 0 = committed
+static volatile bool     cfgExportPending = false;
+static std::atomic<uint32_t> cfgSeq{0};
+static portMUX_TYPE      cfgMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void configEncode(ConfigRecord& r){
+  memset(&r, 0, sizeof(r));
+  r.magic = CONFIG_MAGIC; r.version = CONFIG_VERSION; r.size = sizeof(r);
+  r.flags = (appcfg.show_usage_graph ? 1 : 0) | (appcfg.show_prio_status ? 2 : 0)
+          | (appcfg.show_prio_controls ? 4 : 0) | (appcfg.pq_log ? 8 : 0);
+  r.mqtt_port  = appcfg.mqtt_port;
+  r.budget_kwh = appcfg.budget_kwh;
+  strlcpy(r.username,  appcfg.username.c_str(),  sizeof(r.username));
+  strlcpy(r.password,  appcfg.password.c_str(),  sizeof(r.password));
+  strlcpy(r.mqtt_host, appcfg.mqtt_host.c_str(), sizeof(r.mqtt_host));
+  r.seq = ++cfgSeq;
+  r.crc = crc32(&r, offsetof(ConfigRecord, crc));
+}
+static bool configRecordValid(const ConfigRecord& r){
+  return r.magic == CONFIG_MAGIC && r.version == CONFIG_VERSION && r.size == sizeof(r)
+      && r.crc == crc32(&r, offsetof(ConfigRecord, crc));
+}
+// The broker as the MQTT client in loop() sees it. Config changes arrive on
+// async_tcp, so it crosses over as a copy under its own mux rather than as
+// appcfg.mqtt_host (a String); `gen` moves on every host or port change.
+struct MqttBroker { char host[64]; uint16_t port; uint32_t gen; };
+static MqttBroker   mqBroker = {};
+static portMUX_TYPE mqBrokerMux = portMUX_INITIALIZER_UNLOCKED;
+static void mqttBrokerSet(const char* host, uint16_t port){
+  portENTER_CRITICAL(&mqBrokerMux);
+  if (strncmp(mqBroker.host, host, sizeof(mqBroker.host) - 1) || mqBroker.port != port){
+    strlcpy(mqBroker.host, host, sizeof(mqBroker.host));
+    mqBroker.port = port; mqBroker.gen++;
+  }
+  portEXIT_CRITICAL(&mqBrokerMux);
+}
+static void mqttBrokerGet(MqttBroker& b){
+  portENTER_CRITICAL(&mqBrokerMux);
+  b = mqBroker;
+  portEXIT_CRITICAL(&mqBrokerMux);
+}
+
+static void configApply(const ConfigRecord& r){
+  appcfg.username  = r.username;
+  appcfg.password  = r.password;
+  appcfg.mqtt_host = r.mqtt_host;
+  appcfg.budget_kwh = r.budget_kwh;
+  appcfg.show_usage_graph   = r.flags & 1;
+  appcfg.show_prio_status   = r.flags & 2;
+  appcfg.show_prio_controls = r.flags & 4;
+  appcfg.pq_log             = r.flags & 8;
+  appcfg.mqtt_port = r.mqtt_port ? r.mqtt_port : 1883;
+  budgetKWh = appcfg.budget_kwh;
+  currentStatus.budget = budgetKWh;
+  mqttBrokerSet(r.mqtt_host, appcfg.mqtt_port);
+}
+
+// Call after changing appcfg; cheap enough for an AsyncTCP callback.
+void configChanged(){
+  ConfigRecord r;
+  configEncode(r);
+  mqttBrokerSet(r.mqtt_host, r.mqtt_port);
+  portENTER_CRITICAL(&cfgMux);
+  cfgPending = r;
+  cfgDirtyMs = millis() | 1;
+  portEXIT_CRITICAL(&cfgMux);
+  configChanges++;
+}
+
+static void writeConfigCsv(File& f, const ConfigRecord& r){
+  f.printf("username,password,budget_kwh,show_usage_graph,show_prio_status,show_prio_controls,pq_log,mqtt_host,mqtt_port\n");
+  f.printf("%.31s,%.31s,%.3f,%d,%d,%d,%d,%.63s,%u\n",
+    r.username, r.password, r.budget_kwh,
+    (r.flags & 1) ? 1 : 0, (r.flags & 2) ? 1 : 0, (r.flags & 4) ? 1 : 0, (r.flags & 8) ? 1 : 0,
+    r.mqtt_host, (unsigned)r.mqtt_port);
+}
+// Export view; skipped (and retried later) while the bus is busy or no card.
+static bool configExportCsv(const ConfigRecord& r){
+  SdLock lk(SD_PRIO_BULK, 100);
+  if(!lk) return false;
+  File f = SD.open("/config.csv","w");
+  if(!f){ sdFault("configExportCsv"); return false; }
+  writeConfigCsv(f, r);
+  f.close();
+  return true;
+}
+
+static bool configLoadNvs(){
+  Preferences p;
+  if(!p.begin("cfg", true)) return false;
+  ConfigRecord r;
+  bool ok = p.getBytesLength("rec") == sizeof(r) && p.getBytes("rec", &r, sizeof(r)) == sizeof(r) && configRecordValid(r);
+  p.end();
+  if(!ok) return false;
+  r.username[sizeof(r.username) - 1] = r.password[sizeof(r.password) - 1] = r.mqtt_host[sizeof(r.mqtt_host) - 1] = 0;
+  cfgSeq = r.seq;
+  configApply(r);
+  return true;
+}
+
+// storageTask, every tick: commits the pending record once changes settle
+// (`force` skips the wait, e.g. before a restart).
+static void configCommitMaybe(bool force){
+  uint32_t dirty = cfgDirtyMs;
+  if(dirty && (force || millis() - dirty >= CONFIG_SETTLE_MS)){
+    ConfigRecord r;
+    portENTER_CRITICAL(&cfgMux);
+    bool settled = cfgDirtyMs == dirty;
+    if(settled){ r = cfgPending; cfgDirtyMs = 0; }
+    portEXIT_CRITICAL(&cfgMux);
+    if(!settled) return;   // changed again meanwhile
+    Preferences p;
+    bool ok = p.begin("cfg", false) && p.putBytes("rec", &r, sizeof(r)) == sizeof(r);
+    p.end();
+    if(!ok){
+      portENTER_CRITICAL(&cfgMux);
+      if(!cfgDirtyMs) cfgDirtyMs = millis() | 1;   // try again after another settle
+      portEXIT_CRITICAL(&cfgMux);
+      Serial.println("[CFG] NVS write failed, will retry");
+      return;
+    }
+    configCommits++;
+    cfgExportPending = true;
+  }
+  if(cfgExportPending && sdState == SD_MOUNTED){
+    ConfigRecord r;
+    portENTER_CRITICAL(&cfgMux);
+    r = cfgPending;
+    portEXIT_CRITICAL(&cfgMux);
+    if(configExportCsv(r)) cfgExportPending = false;
   }
+}
+
+// Reads /config.csv into appcfg and stages it for NVS. Missing file: the
+// current (default) config is staged instead, which also writes the file.
+bool configImportCsv(){
+  SdLock lk(SD_PRIO_INTERACTIVE);
+  if(!lk) { Serial.println("[SD] not mounted in configImportCsv"); return false; }
+  if(!fileExists(SD, "/config.csv")){ configChanged(); return true; }
   File f = SD.open("/config.csv","r");
   if(!f) return false;
-  String header = f.readStringUntil('\n');
-  String line   = f.readStringUntil('\n');
+  f.readStringUntil('\n');   // header
+  String line = f.readStringUntil('\n');
   f.close();
   if(line.length()==0) return false;
 
-  int idx=0; String parts[6]; int start=0;
+  int idx=0; String parts[9]; int start=0;
   for(int i=0;i<line.length();++i){
     if(line[i]==',' || i==line.length()-1){
       int end = (i==line.length()-1)? i+1 : i;
       parts[idx++] = line.substring(start,end);
-      start = i+1; if(idx>=6) break;
+      start = i+1; if(idx>=9) break;
     }
   }
-  if(idx<6) return false;
+  if(idx<6) return false;   // older files lack the trailing columns
 
   appcfg.username = parts[0];
   appcfg.password = parts[1];
@@ -177,23 +750,16 @@ bool loadConfig(){
   appcfg.show_usage_graph = parts[3].toInt()!=0;
   appcfg.show_prio_status = parts[4].toInt()!=0;
   appcfg.show_prio_controls = parts[5].toInt()!=0;
+  appcfg.pq_log = idx>6 && parts[6].toInt()!=0;
+  if(idx>7) { appcfg.mqtt_host = parts[7]; appcfg.mqtt_host.trim(); }
+  if(idx>8 && parts[8].toInt()>0) appcfg.mqtt_port = (uint16_t)parts[8].toInt();
 
   budgetKWh = appcfg.budget_kwh;
   currentStatus.budget = budgetKWh;
+  configChanged();
   return true;
 }
 
-void persistConfig(){
-  if(!SD.begin(SD_CS)) return;
-  File f = SD.open("/config.csv","w");
-  if(!f) return;
-  f.printf("username,password,budget_kwh,show_usage_graph,show_prio_status,show_prio_controls\n");
-  f.printf("%s,%s,%.3f,%d,%d,%d\n",
-    appcfg.username.c_str(), appcfg.password.c_str(), appcfg.budget_kwh,
-    appcfg.show_usage_graph?1:0, appcfg.show_prio_status?1:0, appcfg.show_prio_controls?1:0);
-  f.close();
-}
-
 /* ===================== Time / NTP / RTC ===================== */
 bool rtcReady=false;
 bool ntpSynced=false;
@@ -205,14 +771,68 @@ String ampmStr(int h24){ return (h24<12)?"AM":"PM"; }
 // Quick, non-blocking NTP (<= 1s)
 bool syncNTP_quick(){
   configTime(8*3600, 0, "pool.ntp.org", "time.nist.gov"); // Asia/Manila
-  for(int i=0;i<5;i++){ struct tm t; if(getLocalTime(&t)) return true; delay(200); }
+  for(int i=0;i<5;i++){ struct tm t; if(getLocalTime(&t, 0)) return true; delay(200); }
   return false;
 }
-DateTime nowLocal(){
+
+/* ====== Wall clock: esp_timer + offset, disciplined from RTC/NTP ====== */
+// Reading the time never touches I2C or the SNTP client: local wall time is
+// esp_timer microseconds plus an offset that is set from the DS3231 at boot
+// (or NTP when available) and re-checked against the RTC every few minutes.
+// Returned time never goes backwards by less than CLOCK_STEP_BACK_S; such
+// corrections are absorbed by holding the clock until it catches up.
+// "Epoch" here is local-time seconds, the same convention as DateTime/CSV.
+static const uint32_t CLOCK_FALLBACK_EPOCH = 1735689600UL;   // 2025-01-01 00:00:00
+static const uint32_t CLOCK_RESYNC_MS      = 10UL * 60UL * 1000UL;
+static const int32_t  CLOCK_STEP_BACK_S    = 60;
+static int64_t  clockOffsetUs = (int64_t)CLOCK_FALLBACK_EPOCH * 1000000LL;
+static int64_t  clockLastUs   = 0;
+static bool     clockSynced   = false;
+static uint32_t clockLastResyncMs = 0;
+static portMUX_TYPE clockMux = portMUX_INITIALIZER_UNLOCKED;
+
+// The 64-bit offset is only read or written under clockMux: a torn read on the
+// 32-bit core could jump clockLastUs far ahead and freeze the clock.
+static int64_t clockNowUs(){
+  portENTER_CRITICAL(&clockMux);
+  int64_t t = esp_timer_get_time() + clockOffsetUs;
+  if(t < clockLastUs) t = clockLastUs; else clockLastUs = t;
+  portEXIT_CRITICAL(&clockMux);
+  return t;
+}
+uint32_t clockEpoch(){ return (uint32_t)(clockNowUs() / 1000000LL); }
+
+static void clockSetEpoch(uint32_t epoch, const char* src){
+  int64_t target = (int64_t)epoch * 1000000LL;
+  portENTER_CRITICAL(&clockMux);
+  int64_t errUs  = target - (esp_timer_get_time() + clockOffsetUs);
+  // RTC/NTP second boundaries are unknown, so ignore sub-second disagreement
+  if(clockSynced && llabs(errUs) < 1000000LL){ portEXIT_CRITICAL(&clockMux); return; }
+  clockOffsetUs = target - esp_timer_get_time();
+  if(errUs < -(int64_t)CLOCK_STEP_BACK_S * 1000000LL) clockLastUs = 0;  // real reset, not drift
+  portEXIT_CRITICAL(&clockMux);
+  if(clockSynced) Serial.printf("[CLOCK] %s step %+lld ms\n", src, (long long)(errUs / 1000));
+  clockSynced = true;
+}
+static void clockSyncFromRtc(){
+  if(!rtcReady) return;
+  DateTime r = rtc.now();
+  if(r.isValid() && r.year() >= 2024) clockSetEpoch(r.unixtime(), "rtc");
+  clockLastResyncMs = millis();
+}
+static void clockSyncFromNtp(){
   struct tm tt;
-  if(getLocalTime(&tt)){ return DateTime(1900+tt.tm_year, 1+tt.tm_mon, tt.tm_mday, tt.tm_hour, tt.tm_min, tt.tm_sec); }
-  if(rtcReady) return rtc.now();
-  return DateTime(2025,1,1,0,0,0);
+  if(!getLocalTime(&tt, 0)) return;
+  DateTime dt(1900+tt.tm_year, 1+tt.tm_mon, tt.tm_mday, tt.tm_hour, tt.tm_min, tt.tm_sec);
+  clockSetEpoch(dt.unixtime(), "ntp");
+}
+// loop(): periodic RTC discipline (one I2C read every CLOCK_RESYNC_MS)
+static void clockMaintain(){
+  if(rtcReady && millis() - clockLastResyncMs >= CLOCK_RESYNC_MS) clockSyncFromRtc();
+}
+
+DateTime nowLocal(){
+  return DateTime(clockEpoch());
 }
 
 /* ===================== Logging to CSV (SD) ===================== */
@@ -225,11 +845,12 @@ String makeLogName(const DateTime& dt){
   String hh = ampmHour(dt.hour());
   return "/logs_" + y + m + d + "_" + hh + "_" + ap + ".csv";
 }
+// Caller holds an SdLock.
 File openLogFile(const String& name, bool &created){
-  created=false; if(!SD.begin(SD_CS)) return File();
+  created=false;
   bool exists = fileExists(SD, name.c_str());
   File f = SD.open(name.c_str(), exists ? "a" : "w");
-  if(!f) return File();
+  if(!f){ sdFault("openLogFile"); return File(); }
   if(!exists){ created=true; f.println("timestamp,budget_kwh,remaining_kwh,used_kwh"); }
   return f;
 }
@@ -237,8 +858,10 @@ double lastLoggedUsed=-1,lastLoggedRem=-1,lastLoggedBudget=-1;
 const double LOG_EPS=0.0005;
 bool significantlyDiff(double a, double b){ if(a<0||b<0) return true; return fabs(a-b)>LOG_EPS; }
 bool forceLogNext = false;
+static int64_t bootToFirstLogUs = 0;   // esp_timer at the first row written
 
 void appendLogMaybe(){
+  TRACE_SCOPE("append_log_maybe");
   if(paused && !forceLogNext) return;
 
   DateTime dt=nowLocal();
@@ -256,7 +879,15 @@ void appendLogMaybe(){
 
   if(!changed) return;
 
+  // never stall the control loop on the bus: retry next tick if it is busy
+  SdLock lk(SD_PRIO_CONTROL, 20);
+  if(!lk) return;
+  ScopedTimer tm(mLogWrite);
   bool created=false; File f=openLogFile(currentLogName,created); if(!f) return;
+  if(!bootToFirstLogUs){
+    bootToFirstLogUs = esp_timer_get_time();
+    Serial.printf("[CLOCK] boot -> first log row: %lld ms\n", (long long)(bootToFirstLogUs / 1000));
+  }
   String ts = String(dt.year())+"-"+two(dt.month())+"-"+two(dt.day())+" "+two(dt.hour())+":"+two(dt.minute())+":"+two(dt.second());
   f.printf("%s,%.6f,%.6f,%.6f\n", ts.c_str(), (double)budgetKWh, (double)currentStatus.remKWh, (double)currentStatus.usedKWh);
   f.close();
@@ -267,40 +898,147 @@ void appendLogMaybe(){
   forceLogNext = false;
 }
 
-/* ===================== Pause snapshot on LittleFS ===================== */
+/* ===================== Pause snapshot (LittleFS journal) ===================== */
 double frozenUsed = 0.0;
 double frozenRem  = 0.004;
 float  frozenPct  = 100.0f;
 
+// Fixed-size, CRC-checked records appended to /state.jrnl. A torn or corrupt
+// tail just fails its CRC; restore takes the valid record with the highest
+// seq, budget included. Once the file reaches STATE_JRNL_MAX records it is compacted to the
+// newest one via write-tmp + rename, which LittleFS performs atomically.
+// Only loop() appends; other tasks ask for a save through snapshotDueMs.
+static const char*    STATE_JRNL      = "/state.jrnl";
+static const char*    STATE_JRNL_TMP  = "/state.jrnl.tmp";
+static const uint16_t STATE_MAGIC     = 0x5354;   // "ST"
+static const uint8_t  STATE_VERSION   = 1;
+static const uint16_t STATE_JRNL_MAX  = 512;      // ~20 KB before compaction
+// While running only used/remaining move; the baseline does not, and after a
+// power cut the meter's own counter gives `used` back from it. So the running
+// copy goes to flash once a minute (~1.4k tail-block rewrites a day on a
+// 112-block partition, not ~17k), and the RTC checkpoint, written every tick,
+// covers warm resets in between.
+static const uint32_t STATE_CHECKPOINT_MS = 60000; // while running
+
+struct __attribute__((packed)) StateRecord {
+  uint16_t magic;
+  uint8_t  version;
+  uint8_t  reserved;   // was `paused`; boot always comes up paused, so it is not kept
+  uint32_t seq;
+  double   baseline;
+  double   used;
+  double   rem;
+  float    pct;
+  float    budget;
+  uint32_t crc;        // over everything above
+};
+static uint32_t stateSeq = 0;
+static uint16_t stateJrnlCount = 0;
+
+static bool stateRecordValid(const StateRecord& r){
+  return r.magic==STATE_MAGIC && r.version==STATE_VERSION
+      && r.crc==crc32(&r, offsetof(StateRecord, crc));
+}
+
+static bool stateJournalCompact(const StateRecord& newest){
+  File f = LittleFS.open(STATE_JRNL_TMP, "w");
+  if(!f) return false;
+  bool ok = f.write((const uint8_t*)&newest, sizeof(newest)) == sizeof(newest);
+  f.close();
+  if(!ok || !LittleFS.rename(STATE_JRNL_TMP, STATE_JRNL)) return false;
+  stateJrnlCount = 1;
+  return true;
+}
+
 void savePauseSnapshot(){
   if(!littlefsMounted) return;
-  JsonDocument d;
-  d["paused"]       = paused;
-  d["usedKWh"]      = frozenUsed;
-  d["remKWh"]       = frozenRem;
-  d["pct"]          = frozenPct;
-  d["budget"]       = budgetKWh;
-  d["baseline_kwh"] = energyBaseline;
-  File f = LittleFS.open("/state.json","w");
-  if(f){ serializeJson(d,f); f.close(); }
+  TRACE_SCOPE("save_pause_snapshot");
+  ScopedTimer tm(mSnapshotSave);
+  StateRecord r;
+  r.magic    = STATE_MAGIC;
+  r.version  = STATE_VERSION;
+  r.reserved = 0;
+  r.seq      = ++stateSeq;
+  r.baseline = energyBaseline;
+  r.used     = frozenUsed;
+  r.rem      = frozenRem;
+  r.pct      = frozenPct;
+  r.budget   = budgetKWh;
+  r.crc      = crc32(&r, offsetof(StateRecord, crc));
+
+  if(stateJrnlCount >= STATE_JRNL_MAX){ if(stateJournalCompact(r)) return; }
+  File f = LittleFS.open(STATE_JRNL, "a");
+  if(!f) return;
+  if(f.write((const uint8_t*)&r, sizeof(r)) == sizeof(r)) stateJrnlCount++;
+  f.close();
 }
 
-bool loadPauseSnapshot(){
-  if(!littlefsMounted) return false;
-  if(!LittleFS.exists("/state.json"))    return false;
+// Scans the journal; fills `out` with the newest valid record.
+static bool stateJournalNewest(StateRecord& out){
+  File f = LittleFS.open(STATE_JRNL, "r");
+  if(!f) return false;
+  size_t size = f.size();
+  bool found = false; uint16_t n = 0;
+  StateRecord r;
+  while(f.read((uint8_t*)&r, sizeof(r)) == sizeof(r)){
+    n++;
+    if(!stateRecordValid(r)) continue;
+    if(!found || (int32_t)(r.seq - out.seq) > 0){ out = r; found = true; }
+  }
+  f.close();
+  stateJrnlCount = n;
+  // A torn tail (size not a record multiple) would misalign every later
+  // append: keep only the newest record, or start clean if none was valid.
+  if(size % sizeof(StateRecord)){
+    if(found) stateJournalCompact(out);
+    else { LittleFS.remove(STATE_JRNL); stateJrnlCount = 0; }
+  }
+  return found;
+}
+
+// Pre-journal firmware kept one JSON document; read it once so an upgrade
+// does not lose the last state.
+static bool loadLegacyStateJson(){
+  if(!LittleFS.exists("/state.json")) return false;
   File f = LittleFS.open("/state.json","r");
   if(!f) return false;
   JsonDocument d;
   DeserializationError e = deserializeJson(d,f);
   f.close();
   if(e) return false;
-
   energyBaseline = d["baseline_kwh"] | 0.0;
   baselineFromSnapshot = d["baseline_kwh"].is<double>();  // ArduinoJson v7 style
-
   frozenUsed = d["usedKWh"] | 0.0;
   frozenRem  = d["remKWh"]  | budgetKWh;
   frozenPct  = d["pct"]     | 100.0f;
+  LittleFS.remove("/state.json");
+  return true;
+}
+
+// Called right after LittleFS mounts so new records continue the sequence
+// even when state ends up being restored from somewhere else.
+static void stateJournalInit(){
+  StateRecord r;
+  if(stateJournalNewest(r)) stateSeq = r.seq;
+}
+
+bool loadPauseSnapshot(){
+  if(!littlefsMounted) return false;
+  StateRecord r;
+  if(stateJournalNewest(r)){
+    energyBaseline = r.baseline;
+    baselineFromSnapshot = true;
+    frozenUsed = r.used;
+    frozenRem  = r.rem;
+    frozenPct  = r.pct;
+    if(r.budget > 0.0f){
+      budgetKWh  = r.budget;
+      appcfg.budget_kwh    = budgetKWh;
+      currentStatus.budget = budgetKWh;
+    }
+  } else if(!loadLegacyStateJson()){
+    return false;
+  }
 
   paused = true;
   Serial.printf("[STATE] restored: budget=%.6f rem=%.6f used=%.6f (%.1f%%)\n",
@@ -308,6 +1046,88 @@ bool loadPauseSnapshot(){
   return true;
 }
 
+/* ===================== Warm-reset checkpoint (RTC slow memory) ===================== */
+// Written every control tick into RTC_NOINIT memory, which survives software,
+// panic and watchdog resets (not power loss). Two slots alternate so a reset
+// in the middle of a write still leaves the previous one intact; the CRC and
+// generation pick the newest good slot. journalSeq ties it to /state.jrnl so
+// boot can tell which tier is fresher.
+static const uint32_t RTC_CK_MAGIC = 0x524B4331;  // "RKC1"
+struct RtcCheckpoint {
+  uint32_t magic;
+  uint32_t gen;
+  uint32_t journalSeq;   // stateSeq when this was written
+  double   baseline;
+  double   softAccum;
+  double   lastGood;
+  double   used;
+  double   rem;
+  float    pct;
+  float    budget;
+  uint8_t  paused;
+  uint8_t  haveLastGood;
+  uint8_t  zone;
+  uint8_t  pad;
+  uint32_t crc;
+};
+RTC_NOINIT_ATTR static RtcCheckpoint rtcCk[2];
+static uint32_t rtcCkGen = 0;
+
+static bool rtcCheckpointValid(const RtcCheckpoint& c){
+  return c.magic==RTC_CK_MAGIC && c.crc==crc32(&c, offsetof(RtcCheckpoint, crc));
+}
+static void rtcCheckpoint(){
+  RtcCheckpoint& c = rtcCk[(rtcCkGen + 1) & 1];
+  c.magic        = RTC_CK_MAGIC;
+  c.gen          = rtcCkGen + 1;
+  c.journalSeq   = stateSeq;
+  c.baseline     = energyBaseline;
+  c.softAccum    = softAccumKWh;
+  c.lastGood     = lastGoodTotal;
+  c.used         = frozenUsed;
+  c.rem          = frozenRem;
+  c.pct          = frozenPct;
+  c.budget       = budgetKWh;
+  c.paused       = paused ? 1 : 0;
+  c.haveLastGood = haveLastGood ? 1 : 0;
+  c.zone         = (uint8_t)currentZone;
+  c.pad          = 0;
+  c.crc          = crc32(&c, offsetof(RtcCheckpoint, crc));
+  rtcCkGen++;
+}
+// Restores from RTC memory after a warm reset, if that copy is at least as new
+// as the flash journal. Returns false on cold boot or when flash is fresher.
+static bool loadRtcCheckpoint(){
+  esp_reset_reason_t why = esp_reset_reason();
+  if(why == ESP_RST_POWERON || why == ESP_RST_UNKNOWN) return false;
+  const RtcCheckpoint* best = nullptr;
+  for(auto& c : rtcCk){
+    if(rtcCheckpointValid(c) && (!best || (int32_t)(c.gen - best->gen) > 0)) best = &c;
+  }
+  if(!best) return false;
+  if((int32_t)(best->journalSeq - stateSeq) < 0){
+    Serial.println("[RTC-CK] older than flash journal, ignored");
+    return false;
+  }
+  rtcCkGen       = best->gen;
+  energyBaseline = best->baseline;
+  softAccumKWh   = best->softAccum;
+  lastGoodTotal  = best->lastGood;
+  haveLastGood   = best->haveLastGood != 0;
+  frozenUsed     = best->used;
+  frozenRem      = best->rem;
+  frozenPct      = best->pct;
+  budgetKWh      = best->budget;
+  appcfg.budget_kwh    = budgetKWh;
+  currentStatus.budget = budgetKWh;
+  currentZone    = (Zone)best->zone;
+  baselineFromSnapshot = true;
+  paused = true;
+  Serial.printf("[RTC-CK] warm restore gen=%u reason=%d: rem=%.6f used=%.6f (%.1f%%)\n",
+                (unsigned)best->gen, (int)why, frozenRem, frozenUsed, (double)frozenPct);
+  return true;
+}
+
 /* ===================== CSV restore (FIXED) ===================== */
 static bool isLogCsvName(String nm){
   String low = nm; low.toLowerCase();
@@ -319,7 +1139,8 @@ static String ensureLeadingSlash(String nm){
   return nm;
 }
 static String findLatestLogCsv(){
-  if(!SD.begin(SD_CS)) { Serial.println("[SD] begin failed in findLatestLogCsv"); return ""; }
+  SdLock lk(SD_PRIO_INTERACTIVE);
+  if(!lk) { Serial.println("[SD] not mounted in findLatestLogCsv"); return ""; }
   File root = SD.open("/");
   if(!root || !root.isDirectory()) { Serial.println("[CSV] root open failed"); return ""; }
   String latest = "";
@@ -330,7 +1151,7 @@ static String findLatestLogCsv(){
       String nm = String(f.name());
       if(isLogCsvName(nm)){
         nm = ensureLeadingSlash(nm);
-        if(latest == "" || nm > latest) latest = nm;
+        if(latest == "" || logFileKey(nm) > logFileKey(latest)) latest = nm;
       }
     }
     f.close();
@@ -341,32 +1162,44 @@ static String findLatestLogCsv(){
   return latest;
 }
 static bool loadSnapshotFromCsv(){
-  if(!SD.begin(SD_CS)) { Serial.println("[SD] begin failed in loadSnapshotFromCsv"); return false; }
+  SdLock lk(SD_PRIO_INTERACTIVE);
+  if(!lk) { Serial.println("[SD] not mounted in loadSnapshotFromCsv"); return false; }
   String csv = findLatestLogCsv();
-  if(csv == "") return false;
+  float b, rem, used;
+  if(csv == ""){
+    // every closed day may already be compacted: fall back to the newest archive
+    double ab, ar, au;
+    if(!latestArchivedRow(ab, ar, au)) return false;
+    b = ab; rem = ar; used = au;
+  } else {
+    File f = SD.open(csv, "r");
+    if(!f){ Serial.println("[CSV] open failed"); return false; }
+
+    // Only the last row matters: read just the final block (rows are short).
+    char lastLine[96] = "";
+    {
+      SdBlockReader rd(f);
+      size_t sz = f.size();
+      if(sz > SD_READ_BLOCK) rd.seek(sz - SD_READ_BLOCK / 2);
+      size_t len;
+      while(const char* line = rd.next(&len)){
+        if(len==0 || len >= sizeof(lastLine)) continue;
+        if(!strncmp(line, "timestamp", 9)) continue;
+        memcpy(lastLine, line, len + 1);
+      }
+    }
+    f.close();
+    if(!lastLine[0]){ Serial.println("[CSV] empty file"); return false; }
 
-  File f = SD.open(csv, "r");
-  if(!f){ Serial.println("[CSV] open failed"); return false; }
+    // timestamp,budget_kwh,remaining_kwh,used_kwh
+    const char* c1 = strchr(lastLine, ','); if(!c1) return false;
+    const char* c2 = strchr(c1+1, ',');     if(!c2) return false;
+    const char* c3 = strchr(c2+1, ',');     if(!c3) return false;
 
-  String lastLine = "";
-  while (f.available()){
-    String line = f.readStringUntil('\n');
-    line.trim();
-    if(line.length()==0) continue;
-    if(line.startsWith("timestamp")) continue;
-    lastLine = line;
+    b    = strtof(c1+1, nullptr);
+    rem  = strtof(c2+1, nullptr);
+    used = strtof(c3+1, nullptr);
   }
-  f.close();
-  if(lastLine==""){ Serial.println("[CSV] empty file"); return false; }
-
-  // timestamp,budget_kwh,remaining_kwh,used_kwh
-  int c1 = lastLine.indexOf(','); if(c1<0) return false;
-  int c2 = lastLine.indexOf(',', c1+1); if(c2<0) return false;
-  int c3 = lastLine.indexOf(',', c2+1); if(c3<0) return false;
-
-  float b   = lastLine.substring(c1+1, c2).toFloat();
-  float rem = lastLine.substring(c2+1, c3).toFloat();
-  float used= lastLine.substring(c3+1).toFloat();
   if(!(b>0.0f)) { Serial.println("[CSV] invalid budget in last line"); return false; }
 
   budgetKWh  = b;
@@ -384,25 +1217,202 @@ static bool loadSnapshotFromCsv(){
   baselineFromSnapshot = true;
 
   paused = true;
-  savePauseSnapshot();
+  snapshotDueMs = millis() | 1;   // loop() writes the journal
 
   Serial.printf("[RESTORE] budget=%.6f rem=%.6f used=%.6f (%.1f%%)\n",
                 (double)budgetKWh, (double)frozenRem, (double)frozenUsed, (double)frozenPct);
   return true;
 }
 
+/* ===================== Event journal (SD) ===================== */
+// Control decisions the CSV rows don't show (record layout in log_format.h).
+// Producers only push into a RAM ring, so recording is safe from any task and
+// never waits on SD; the loop drains it at control priority and stamps wall
+// time then, and not before the clock is synced, so events from before the
+// RTC/NTP fix don't land on the fallback date.
+static const char*    EVENTS_DIR     = "/events";
+static const uint8_t  EV_RING        = 64;
+static const uint32_t EV_MARK_MS     = 3600000UL;
+struct EvPending { EventRec rec; uint32_t ms; };
+static EvPending evRing[EV_RING];
+static uint8_t   evHead = 0, evCount = 0;
+static uint16_t  evSeq = 0;
+static portMUX_TYPE evMux = portMUX_INITIALIZER_UNLOCKED;
+static std::atomic<uint32_t> eventsWritten{0}, eventsDropped{0};
+static uint32_t evLastMarkMs = 0;
+static uint8_t  evRelaysSeen = 0, evManualSeen = 0;
+static bool     evRelaysKnown = false;   // the first mask seen is the baseline, not a change
+
+static uint32_t meterNowDWh(){   // 0.1 Wh
+  return (uint32_t)llround(((haveLastGood ? lastGoodTotal : 0.0) + softAccumKWh) * 10000.0);
+}
+static uint8_t relayMaskOf(const Status& s){
+  return s.paused ? 0 : (uint8_t)((s.p1?1:0) | (s.p2?2:0) | (s.p3?4:0) | (s.p4?8:0));
+}
+static void eventRecord(EventType type, uint8_t from, uint8_t to){
+  EvPending p;
+  p.ms = millis();
+  p.rec.epoch   = 0;   // stamped when flushed
+  p.rec.meter   = meterNowDWh();
+  p.rec.type = type; p.rec.from = from; p.rec.to = to;
+  p.rec.zone  = (uint8_t)currentZone;
+  p.rec.state = (paused ? 1 : 0) | EV_STATE_DWH | (uint8_t)(relayMaskOf(currentStatus) << 4);
+  portENTER_CRITICAL(&evMux);
+  if (evCount == EV_RING){ evHead = (evHead + 1) % EV_RING; evCount--; eventsDropped++; }  // keep the newest
+  p.rec.seq = evSeq++;
+  evRing[(evHead + evCount++) % EV_RING] = p;
+  portEXIT_CRITICAL(&evMux);
+}
+// Relay outputs and the manual mask change in several places; watch them here.
+static void eventWatch(){
+  uint8_t relays = relayMaskOf(currentStatus);
+  if (!evRelaysKnown){ evRelaysSeen = relays; evRelaysKnown = true; }
+  if (relays != evRelaysSeen){ eventRecord(EV_RELAYS, evRelaysSeen, relays); evRelaysSeen = relays; }
+  if (manualMask != evManualSeen){ eventRecord(EV_MANUAL, evManualSeen, manualMask); evManualSeen = manualMask; }
+}
+static String eventFileFor(uint32_t epoch){
+  DateTime d(epoch);
+  char p[32]; snprintf(p, sizeof(p), "%s/ev_%04u%02u.bin", EVENTS_DIR, (unsigned)d.year(), (unsigned)d.month());
+  return p;
+}
+static void eventFlush(){
+  if (millis() - evLastMarkMs >= EV_MARK_MS){ evLastMarkMs = millis(); eventRecord(EV_MARK, 0, 0); }
+  if (!evCount || !clockSynced) return;   // the ring keeps the newest until then
+  SdLock lk(SD_PRIO_CONTROL, 20);
+  if (!lk) return;
+  if (!SD.exists(EVENTS_DIR)) SD.mkdir(EVENTS_DIR);
+
+  EvPending batch[EV_RING];
+  uint8_t n = 0;
+  portENTER_CRITICAL(&evMux);
+  while (evCount){ batch[n++] = evRing[evHead]; evHead = (evHead + 1) % EV_RING; evCount--; }
+  portEXIT_CRITICAL(&evMux);
+
+  uint32_t nowMs = millis(), nowEpoch = (uint32_t)clockEpoch();
+  String openName; File f;
+  for (uint8_t i = 0; i < n; i++){
+    EventRec& e = batch[i].rec;
+    e.epoch = nowEpoch - (nowMs - batch[i].ms) / 1000;
+    e.check = (uint8_t)crc32((const uint8_t*)&e, sizeof(e) - 1);
+    String name = eventFileFor(e.epoch);
+    if (name != openName){ if (f) f.close(); f = SD.open(name, "a"); openName = name; }
+    if (f && f.write((const uint8_t*)&e, sizeof(e)) == sizeof(e)) eventsWritten++;
+    else eventsDropped++;
+  }
+  if (f) f.close();
+}
+
+/* ===================== Power-quality channel (SD, optional) ===================== */
+// With appcfg.pq_log on, one meter sample per second goes into the block format
+// from log_format.h. A block fills in RAM (about four minutes), then moves to a
+// one-slot pending buffer that the loop writes out when the bus is free; if
+// that slot is still taken when the next block fills, the older one is dropped.
+// Seconds with a failed meter read, or in a stale spell, are left out: the
+// timestamps show the gap rather than repeating the last good reading.
+static const char*    PQ_DIR       = "/pq";
+static const uint32_t PQ_PERIOD_MS = 1000;
+static PqBlockWriter* pqCur  = nullptr;   // being filled
+static PqBlockWriter* pqDone = nullptr;   // full, waiting for the bus
+static bool           pqDonePending = false;
+static uint32_t       pqLastMs = 0;
+static portMUX_TYPE   pqMux = portMUX_INITIALIZER_UNLOCKED;   // vs. /api/pq reading the live blocks
+static std::atomic<uint32_t> pqSamples{0}, pqSkipped{0}, pqBlocksWritten{0}, pqBlocksDropped{0}, pqBytesWritten{0}, pqCrcErrors{0};
+
+static void pqInit(){
+  pqCur  = new (std::nothrow) PqBlockWriter();
+  pqDone = new (std::nothrow) PqBlockWriter();
+}
+static String pqPath(uint32_t epoch, const char* ext){
+  DateTime d(epoch);
+  char p[32]; snprintf(p, sizeof(p), "%s/pq_%04u%02u%02u.%s", PQ_DIR, (unsigned)d.year(), (unsigned)d.month(), (unsigned)d.day(), ext);
+  return p;
+}
+// Appends the pending block to its day's .pqb and its entry to the .pqi.
+// The entry goes last, so a torn write leaves at worst an unindexed block.
+static void pqFlush(){
+  if (!pqDonePending) return;
+  SdLock lk(SD_PRIO_INTERACTIVE, 20);
+  if (!lk) return;
+  if (!SD.exists(PQ_DIR)) SD.mkdir(PQ_DIR);
+  uint32_t firstS = (uint32_t)(pqDone->t0Ms / 1000);
+  File d = SD.open(pqPath(firstS, "pqb"), "a");
+  File x = SD.open(pqPath(firstS, "pqi"), "a");
+  bool ok = d && x;
+  if (ok){
+    PqBlockHdr h = { PQ_MAGIC, pqDone->rows, (uint16_t)pqDone->len, 0, pqDone->t0Ms, crc32(pqDone->buf, pqDone->len) };
+    PqIdx e = { firstS, (uint32_t)d.size() };
+    ok = d.write((const uint8_t*)&h, sizeof(h)) == sizeof(h)
+      && d.write(pqDone->buf, pqDone->len) == pqDone->len
+      && x.write((const uint8_t*)&e, sizeof(e)) == sizeof(e);
+  }
+  if (d) d.close();
+  if (x) x.close();
+  if (!ok){ sdFault("pqFlush"); return; }   // stays pending; retried after remount
+  pqBytesWritten += sizeof(PqBlockHdr) + pqDone->len;
+  pqBlocksWritten++;
+  portENTER_CRITICAL(&pqMux);
+  pqDonePending = false;
+  portEXIT_CRITICAL(&pqMux);
+}
+static void pqSample(){
+  if (!appcfg.pq_log || !pqCur || !pqDone) return;
+  if (millis() - pqLastMs >= PQ_PERIOD_MS){
+    pqLastMs = millis();
+    // last* hold the previous good reading while the meter is failing; leave a gap instead
+    if (pzemStale || !pzemReadOk){ pqSkipped++; pqFlush(); return; }
+    PqSample s = { clockNowUs() / 1000,
+                   (int32_t)lround(lastVoltageV * 10), (int32_t)lround(lastCurrentA * 1000),
+                   (int32_t)lround(lastPowerW * 10),   (int32_t)lround(lastPf * 100),
+                   (int32_t)lround(lastFreqHz * 10) };
+    bool dropped = false;
+    portENTER_CRITICAL(&pqMux);
+    // a block never spans midnight, so each one lands in its own day's file
+    if (pqCur->rows && (pqCur->full() || s.tMs / 86400000LL != pqCur->t0Ms / 86400000LL)){
+      dropped = pqDonePending;
+      std::swap(pqCur, pqDone);
+      pqDonePending = true;
+      pqCur->reset();
+    }
+    pqCur->add(s);
+    portEXIT_CRITICAL(&pqMux);
+    pqSamples++;
+    if (dropped) pqBlocksDropped++;
+  }
+  pqFlush();
+}
+
 /* ===================== Energy model ===================== */
+// After boot only loop() reads the meter: the PZEM UART and the integration
+// state below are not shared. Handlers get the total of the last read.
+static double       virtualTotalLast = 0.0;
+static portMUX_TYPE virtualTotalMux  = portMUX_INITIALIZER_UNLOCKED;
+static const uint32_t METER_PAUSED_POLL_MS = 1000;   // computeStatus() skips the meter while paused
+static uint32_t     meterPolledMs = 0;
+
+static double virtualTotalCached(){
+  portENTER_CRITICAL(&virtualTotalMux);
+  double v = virtualTotalLast;
+  portEXIT_CRITICAL(&virtualTotalMux);
+  return v;
+}
+
 double virtualTotalKWh(){
+  TRACE_SCOPE("virtual_total_kwh");
+  ScopedTimer tm(mVirtualTotal);
   static uint32_t lastMs = millis();
   uint32_t now = millis();
   double dtHours = (now - lastMs) / 3600000.0;
   lastMs = now;
 
-  double v = pzem.voltage();  if(!isnan(v) && v>=0) lastVoltageV = v;
-  double c = pzem.current();  if(!isnan(c) && c>=0) lastCurrentA = c;
-  double p = pzem.power();    if(!isnan(p) && p>=0) lastPowerW   = p;
+  bool ok = true;
+  double v = pzem.voltage();  if(!isnan(v) && v>=0) lastVoltageV = v; else { pzemReadErrors++; ok = false; }
+  double c = pzem.current();  if(!isnan(c) && c>=0) lastCurrentA = c; else { pzemReadErrors++; ok = false; }
+  double p = pzem.power();    if(!isnan(p) && p>=0) lastPowerW   = p; else { pzemReadErrors++; ok = false; }
+  double hz = pzem.frequency(); if(!isnan(hz) && hz>=0) lastFreqHz = hz; else ok = false;   // same Modbus read, cached
+  double pf = pzem.pf();        if(!isnan(pf) && pf>=0) lastPf     = pf;
 
   double e = pzem.energy();
+  if(isnan(e) || e<0) pzemReadErrors++;
   if(!isnan(e) && e>=0){
     if(!haveLastGood || e >= lastGoodTotal - ENERGY_BACKSTEP_EPS){
       haveLastGood = true;
@@ -411,36 +1421,88 @@ double virtualTotalKWh(){
     }
   }
 
-  if((now - lastEnergyUpdateMs) > STALE_MS && lastPowerW > POWER_STALE_W){
+  bool stale = (now - lastEnergyUpdateMs) > STALE_MS && lastPowerW > POWER_STALE_W;
+  if(stale){
     softAccumKWh += (lastPowerW/1000.0) * dtHours;
   }
-
-  return (haveLastGood ? lastGoodTotal : 0.0) + softAccumKWh;
+  if(stale && !pzemStale) pzemStaleEvents++;
+  if(stale != pzemStale) eventRecord(EV_PZEM_STALE, pzemStale, stale);
+  pzemStale = stale;
+  pzemReadOk = ok;
+  meterPolledMs = now;
+
+  double total = (haveLastGood ? lastGoodTotal : 0.0) + softAccumKWh;
+  portENTER_CRITICAL(&virtualTotalMux);
+  virtualTotalLast = total;
+  portEXIT_CRITICAL(&virtualTotalMux);
+  return total;
 }
 
+// loop() only (controlApply); the caller saves the new baseline.
 void restartCycle(){
   double vt = virtualTotalKWh();
   energyBaseline = vt;
   softAccumKWh = 0.0;
   firstResume=false;
   baselineFromSnapshot = true;
-  savePauseSnapshot();
 }
 
-/* ===================== Auto zoning / status ===================== */
-static inline Zone zoneFromPctWithHyst(float pct, Zone prev){
-  if(pct<=PCT_EPS) return Z0_CUTOFF;
-  switch(prev){
-    case Z4_ALL:   if(pct<(69.0f-BAND_HYST)) return Z3_OFF4;   return Z4_ALL;
-    case Z3_OFF4:  if(pct>=(70.0f+BAND_HYST)) return Z4_ALL;   if(pct<(39.0f-BAND_HYST)) return Z2_ONLY12; if(pct<=(0.0f+BAND_HYST)) return Z0_CUTOFF; return Z3_OFF4;
-    case Z2_ONLY12:if(pct>=(40.0f+BAND_HYST)) return Z3_OFF4;  if(pct<(9.0f-BAND_HYST))  return Z1_ONLY1;  if(pct<=(0.0f+BAND_HYST)) return Z0_CUTOFF; return Z2_ONLY12;
-    case Z1_ONLY1: if(pct>=(10.0f+BAND_HYST)) return Z2_ONLY12; if(pct<=(0.0f+BAND_HYST)) return Z0_CUTOFF; return Z1_ONLY1;
-    case Z0_CUTOFF:if(pct>(0.0f+BAND_HYST))  return Z1_ONLY1;  return Z0_CUTOFF;
+/* ===================== Recent history (RAM ring) ===================== */
+// 1 h @ 1 s of used/remaining kWh as IEEE half floats (4 bytes/sample, ~14 KB).
+// Each sample gets a monotonically increasing seq so clients can ask for
+// "everything after N" and only pull the new tail.
+static const uint16_t HIST_CAP       = 3600;
+static const uint32_t HIST_PERIOD_MS = 1000;
+struct HistSample { uint16_t used; uint16_t rem; };
+static HistSample histRing[HIST_CAP];
+static uint32_t   histSeq = 0;          // seq of newest sample (0 = empty)
+static uint32_t   histLastMs = 0;
+static portMUX_TYPE histMux = portMUX_INITIALIZER_UNLOCKED;
+
+static uint16_t floatToHalf(float f){
+  uint32_t x; memcpy(&x,&f,4);
+  uint16_t sign = (x>>16) & 0x8000;
+  int32_t  exp  = (int32_t)((x>>23) & 0xFF) - 127 + 15;
+  uint32_t man  = x & 0x7FFFFF;
+  if(exp <= 0){                                  // subnormal / underflow
+    if(exp < -10) return sign;
+    man |= 0x800000;
+    return sign | (uint16_t)((man >> (14 - exp)) + ((man >> (13 - exp)) & 1));
+  }
+  if(exp >= 31) return sign | 0x7BFF;            // clamp to max finite
+  uint16_t h = sign | (uint16_t)(exp<<10) | (uint16_t)(man>>13);
+  if(man & 0x1000) h++;                          // round half up
+  return h;
+}
+static float halfToFloat(uint16_t h){
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exp  = (h>>10) & 0x1F;
+  uint32_t man  = h & 0x3FF;
+  if(exp == 0){
+    float f = ldexpf((float)man, -24);
+    return sign ? -f : f;
   }
-  return prev;
+  uint32_t x = sign | ((exp - 15 + 127) << 23) | (man << 13);
+  float f; memcpy(&f,&x,4); return f;
+}
+
+static void historyRecord(double used, double rem){
+  uint32_t now = millis();
+  if(histSeq && (now - histLastMs) < HIST_PERIOD_MS) return;
+  histLastMs = now;
+  HistSample s = { floatToHalf((float)used), floatToHalf((float)rem) };
+  portENTER_CRITICAL(&histMux);
+  histSeq++;
+  histRing[histSeq % HIST_CAP] = s;
+  portEXIT_CRITICAL(&histMux);
 }
 
+/* ===================== Auto zoning / status ===================== */
+static inline Zone zoneFromPctWithHyst(float pct, Zone prev){ return (Zone)zoneForPct(pct, (uint8_t)prev); }
+
 Status computeStatus(){
+  TRACE_SCOPE("compute_status");
+  ScopedTimer tm(mComputeStatus);
   Status s=currentStatus;
 
   if(paused){
@@ -450,6 +1512,7 @@ Status computeStatus(){
     s.paused       = true;
     s.budget       = budgetKWh;
     s.p1=s.p2=s.p3=s.p4=false;
+    historyRecord(s.usedKWh, s.remKWh);
     return s;
   }
 
@@ -469,6 +1532,7 @@ Status computeStatus(){
   s.usedKWh=used; s.remKWh=rem; s.remainingPct=pct; s.paused=false; s.budget=budgetKWh;
 
   Zone newZone = zoneFromPctWithHyst(pct, currentZone);
+  if(newZone != currentZone) eventRecord(EV_ZONE, currentZone, newZone);
   currentZone=newZone;
   bool z1=false,z2=false,z3=false,z4=false;
   switch(newZone){
@@ -488,154 +1552,1259 @@ Status computeStatus(){
     s.p1=z1; s.p2=z2; s.p3=z3; s.p4=z4;
   }
 
+  historyRecord(used, rem);
   return s;
 }
 void enforceRelays(const Status& s){
+  TRACE_SCOPE("enforce_relays");
+  ScopedTimer tm(mEnforceRelays);
   if(s.paused){ allGroups(false); return; }
   setGroup(prio1,s.p1); setGroup(prio2,s.p2); setGroup(prio3,s.p3); setGroup(prio4,s.p4);
 }
 
+/* ===================== UI bundle (memory-mapped flash partition) ===================== */
+// tools/pack_ui.py packs data/ into the "ui" partition: a header, a path-sorted
+// entry table, then the files (gzipped where that is smaller). The partition is
+// mapped once at boot and assets go out straight from flash, with no
+// filesystem walk or read buffer. LittleFS keeps only mutable state; it still
+// serves the pages when no valid bundle has been flashed.
+static const uint32_t UI_MAGIC   = 0x31554C53;   // "SLU1"
+static const uint8_t  UI_SUBTYPE = 0x40;
+static const uint32_t UI_GZIP    = 1;
+struct __attribute__((packed)) UiHeader { uint32_t magic; uint16_t count, version; uint32_t size, crc; };
+struct __attribute__((packed)) UiEntry  { char path[48]; uint32_t off, len, etag, flags; };
+static const uint8_t* uiBase  = nullptr;
+static const UiEntry* uiIndex = nullptr;
+static uint16_t       uiCount = 0;
+static std::atomic<uint32_t> uiServed{0}, uiNotModified{0};
+
+static void uiBundleInit(){
+  const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)UI_SUBTYPE, "ui");
+  UiHeader h;
+  if(!part || esp_partition_read(part, 0, &h, sizeof(h)) != ESP_OK || h.magic != UI_MAGIC
+     || h.size > part->size || sizeof(h) + (size_t)h.count * sizeof(UiEntry) > h.size){
+    Serial.println("[UI] no bundle, pages from LittleFS");
+    return;
+  }
+  const void* map = nullptr;
+#if ESP_IDF_VERSION_MAJOR >= 5
+  esp_partition_mmap_handle_t handle;
+  esp_err_t err = esp_partition_mmap(part, 0, h.size, ESP_PARTITION_MMAP_DATA, &map, &handle);
+#else
+  spi_flash_mmap_handle_t handle;
+  esp_err_t err = esp_partition_mmap(part, 0, h.size, SPI_FLASH_MMAP_DATA, &map, &handle);
+#endif
+  if(err != ESP_OK){ Serial.printf("[UI] mmap failed (%d), pages from LittleFS\n", (int)err); return; }
+  const uint8_t* base = (const uint8_t*)map;
+  if(crc32(base + sizeof(h), h.size - sizeof(h)) != h.crc){   // the mapping stays; boot-once
+    Serial.println("[UI] bundle CRC mismatch, pages from LittleFS");
+    return;
+  }
+  uiBase = base; uiIndex = (const UiEntry*)(base + sizeof(h)); uiCount = h.count;
+  Serial.printf("[UI] bundle: %u files, %u bytes mapped\n", (unsigned)uiCount, (unsigned)h.size);
+}
+static const UiEntry* uiFind(const char* path){
+  size_t lo = 0, hi = uiCount;
+  while(lo < hi){
+    size_t mid = (lo + hi) / 2;
+    int c = strncmp(path, uiIndex[mid].path, sizeof(uiIndex[mid].path));
+    if(!c) return &uiIndex[mid];
+    if(c < 0) hi = mid; else lo = mid + 1;
+  }
+  return nullptr;
+}
+static const char* uiContentType(const char* path){
+  static const struct { const char* ext; const char* type; } T[] = {
+    {".html","text/html"}, {".css","text/css"}, {".js","application/javascript"}, {".json","application/json"},
+    {".png","image/png"}, {".ico","image/x-icon"}, {".svg","image/svg+xml"},
+  };
+  const char* dot = strrchr(path, '.');
+  if(dot) for(auto& t : T) if(!strcmp(dot, t.ext)) return t.type;
+  return "application/octet-stream";
+}
+// Whether the client takes gzip: listed (or "*") without q=0.
+static bool uiAcceptsGzip(AsyncWebServerRequest* req){
+  if(!req->hasHeader("Accept-Encoding")) return false;
+  String ae = req->header("Accept-Encoding");
+  ae.replace(" ", ""); ae.toLowerCase();
+  int i = ae.indexOf("gzip");
+  if(i < 0) i = ae.indexOf('*');
+  if(i < 0) return false;
+  int q = ae.indexOf(";q=", i), comma = ae.indexOf(',', i);
+  if(q < 0 || (comma >= 0 && q > comma)) return true;
+  return ae.substring(q + 3).toFloat() > 0.0f;   // toFloat stops at the next comma
+}
+// Sends `path` from the bundle; false if there is no bundle or no such file, or
+// the file is packed gzipped, the client doesn't take gzip and LittleFS has a
+// plain copy for the caller to send. With no copy, a client that refused gzip
+// gets 406; one that sent no Accept-Encoding at all gets the gzip (RFC 9110).
+// Pages revalidate every time (they sit behind auth); other assets cache briefly.
+static bool uiSend(AsyncWebServerRequest* req, const char* path){
+  const UiEntry* e = uiBase ? uiFind(path) : nullptr;
+  if(!e) return false;
+  if((e->flags & UI_GZIP) && !uiAcceptsGzip(req)){
+    if(LittleFS.exists(path)) return false;
+    if(req->hasHeader("Accept-Encoding")){ req->send(406, "text/plain", "Stored gzip-compressed only"); return true; }
+  }
+  char etag[12]; snprintf(etag, sizeof(etag), "\"%08x\"", (unsigned)e->etag);
+  const char* type = uiContentType(path);
+  AsyncWebServerResponse* res;
+  if(req->hasHeader("If-None-Match") && req->header("If-None-Match") == etag){
+    res = req->beginResponse(304);
+    uiNotModified++;
+  } else {
+    res = req->beginResponse(200, type, uiBase + e->off, e->len);   // read from the mapping as it is sent
+    if(e->flags & UI_GZIP) res->addHeader("Content-Encoding", "gzip");
+    uiServed++;
+  }
+  if(e->flags & UI_GZIP) res->addHeader("Vary", "Accept-Encoding");
+  res->addHeader("ETag", etag);
+  res->addHeader("Cache-Control", strcmp(type, "text/html") ? "max-age=600" : "no-cache");
+  req->send(res);
+  return true;
+}
+static void sendPage(AsyncWebServerRequest* req, const char* path){
+  if(!uiSend(req, path)) req->send(LittleFS, path, "text/html");
+}
+// Static assets; registered ahead of the LittleFS serveStatic fallback, which
+// also serves plain copies to clients that don't take gzip.
+class UiBundleHandler : public AsyncWebHandler {
+public:
+  bool canHandle(AsyncWebServerRequest* req) const override {
+    return uiBase && req->method() == HTTP_GET && uiFind(req->url().c_str());
+  }
+  void handleRequest(AsyncWebServerRequest* req) override {
+    const char* path = req->url().c_str();
+    if(!uiSend(req, path)) req->send(LittleFS, path, uiContentType(path));
+  }
+  bool isRequestHandlerTrivial() const override { return true; }
+};
+
 /* ===================== Auth ===================== */
-String sessionId=""; bool isLoggedIn=false;
-String randomHex(uint8_t n=16){
-  String s; s.reserve(n*2);
-  for(uint8_t i=0;i<n;i++){ uint8_t b=random(0,256); if(b<16)s+='0'; s+=String(b,HEX); }
-  return s;
+// Up to AUTH_SESSIONS operators stay signed in at once. A session is a 128-bit
+// token from the hardware RNG whose low bits of the first byte name its slot,
+// so checking a cookie is one slot read plus a constant-time compare. Sessions
+// expire after AUTH_IDLE_MS without a request; a login with the table full
+// replaces the least recently used one.
+static const uint8_t  AUTH_SESSIONS = 8;                  // power of two
+static const uint32_t AUTH_IDLE_MS  = 12UL * 3600 * 1000;
+struct Session { uint8_t tok[16]; uint32_t lastMs; bool used; };
+static Session      sessions[AUTH_SESSIONS];
+static portMUX_TYPE authMux = portMUX_INITIALIZER_UNLOCKED;
+
+static bool sessionLive(const Session& s, uint32_t now){ return s.used && now - s.lastMs < AUTH_IDLE_MS; }
+static bool tokenEqual(const uint8_t* a, const uint8_t* b){
+  uint8_t d = 0;
+  for(uint8_t i=0;i<16;i++) d |= a[i] ^ b[i];
+  return d == 0;
 }
-bool hasAuth(AsyncWebServerRequest* req){
-  if(!isLoggedIn) return false;
+// Finds "SID=<32 hex>" in the Cookie header without allocating.
+static bool cookieToken(AsyncWebServerRequest* req, uint8_t tok[16]){
   if(!req->hasHeader("Cookie")) return false;
-  String ck=req->header("Cookie");
-  return ck.indexOf("SID="+sessionId)>=0;
+  const char* all = req->header("Cookie").c_str();
+  const char* c = all;
+  while((c = strstr(c, "SID=")) != nullptr){
+    bool atStart = c == all || c[-1] == ' ' || c[-1] == ';';
+    c += 4;
+    if(!atStart) continue;
+    for(uint8_t i=0;i<32;i++){
+      char h = c[i]; int v = (h>='0'&&h<='9') ? h-'0' : (h>='a'&&h<='f') ? h-'a'+10 : (h>='A'&&h<='F') ? h-'A'+10 : -1;
+      if(v < 0) return false;
+      tok[i/2] = (i & 1) ? (uint8_t)(tok[i/2] | v) : (uint8_t)(v << 4);
+    }
+    return true;
+  }
+  return false;
+}
+// Creates a session and writes its cookie value (32 hex chars) to `hex`.
+static void sessionCreate(char hex[33]){
+  uint8_t tok[16];
+  esp_fill_random(tok, sizeof(tok));
+  uint32_t now = millis();
+  portENTER_CRITICAL(&authMux);
+  uint8_t slot = 0; uint32_t idle = 0;   // a free slot, else the least recently used
+  for(uint8_t i=0;i<AUTH_SESSIONS;i++){
+    if(!sessionLive(sessions[i], now)){ slot = i; break; }
+    if(now - sessions[i].lastMs >= idle){ idle = now - sessions[i].lastMs; slot = i; }
+  }
+  tok[0] = (uint8_t)((tok[0] & ~(AUTH_SESSIONS - 1)) | slot);
+  memcpy(sessions[slot].tok, tok, sizeof(tok));
+  sessions[slot].lastMs = now; sessions[slot].used = true;
+  portEXIT_CRITICAL(&authMux);
+  for(uint8_t i=0;i<16;i++) snprintf(hex + i*2, 3, "%02x", tok[i]);
+}
+static void sessionEnd(AsyncWebServerRequest* req){
+  uint8_t tok[16];
+  if(!cookieToken(req, tok)) return;
+  Session& s = sessions[tok[0] & (AUTH_SESSIONS - 1)];
+  portENTER_CRITICAL(&authMux);
+  if(s.used && tokenEqual(s.tok, tok)) s.used = false;
+  portEXIT_CRITICAL(&authMux);
+}
+static uint8_t sessionCount(){
+  uint32_t now = millis(); uint8_t n = 0;
+  for(auto& s : sessions) if(sessionLive(s, now)) n++;
+  return n;
+}
+bool hasAuth(AsyncWebServerRequest* req){
+  uint8_t tok[16];
+  if(!cookieToken(req, tok)) return false;
+  Session& s = sessions[tok[0] & (AUTH_SESSIONS - 1)];
+  uint32_t now = millis();
+  bool ok;
+  portENTER_CRITICAL(&authMux);
+  ok = sessionLive(s, now) && tokenEqual(s.tok, tok);
+  if(ok) s.lastMs = now;
+  portEXIT_CRITICAL(&authMux);
+  return ok;
 }
 void requireAuth(AsyncWebServerRequest* req, const char* pathIfOk){
-  if(hasAuth(req)) req->send(LittleFS, pathIfOk, "text/html");
+  if(hasAuth(req)) sendPage(req, pathIfOk);
   else req->redirect("/login");
 }
 
-/* ===================== HTTP APIs ===================== */
-void handleStatus(AsyncWebServerRequest*req){
-  JsonDocument doc;
-  doc["remainingPct"]=currentStatus.remainingPct;
-  doc["usedKWh"]=currentStatus.usedKWh;
-  doc["remKWh"]=currentStatus.remKWh;
-  doc["p1"]=currentStatus.p1; doc["p2"]=currentStatus.p2; doc["p3"]=currentStatus.p3; doc["p4"]=currentStatus.p4;
-  doc["paused"]=currentStatus.paused;
-  doc["budget"]=currentStatus.budget;
-  doc["show_usage_graph"]=appcfg.show_usage_graph;
-  doc["show_prio_status"]=appcfg.show_prio_status;
-  doc["show_prio_controls"]=appcfg.show_prio_controls;
-  doc["depleted"] = (currentStatus.remKWh <= 0.0 || currentStatus.remainingPct <= 0.0f);
-  doc["powerW"]   = lastPowerW;
-  doc["voltageV"] = lastVoltageV;
-  doc["currentA"] = lastCurrentA;
-  doc["energy_raw_kwh"]     = lastGoodTotal;
-  doc["energy_virtual_kwh"] = virtualTotalKWh();
-  doc["ready"] = systemReady;
-
-  String out; serializeJson(doc,out);
-  req->send(200,"application/json",out);
+/* ===================== Admission control ===================== */
+// Routes are classed as control, status or bulk, each with its own in-flight
+// limit. A slot is held until the connection closes, so streamed responses
+// (exports, downloads, LittleFS pages) count for as long as they run, and a
+// request over its class limit is turned away with 503 + Retry-After instead
+// of piling up on the async_tcp task in front of relay commands.
+// Handlers also get a time slice: long scans that still run inline check
+// sliceSpent() and stop early with a partial result. Body routes are admitted
+// on their first chunk; the rest of a turned-away body is dropped.
+enum ReqClass : uint8_t { RC_CONTROL, RC_STATUS, RC_BULK, RC_COUNT };
+struct ReqClassInfo { const char* name; uint8_t maxInFlight; uint32_t sliceUs; const char* retryAfter; };
+static const ReqClassInfo REQ_CLASSES[RC_COUNT] = {
+  { "control", 8, 50000, "1" },
+  { "status",  6, 50000, "1" },
+  { "bulk",    2, 20000, "5" },
+};
+static std::atomic<uint8_t>  rcInFlight[RC_COUNT];
+static std::atomic<uint32_t> rcAdmitted[RC_COUNT], rcRejected[RC_COUNT];
+static uint32_t sliceStartUs = 0, sliceBudgetUs = 0;   // handler running on async_tcp
+// Who holds which slot (async_tcp only): a request has one disconnect
+// callback, and the slot release has to ride along with the handler's own.
+struct RcHold { const AsyncWebServerRequest* req; ReqClass c; };
+static const uint8_t RC_HOLDS = 16;   // the class limits summed
+static RcHold rcHolds[RC_HOLDS];
+
+static bool sliceSpent(){ return sliceBudgetUs && micros() - sliceStartUs >= sliceBudgetUs; }
+
+static bool rcHeld(const AsyncWebServerRequest* req){
+  for (const auto& h : rcHolds) if (h.req == req) return true;
+  return false;
+}
+// Sets the disconnect callback, keeping the admission slot's release in it.
+static void reqOnDisconnect(AsyncWebServerRequest* req, ArDisconnectHandler fn){
+  for (auto& h : rcHolds){
+    if (h.req != req) continue;
+    RcHold* hp = &h; ReqClass c = h.c;
+    req->onDisconnect([hp, c, fn](){ if (fn) fn(); hp->req = nullptr; rcInFlight[c]--; });
+    return;
+  }
+  req->onDisconnect(fn);
 }
 
-/* ===== Config HTTP handlers (REST) ===== */
-void handleConfigGet(AsyncWebServerRequest* req){
-  if(!hasAuth(req)){ req->send(401); return; }
-  JsonDocument d;
-  d["username"]=appcfg.username;
-  d["budget_kwh"]=appcfg.budget_kwh;
-  d["show_usage_graph"]=appcfg.show_usage_graph;
-  d["show_prio_status"]=appcfg.show_prio_status;
-  d["show_prio_controls"]=appcfg.show_prio_controls;
-  String out; serializeJson(d,out);
-  req->send(200,"application/json",out);
+// Takes a slot for the request's lifetime (released from onDisconnect, so
+// classed routes set their own disconnect callback with reqOnDisconnect()).
+static bool admit(AsyncWebServerRequest* req, ReqClass c){
+  uint8_t n = rcInFlight[c].load();
+  do {
+    if (n >= REQ_CLASSES[c].maxInFlight){
+      rcRejected[c]++;
+      AsyncWebServerResponse* r = req->beginResponse(503, "text/plain", "Busy, retry shortly");
+      r->addHeader("Retry-After", REQ_CLASSES[c].retryAfter);
+      req->send(r);
+      return false;
+    }
+  } while (!rcInFlight[c].compare_exchange_weak(n, n + 1));
+  rcAdmitted[c]++;
+  for (auto& h : rcHolds) if (!h.req){ h = { req, c }; reqOnDisconnect(req, nullptr); return true; }
+  req->onDisconnect([c](){ rcInFlight[c]--; });   // not reached: there is a hold per slot
+  return true;
 }
-void handleConfigBody(AsyncWebServerRequest* req, uint8_t* data, size_t len, size_t index, size_t total){
-  if (!hasAuth(req)) { req->send(401); return; }
-  if (index==0) req->_tempObject = new String();
-  String* body = (String*)req->_tempObject;
-  body->reserve(total);
-  body->concat((const char*)data, len);
-  if (index + len != total) return;
-
-  String contentType="";
-  if (req->hasHeader("Content-Type")) contentType = req->getHeader("Content-Type")->value();
-  contentType.toLowerCase();
-
-  String u = appcfg.username;
-  String p = appcfg.password;
-  float  budget = appcfg.budget_kwh;
-  bool   sGraph = appcfg.show_usage_graph;
-  bool   sStatus= appcfg.show_prio_status;
-  bool   sCtrl  = appcfg.show_prio_controls;
 
-  if (contentType.indexOf("application/json")>=0) {
-    JsonDocument d;
-    if (deserializeJson(d, *body) == DeserializationError::Ok) {
-      if (d["username"].is<const char*>()) u = d["username"].as<const char*>();
-      if (d["password"].is<const char*>()) p = d["password"].as<const char*>();
-      if (d["budget_kwh"].is<float>())     budget = d["budget_kwh"].as<float>();
-      if (d["show_usage_graph"].is<bool>())    sGraph = d["show_usage_graph"].as<bool>();
-      if (d["show_prio_status"].is<bool>())    sStatus= d["show_prio_status"].as<bool>();
-      if (d["show_prio_controls"].is<bool>())  sCtrl  = d["show_prio_controls"].as<bool>();
+/* ===================== Request arenas (PSRAM-aware) ===================== */
+// Handlers bump-allocate their JsonDocument nodes, request body and output
+// buffer from one fixed block that is dropped in a single step when the request
+// is done, so HTTP traffic never fragments the heap WiFi/lwIP live on.
+// Blocks are allocated once at boot, from PSRAM when the board has it.
+static const size_t  ARENA_BYTES = 8192;
+static const uint8_t ARENA_SLOTS = 3;
+
+static size_t   arenaHighWater  = 0;   // most bytes any single request used
+static uint32_t arenaOverflows  = 0;   // allocations refused (request too big)
+static uint32_t arenaFallbacks  = 0;   // requests served from heap (all slots busy)
+static bool     arenaInPsram    = false;
+
+class ReqArena : public ArduinoJson::Allocator {
+public:
+  uint8_t* base = nullptr;
+  size_t   used = 0;
+  size_t   lastOff = 0;                // start of the newest block (grown in place)
+  const AsyncWebServerRequest* owner = nullptr;
+
+  void* allocate(size_t n) override {
+    n = (n + 3) & ~(size_t)3;
+    if(!base || used + n > ARENA_BYTES){ arenaOverflows++; return nullptr; }
+    lastOff = used; used += n;
+    if(used > arenaHighWater) arenaHighWater = used;
+    return base + lastOff;
+  }
+  void deallocate(void* p) override {
+    if(p && (uint8_t*)p == base + lastOff){ used = lastOff; }   // pop newest only
+  }
+  void* reallocate(void* p, size_t n) override {
+    if(!p) return allocate(n);
+    n = (n + 3) & ~(size_t)3;
+    size_t off = (uint8_t*)p - base;
+    if(off == lastOff){
+      if(off + n > ARENA_BYTES){ arenaOverflows++; return nullptr; }
+      used = off + n;
+      if(used > arenaHighWater) arenaHighWater = used;
+      return p;
     }
-  } else if (contentType.indexOf("application/x-www-form-urlencoded")>=0 || contentType.indexOf("text/plain")>=0) {
-    String b = *body;
-    int start=0;
-    while (start < (int)b.length()) {
-      int amp = b.indexOf('&', start); if (amp<0) amp = b.length();
-      int eq  = b.indexOf('=', start);
-      if (eq>start && eq<amp) {
-        String key = b.substring(start, eq);
-        String val = b.substring(eq+1, amp);
-        key.toLowerCase(); val = urlDecode(val);
-        if (key=="username") u = val;
-        else if (key=="password") p = val;
-        else if (key=="budget_kwh") budget = val.toFloat();
-        else if (key=="show_usage_graph") sGraph = parseBoolStr(val);
-        else if (key=="show_prio_status") sStatus= parseBoolStr(val);
-        else if (key=="show_prio_controls") sCtrl = parseBoolStr(val);
-      }
-      start = amp+1;
+    size_t oldEnd = used;
+    void* q = allocate(n);
+    if(q) memcpy(q, p, min(n, oldEnd - off));
+    return q;
+  }
+  void reset(){ used = 0; lastOff = 0; }
+};
+
+// Used when every slot is busy; same interface, plain heap.
+struct HeapAllocator : ArduinoJson::Allocator {
+  void* allocate(size_t n) override { return malloc(n); }
+  void  deallocate(void* p) override { free(p); }
+  void* reallocate(void* p, size_t n) override { return realloc(p, n); }
+} heapAlloc;
+
+static ReqArena arenaPool[ARENA_SLOTS];
+static portMUX_TYPE arenaMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void arenaInit(){
+  arenaInPsram = psramFound();
+  for(uint8_t i=0;i<ARENA_SLOTS;i++){
+    uint32_t caps = arenaInPsram ? (MALLOC_CAP_SPIRAM|MALLOC_CAP_8BIT) : (MALLOC_CAP_INTERNAL|MALLOC_CAP_8BIT);
+    arenaPool[i].base = (uint8_t*)heap_caps_malloc(ARENA_BYTES, caps);
+  }
+  Serial.printf("[ARENA] %u x %u B in %s\n", (unsigned)ARENA_SLOTS, (unsigned)ARENA_BYTES, arenaInPsram ? "PSRAM" : "internal RAM");
+}
+static ReqArena* arenaAcquire(const AsyncWebServerRequest* req){
+  ReqArena* a = nullptr;
+  portENTER_CRITICAL(&arenaMux);
+  for(auto& s : arenaPool){ if(s.base && !s.owner){ s.owner = req; s.reset(); a = &s; break; } }
+  if(!a) arenaFallbacks++;
+  portEXIT_CRITICAL(&arenaMux);
+  return a;
+}
+static ReqArena* arenaFind(const AsyncWebServerRequest* req){
+  for(auto& s : arenaPool) if(s.owner == req) return &s;
+  return nullptr;
+}
+static void arenaRelease(const AsyncWebServerRequest* req){
+  portENTER_CRITICAL(&arenaMux);
+  for(auto& s : arenaPool){ if(s.owner == req){ s.owner = nullptr; s.reset(); } }
+  portEXIT_CRITICAL(&arenaMux);
+}
+
+// Scoped lease for single-callback handlers.
+struct ArenaLease {
+  const AsyncWebServerRequest* req; ReqArena* a;
+  explicit ArenaLease(const AsyncWebServerRequest* r) : req(r), a(arenaAcquire(r)) {}
+  ~ArenaLease(){ if(a) arenaRelease(req); }
+  ArduinoJson::Allocator* alloc(){ return a ? (ArduinoJson::Allocator*)a : &heapAlloc; }
+};
+
+// Serialize into the arena and send; the response copies the text once.
+static void sendJson(AsyncWebServerRequest* req, JsonDocument& doc, ReqArena* a, int code=200){
+  size_t n = measureJson(doc);
+  char* buf = a ? (char*)a->allocate(n + 1) : nullptr;
+  if(buf){
+    serializeJson(doc, buf, n + 1);
+    req->send(code, "application/json", buf);
+  } else {
+    String out; serializeJson(doc, out);
+    req->send(code, "application/json", out);
+  }
+}
+
+// Accumulates a POST body into the request's arena (or, if every slot is busy,
+// a malloc'd buffer parked in _tempObject, which the request frees itself).
+// Returns the NUL-terminated body on the final chunk, nullptr before that.
+static const size_t BODY_MAX = ARENA_BYTES / 2;
+static char* collectBody(AsyncWebServerRequest* req, uint8_t* data, size_t len, size_t index, size_t total){
+  if (total > BODY_MAX){ if (index==0) req->send(413, "text/plain", "Body too large"); return nullptr; }
+  char* body;
+  if (index==0){
+    ReqArena* a = arenaAcquire(req);
+    if (a){
+      body = (char*)a->allocate(total + 1);
+      reqOnDisconnect(req, [req](){ arenaRelease(req); });
+    } else {
+      body = (char*)malloc(total + 1);
+      req->_tempObject = body;
     }
   } else {
-    JsonDocument d;
-    if (deserializeJson(d, *body) == DeserializationError::Ok) {
+    ReqArena* a = arenaFind(req);
+    body = a ? (char*)a->base : (char*)req->_tempObject;
+  }
+  if (!body) return nullptr;
+  memcpy(body + index, data, len);
+  if (index + len != total) return nullptr;
+  body[total] = 0;
+  return body;
+}
+static bool contentTypeIs(AsyncWebServerRequest* req, const char* mime){
+  if (!req->hasHeader("Content-Type")) return false;
+  return strncasecmp(req->getHeader("Content-Type")->value().c_str(), mime, strlen(mime)) == 0;
+}
+// Splits an x-www-form-urlencoded body in place and calls fn(key, value)
+// with decoded, NUL-terminated strings pointing into the body.
+template<typename F> static void forEachFormField(char* b, F fn){
+  while (*b){
+    char* amp = strchr(b, '&'); if (amp) *amp = 0;
+    char* eq  = strchr(b, '=');
+    if (eq && eq > b){ *eq = 0; urlDecodeInPlace(b); urlDecodeInPlace(eq+1); fn(b, eq+1); }
+    if (!amp) break;
+    b = amp + 1;
+  }
+}
+
+// Heap watermarks, sampled once a second from loop().
+static uint32_t heapMinFree = UINT32_MAX;
+static uint32_t heapMinLargest = UINT32_MAX;
+static float    heapWorstFragPct = 0.0f;
+static void memSample(){
+  uint32_t fr = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  uint32_t lg = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  if(fr < heapMinFree) heapMinFree = fr;
+  if(lg < heapMinLargest) heapMinLargest = lg;
+  float frag = fr ? 100.0f * (1.0f - (float)lg / (float)fr) : 0.0f;
+  if(frag > heapWorstFragPct) heapWorstFragPct = frag;
+}
+
+void handleMem(AsyncWebServerRequest* req){
+  ArenaLease lease(req);
+  JsonDocument d(lease.alloc());
+  uint32_t fr = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  uint32_t lg = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  d["heap_free"]          = fr;
+  d["heap_largest_block"] = lg;
+  d["heap_frag_pct"]      = fr ? 100.0f * (1.0f - (float)lg / (float)fr) : 0.0f;
+  d["heap_min_free"]      = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  d["heap_min_largest"]   = heapMinLargest;
+  d["heap_worst_frag_pct"]= heapWorstFragPct;
+  d["psram"]              = arenaInPsram;
+  d["psram_free"]         = arenaInPsram ? heap_caps_get_free_size(MALLOC_CAP_SPIRAM) : 0;
+  d["arena_bytes"]        = ARENA_BYTES;
+  d["arena_slots"]        = ARENA_SLOTS;
+  d["arena_high_water"]   = arenaHighWater;
+  d["arena_overflows"]    = arenaOverflows;
+  d["arena_fallbacks"]    = arenaFallbacks;
+  d["uptime_s"]           = millis() / 1000;
+  sendJson(req, d, lease.a);
+}
+
+// GET /metrics  (Prometheus text exposition 0.0.4)
+static void writeHist(AsyncResponseStream* res, const char* metric, const char* labels, const LatencyHist& h){
+  uint32_t cum = 0;
+  for(uint8_t i=0;i<=HIST_BUCKETS;i++){
+    cum += h.buckets[i].load(std::memory_order_relaxed);
+    if(i < HIST_BUCKETS) res->printf("%s_bucket{%s,le=\"%g\"} %u\n", metric, labels, HIST_BOUNDS_US[i] / 1e6, (unsigned)cum);
+    else                 res->printf("%s_bucket{%s,le=\"+Inf\"} %u\n", metric, labels, (unsigned)cum);
+  }
+  res->printf("%s_sum{%s} %.6f\n", metric, labels, h.sumUs() / 1e6);
+  res->printf("%s_count{%s} %u\n", metric, labels, (unsigned)h.count.load(std::memory_order_relaxed));
+}
+void handleMetrics(AsyncWebServerRequest* req){
+  auto *res = req->beginResponseStream("text/plain; version=0.0.4");
+  char labels[96];
+
+  res->print("# HELP smartload_op_duration_seconds Control-path operation latency.\n"
+             "# TYPE smartload_op_duration_seconds histogram\n");
+  for(const LatencyHist* h : OP_HISTS){
+    snprintf(labels, sizeof(labels), "op=\"%s\"", h->label);
+    writeHist(res, "smartload_op_duration_seconds", labels, *h);
+  }
+  res->print("# HELP smartload_http_request_duration_seconds HTTP handler latency.\n"
+             "# TYPE smartload_http_request_duration_seconds histogram\n");
+  for(uint8_t i=0;i<httpHistCount;i++){
+    snprintf(labels, sizeof(labels), "handler=\"%s\",method=\"%s\"", httpHists[i].label, httpHists[i].method);
+    writeHist(res, "smartload_http_request_duration_seconds", labels, httpHists[i]);
+  }
+
+  res->printf("# TYPE smartload_heap_free_bytes gauge\nsmartload_heap_free_bytes %u\n",
+              (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT));
+  res->printf("# TYPE smartload_heap_largest_free_block_bytes gauge\nsmartload_heap_largest_free_block_bytes %u\n",
+              (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  res->printf("# TYPE smartload_heap_min_free_bytes gauge\nsmartload_heap_min_free_bytes %u\n",
+              (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+  res->printf("# TYPE smartload_arena_high_water_bytes gauge\nsmartload_arena_high_water_bytes %u\n", (unsigned)arenaHighWater);
+  res->printf("# TYPE smartload_arena_overflows_total counter\nsmartload_arena_overflows_total %u\n", (unsigned)arenaOverflows);
+
+  res->print("# TYPE smartload_task_stack_high_water_bytes gauge\n");
+  if(loopTaskHandle) res->printf("smartload_task_stack_high_water_bytes{task=\"loop\"} %u\n",
+                                 (unsigned)uxTaskGetStackHighWaterMark(loopTaskHandle));
+  res->printf("smartload_task_stack_high_water_bytes{task=\"async_tcp\"} %u\n",
+              (unsigned)uxTaskGetStackHighWaterMark(nullptr));   // we run on it
+  if(slowInitStackHwm) res->printf("smartload_task_stack_high_water_bytes{task=\"slow_init\"} %u\n", (unsigned)slowInitStackHwm);
+
+  res->printf("# TYPE smartload_sd_mounted gauge\nsmartload_sd_mounted %d\n", sdState == SD_MOUNTED ? 1 : 0);
+  res->printf("# TYPE smartload_sd_mounts_total counter\nsmartload_sd_mounts_total %u\n", (unsigned)sdMountCount);
+  res->printf("# TYPE smartload_sd_faults_total counter\nsmartload_sd_faults_total %u\n", (unsigned)sdFaultCount);
+  res->printf("# TYPE smartload_sd_read_bytes_total counter\nsmartload_sd_read_bytes_total %u\n", (unsigned)sdReadBytes.load());
+  res->print("# TYPE smartload_http_in_flight gauge\n");
+  for(uint8_t c=0;c<RC_COUNT;c++) res->printf("smartload_http_in_flight{class=\"%s\"} %u\n", REQ_CLASSES[c].name, (unsigned)rcInFlight[c].load());
+  res->print("# TYPE smartload_http_admitted_total counter\n");
+  for(uint8_t c=0;c<RC_COUNT;c++) res->printf("smartload_http_admitted_total{class=\"%s\"} %u\n", REQ_CLASSES[c].name, (unsigned)rcAdmitted[c].load());
+  res->print("# TYPE smartload_http_rejected_total counter\n");
+  for(uint8_t c=0;c<RC_COUNT;c++) res->printf("smartload_http_rejected_total{class=\"%s\"} %u\n", REQ_CLASSES[c].name, (unsigned)rcRejected[c].load());
+  res->printf("# TYPE smartload_events_written_total counter\nsmartload_events_written_total %u\n", (unsigned)eventsWritten.load());
+  res->printf("# TYPE smartload_events_dropped_total counter\nsmartload_events_dropped_total %u\n", (unsigned)eventsDropped.load());
+  res->printf("# TYPE smartload_replicate_rows_total counter\nsmartload_replicate_rows_total %u\n", (unsigned)replRows.load());
+  res->printf("# TYPE smartload_replicate_bytes_total counter\nsmartload_replicate_bytes_total %u\n", (unsigned)replBytes.load());
+  res->printf("# TYPE smartload_mqtt_published_total counter\nsmartload_mqtt_published_total %u\n", (unsigned)mqttPublished.load());
+  res->printf("# TYPE smartload_mqtt_bytes_total counter\nsmartload_mqtt_bytes_total %u\n", (unsigned)mqttBytes.load());
+  res->printf("# TYPE smartload_mqtt_dropped_total counter\nsmartload_mqtt_dropped_total %u\n", (unsigned)mqttDropped.load());
+  res->printf("# TYPE smartload_mqtt_samples_total counter\nsmartload_mqtt_samples_total %u\n", (unsigned)mqttSamples.load());
+  res->printf("# TYPE smartload_mqtt_coalesced_total counter\nsmartload_mqtt_coalesced_total %u\n", (unsigned)mqttCoalesced.load());
+  res->printf("# TYPE smartload_dns_queries_total counter\nsmartload_dns_queries_total %u\n", (unsigned)dnsQueries.load());
+  res->printf("# TYPE smartload_dns_answered_total counter\nsmartload_dns_answered_total %u\n", (unsigned)dnsAnswered.load());
+  res->printf("# TYPE smartload_dns_ignored_total counter\nsmartload_dns_ignored_total %u\n", (unsigned)dnsIgnored.load());
+  res->printf("# TYPE smartload_dns_queries_per_second gauge\nsmartload_dns_queries_per_second %u\n", (unsigned)dnsRatePerS.load());
+  res->printf("# TYPE smartload_config_changes_total counter\nsmartload_config_changes_total %u\n", (unsigned)configChanges.load());
+  res->printf("# TYPE smartload_config_commits_total counter\nsmartload_config_commits_total %u\n", (unsigned)configCommits.load());
+  res->printf("# TYPE smartload_logs_query_cache_hits_total counter\nsmartload_logs_query_cache_hits_total %u\n", (unsigned)qcacheHits.load());
+  res->printf("# TYPE smartload_logs_query_cache_misses_total counter\nsmartload_logs_query_cache_misses_total %u\n", (unsigned)qcacheMisses.load());
+  res->printf("# TYPE smartload_log_summary_days_built_total counter\nsmartload_log_summary_days_built_total %u\n", (unsigned)sumDaysBuilt.load());
+  res->printf("# TYPE smartload_ota_updates_total counter\nsmartload_ota_updates_total %u\n", (unsigned)otaUpdates.load());
+  res->printf("# TYPE smartload_ota_failures_total counter\nsmartload_ota_failures_total %u\n", (unsigned)otaFailures.load());
+  res->printf("# TYPE smartload_auth_sessions gauge\nsmartload_auth_sessions %u\n", (unsigned)sessionCount());
+  res->printf("# TYPE smartload_ui_bundle_files gauge\nsmartload_ui_bundle_files %u\n", (unsigned)uiCount);
+  res->printf("# TYPE smartload_ui_served_total counter\nsmartload_ui_served_total %u\n", (unsigned)uiServed.load());
+  res->printf("# TYPE smartload_ui_not_modified_total counter\nsmartload_ui_not_modified_total %u\n", (unsigned)uiNotModified.load());
+  res->printf("# TYPE smartload_pq_samples_total counter\nsmartload_pq_samples_total %u\n", (unsigned)pqSamples.load());
+  res->printf("# TYPE smartload_pq_skipped_total counter\nsmartload_pq_skipped_total %u\n", (unsigned)pqSkipped.load());
+  res->printf("# TYPE smartload_pq_blocks_written_total counter\nsmartload_pq_blocks_written_total %u\n", (unsigned)pqBlocksWritten.load());
+  res->printf("# TYPE smartload_pq_blocks_dropped_total counter\nsmartload_pq_blocks_dropped_total %u\n", (unsigned)pqBlocksDropped.load());
+  res->printf("# TYPE smartload_pq_bytes_written_total counter\nsmartload_pq_bytes_written_total %u\n", (unsigned)pqBytesWritten.load());
+  res->printf("# TYPE smartload_pq_crc_errors_total counter\nsmartload_pq_crc_errors_total %u\n", (unsigned)pqCrcErrors.load());
+  res->printf("# TYPE smartload_archive_days_total counter\nsmartload_archive_days_total %u\n", (unsigned)archiveDays.load());
+  res->printf("# TYPE smartload_archive_rows_total counter\nsmartload_archive_rows_total %u\n", (unsigned)archiveRowsIn.load());
+  res->printf("# TYPE smartload_archive_csv_bytes_total counter\nsmartload_archive_csv_bytes_total %u\n", (unsigned)archiveBytesIn.load());
+  res->printf("# TYPE smartload_archive_bytes_total counter\nsmartload_archive_bytes_total %u\n", (unsigned)archiveBytesOut.load());
+  res->printf("# TYPE smartload_archive_decode_bytes_total counter\nsmartload_archive_decode_bytes_total %u\n", (unsigned)archiveDecodeBytes.load());
+  res->printf("# TYPE smartload_archive_decode_seconds_total counter\nsmartload_archive_decode_seconds_total %.6f\n", archiveDecodeUs.load() / 1e6);
+  res->printf("# TYPE smartload_archive_crc_errors_total counter\nsmartload_archive_crc_errors_total %u\n", (unsigned)archiveCrcErrors.load());
+  res->printf("# TYPE smartload_exports_total counter\nsmartload_exports_total %u\n", (unsigned)exportCount.load());
+  res->printf("# TYPE smartload_export_rows_total counter\nsmartload_export_rows_total %u\n", (unsigned)exportRows.load());
+  res->printf("# TYPE smartload_export_bytes_total counter\nsmartload_export_bytes_total %u\n", (unsigned)exportBytes.load());
+  res->printf("# TYPE smartload_export_seconds_total counter\nsmartload_export_seconds_total %.3f\n", exportMs.load() / 1000.0);
+  res->printf("# TYPE smartload_sd_read_seconds_total counter\nsmartload_sd_read_seconds_total %.6f\n", sdReadUs.load() / 1e6);
+  res->printf("# TYPE smartload_pzem_read_errors_total counter\nsmartload_pzem_read_errors_total %u\n", (unsigned)pzemReadErrors.load());
+  res->printf("# TYPE smartload_pzem_stale_events_total counter\nsmartload_pzem_stale_events_total %u\n", (unsigned)pzemStaleEvents.load());
+  res->printf("# TYPE smartload_pzem_stale gauge\nsmartload_pzem_stale %d\n", pzemStale ? 1 : 0);
+
+  res->printf("# TYPE smartload_uptime_seconds gauge\nsmartload_uptime_seconds %u\n", (unsigned)(millis() / 1000));
+  res->printf("# TYPE smartload_clock_synced gauge\nsmartload_clock_synced %d\n", clockSynced ? 1 : 0);
+  if(bootToFirstLogUs) res->printf("# TYPE smartload_boot_to_first_log_seconds gauge\nsmartload_boot_to_first_log_seconds %.3f\n", bootToFirstLogUs / 1e6);
+  res->printf("# TYPE smartload_ready gauge\nsmartload_ready %d\n", systemReady ? 1 : 0);
+  res->printf("# TYPE smartload_paused gauge\nsmartload_paused %d\n", currentStatus.paused ? 1 : 0);
+  res->printf("# TYPE smartload_remaining_pct gauge\nsmartload_remaining_pct %.2f\n", (double)currentStatus.remainingPct);
+  res->printf("# TYPE smartload_used_kwh gauge\nsmartload_used_kwh %.6f\n", currentStatus.usedKWh);
+  res->printf("# TYPE smartload_power_watts gauge\nsmartload_power_watts %.1f\n", lastPowerW);
+  res->printf("# TYPE smartload_voltage_volts gauge\nsmartload_voltage_volts %.1f\n", lastVoltageV);
+  res->printf("# TYPE smartload_current_amperes gauge\nsmartload_current_amperes %.3f\n", lastCurrentA);
+  req->send(res);
+}
+
+/* ===================== MQTT telemetry (optional) ===================== */
+// A small MQTT 3.1.1 publisher on AsyncTCP, on when mqtt_host is set. loop()
+// only encodes messages into a fixed ring of slots; CONNECT, PUBLISH, PUBACK
+// and keepalive all run in AsyncTCP callbacks, so a dead or slow broker never
+// holds the control loop. Topics under smartload/<id>/:
+//   status   QoS 1, retained: on change, checked at 1 Hz, plus a heartbeat
+//   zone     QoS 1: every zone change
+//   samples  QoS 0: one batch per MQTT_BATCH_MS of the 1 Hz meter readings;
+//            a reading equal to the one before it is left out
+// With the broker unreachable the ring keeps the newest MQTT_SLOTS messages.
+static const uint32_t MQTT_BATCH_MS   = 10000;
+static const uint32_t MQTT_STATUS_MS  = 60000;   // heartbeat for the retained status
+static const uint32_t MQTT_RETRY_MS   = 5000;
+static const uint32_t MQTT_ACK_MS     = 10000;
+static const uint32_t MQTT_CONNACK_MS = 10000;   // TCP connect + CONNECT to CONNACK
+static const uint16_t MQTT_KEEPALIVE  = 30;      // s
+static const uint8_t  MQTT_SLOTS      = 12;
+static const size_t   MQTT_MSG_MAX    = 1024;
+static const uint8_t  MQTT_BATCH_MAX  = 10;      // MQTT_BATCH_MS of 1 Hz readings
+
+struct MqttSlot { uint16_t len, idOff; uint8_t qos; uint8_t pkt[MQTT_MSG_MAX]; };
+enum MqttState : uint8_t { MQ_DOWN, MQ_CONNECTING, MQ_UP };
+static MqttSlot*    mqRing = nullptr;
+static uint8_t      mqHead = 0, mqCount = 0;
+static bool         mqHeadBusy = false;          // head being handed to the socket
+static portMUX_TYPE mqMux = portMUX_INITIALIZER_UNLOCKED;
+static AsyncClient* mqClient = nullptr;
+static volatile MqttState mqState = MQ_DOWN;
+static volatile bool mqAwaitAck = false;
+static uint16_t     mqAwaitId = 0, mqNextId = 1;
+static uint32_t     mqLastTxMs = 0, mqAckSentMs = 0, mqLastTryMs = 0;
+static MqttBroker   mqUse = {};                  // loop()'s copy of mqBroker
+static String       mqPrefix;
+
+static size_t mqttRemLen(uint8_t* p, size_t n){
+  size_t k = 0;
+  do { uint8_t b = n & 0x7F; n >>= 7; p[k++] = n ? (b | 0x80) : b; } while (n);
+  return k;
+}
+// Encodes a PUBLISH into the ring, dropping the oldest message when full.
+static bool mqttEnqueue(const char* topic, const char* payload, size_t plen, uint8_t qos, bool retain){
+  if (!mqRing) return false;
+  char full[64]; snprintf(full, sizeof(full), "%s/%s", mqPrefix.c_str(), topic);
+  size_t tlen = strlen(full);
+  size_t rem = 2 + tlen + (qos ? 2 : 0) + plen;
+  if (rem + 5 > MQTT_MSG_MAX){ mqttDropped++; return false; }
+  portENTER_CRITICAL(&mqMux);
+  if (mqCount == MQTT_SLOTS){
+    if (mqHeadBusy){ portEXIT_CRITICAL(&mqMux); mqttDropped++; return false; }
+    if (mqAwaitAck) mqAwaitAck = false;   // its PUBACK will find nothing
+    mqHead = (mqHead + 1) % MQTT_SLOTS; mqCount--;
+    mqttDropped++;
+  }
+  MqttSlot& s = mqRing[(mqHead + mqCount) % MQTT_SLOTS];
+  portEXIT_CRITICAL(&mqMux);
+  uint8_t* p = s.pkt;
+  *p++ = (uint8_t)(0x30 | (qos << 1) | (retain ? 1 : 0));
+  p += mqttRemLen(p, rem);
+  *p++ = (uint8_t)(tlen >> 8); *p++ = (uint8_t)tlen;
+  memcpy(p, full, tlen); p += tlen;
+  s.idOff = (uint16_t)(p - s.pkt);
+  if (qos){ *p++ = 0; *p++ = 0; }   // packet id, set when sent
+  memcpy(p, payload, plen); p += plen;
+  s.len = (uint16_t)(p - s.pkt); s.qos = qos;
+  portENTER_CRITICAL(&mqMux);
+  mqCount++;   // only loop() appends, so the slot is still ours
+  portEXIT_CRITICAL(&mqMux);
+  return true;
+}
+static void mqttPopHead(){
+  portENTER_CRITICAL(&mqMux);
+  if (mqCount){ mqHead = (mqHead + 1) % MQTT_SLOTS; mqCount--; }
+  portEXIT_CRITICAL(&mqMux);
+}
+// AsyncTCP side: sends queued messages while the socket has room. One QoS 1
+// message is in flight at a time, which keeps ordering and retries simple.
+static void mqttPump(AsyncClient* c){
+  while (mqState == MQ_UP && !mqAwaitAck){
+    portENTER_CRITICAL(&mqMux);
+    MqttSlot* s = mqCount ? &mqRing[mqHead] : nullptr;
+    if (s) mqHeadBusy = true;
+    portEXIT_CRITICAL(&mqMux);
+    if (!s) return;
+    if (c->space() < s->len){ mqHeadBusy = false; return; }
+    if (s->qos){
+      uint16_t id = mqNextId++; if (!mqNextId) mqNextId = 1;
+      s->pkt[s->idOff] = (uint8_t)(id >> 8); s->pkt[s->idOff + 1] = (uint8_t)id;
+      mqAwaitId = id; mqAwaitAck = true; mqAckSentMs = millis();
+    }
+    c->add((const char*)s->pkt, s->len);
+    c->send();
+    mqLastTxMs = millis();
+    mqttBytes += s->len;
+    mqHeadBusy = false;
+    if (!s->qos){ mqttPopHead(); mqttPublished++; }
+  }
+}
+static void mqttOnConnect(void*, AsyncClient* c){
+  char id[24]; snprintf(id, sizeof(id), "smartload-%06x", (unsigned)(ESP.getEfuseMac() & 0xFFFFFF));
+  size_t idLen = strlen(id);
+  uint8_t pkt[48]; uint8_t* p = pkt;
+  *p++ = 0x10;
+  p += mqttRemLen(p, 10 + 2 + idLen);
+  const uint8_t vh[10] = { 0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, (uint8_t)(MQTT_KEEPALIVE >> 8), (uint8_t)MQTT_KEEPALIVE };
+  memcpy(p, vh, sizeof(vh)); p += sizeof(vh);
+  *p++ = 0; *p++ = (uint8_t)idLen;
+  memcpy(p, id, idLen); p += idLen;
+  c->add((const char*)pkt, p - pkt);
+  c->send();
+  mqLastTxMs = millis();
+}
+static void mqttOnData(void*, AsyncClient* c, void* data, size_t len){
+  const uint8_t* d = (const uint8_t*)data;
+  for (size_t i = 0; i + 2 <= len; i += 2 + d[i + 1]){   // broker replies here are all < 128 bytes
+    uint8_t type = d[i] >> 4;
+    if (type == 2 && i + 4 <= len){   // CONNACK
+      if (d[i + 3] == 0){ mqState = MQ_UP; mqAwaitAck = false; mqttConnects++; }
+      else c->close();
+    } else if (type == 4 && i + 4 <= len){   // PUBACK
+      uint16_t id = (uint16_t)(d[i + 2] << 8 | d[i + 3]);
+      if (mqAwaitAck && id == mqAwaitId){ mqAwaitAck = false; mqttPopHead(); mqttPublished++; }
+    }
+  }
+  mqttPump(c);
+}
+static void mqttOnPoll(void*, AsyncClient* c){
+  if (mqState == MQ_CONNECTING && millis() - mqLastTryMs > MQTT_CONNACK_MS){ c->close(); return; }   // no CONNACK
+  if (mqState != MQ_UP) return;
+  if (mqAwaitAck && millis() - mqAckSentMs > MQTT_ACK_MS){ c->close(); return; }   // resent after reconnect
+  if (millis() - mqLastTxMs > MQTT_KEEPALIVE * 500UL){
+    static const uint8_t ping[2] = { 0xC0, 0x00 };
+    if (c->space() >= 2){ c->add((const char*)ping, 2); c->send(); mqLastTxMs = millis(); }
+  }
+  mqttPump(c);
+}
+static void mqttOnAck(void*, AsyncClient* c, size_t, uint32_t){ mqttPump(c); }
+static void mqttOnDisconnect(void*, AsyncClient*){ mqState = MQ_DOWN; mqAwaitAck = false; }
+
+// loop(): connection upkeep and message production; never waits on the network.
+static struct { uint32_t t0; uint8_t n; int32_t dt[MQTT_BATCH_MAX], p[MQTT_BATCH_MAX], v[MQTT_BATCH_MAX], ma[MQTT_BATCH_MAX]; } mqBatch;
+static int32_t  mqLastP = INT32_MIN, mqLastV = 0, mqLastMa = 0;
+static uint32_t mqSampleMs = 0, mqStatusMs = 0, mqStatusHash = 0;
+static uint8_t  mqZoneSeen = 0xFF;
+static uint32_t mqRatePub = 0, mqRateMs = 0;
+static float    mqRateMsgsPerS = 0;
+static void mqttTick(){
+  if (mqBroker.gen != mqUse.gen){   // (re)configured: host or port
+    mqttBrokerGet(mqUse);
+    if (mqClient && mqState != MQ_DOWN){ mqClient->close(true); mqState = MQ_DOWN; }
+    mqLastTryMs = millis() - MQTT_RETRY_MS;
+  }
+  if (!mqUse.host[0]) return;
+  if (!mqRing){
+    uint32_t caps = psramFound() ? (MALLOC_CAP_SPIRAM|MALLOC_CAP_8BIT) : MALLOC_CAP_8BIT;
+    mqRing = (MqttSlot*)heap_caps_malloc(sizeof(MqttSlot) * MQTT_SLOTS, caps);
+    char pre[24]; snprintf(pre, sizeof(pre), "smartload/%06x", (unsigned)(ESP.getEfuseMac() & 0xFFFFFF));
+    mqPrefix = pre;
+    if (!mqRing) return;
+  }
+  if (!mqClient){
+    mqClient = new AsyncClient();
+    mqClient->onConnect(mqttOnConnect);
+    mqClient->onData(mqttOnData);
+    mqClient->onAck(mqttOnAck);
+    mqClient->onPoll(mqttOnPoll);
+    mqClient->onDisconnect(mqttOnDisconnect);
+    mqClient->onError([](void*, AsyncClient*, int8_t){ mqState = MQ_DOWN; });
+  }
+  // onPoll only runs once TCP is up; a connect that never completes ends here
+  if (mqState == MQ_CONNECTING && millis() - mqLastTryMs > 2 * MQTT_CONNACK_MS){ mqClient->close(true); mqState = MQ_DOWN; }
+  if (mqState == MQ_DOWN && millis() - mqLastTryMs >= MQTT_RETRY_MS){
+    mqLastTryMs = millis();
+    mqState = MQ_CONNECTING;
+    if (!mqClient->connect(mqUse.host, mqUse.port)) mqState = MQ_DOWN;
+  }
+
+  char buf[512];
+  if (currentZone != mqZoneSeen){
+    int n = snprintf(buf, sizeof(buf), "{\"t\":%u,\"zone\":%u,\"from\":%d}", (unsigned)clockEpoch(), (unsigned)currentZone,
+                     mqZoneSeen == 0xFF ? -1 : (int)mqZoneSeen);
+    mqttEnqueue("zone", buf, n, 1, false);
+    mqZoneSeen = currentZone;
+  }
+  if (millis() - mqSampleMs < 1000) return;
+  mqSampleMs = millis();
+
+  const Status& s = currentStatus;
+  int n = snprintf(buf, sizeof(buf),
+    "{\"zone\":%u,\"paused\":%s,\"budget_kwh\":%.6f,\"used_kwh\":%.6f,\"remaining_kwh\":%.6f,\"remaining_pct\":%.1f,\"relays\":[%d,%d,%d,%d]}",
+    (unsigned)currentZone, s.paused ? "true" : "false", s.budget, s.usedKWh, s.remKWh, s.remainingPct, s.p1, s.p2, s.p3, s.p4);
+  uint32_t h = crc32(buf, n);
+  if (h != mqStatusHash || millis() - mqStatusMs >= MQTT_STATUS_MS){
+    mqttEnqueue("status", buf, n, 1, true);
+    mqStatusHash = h; mqStatusMs = millis();
+  }
+
+  uint32_t now = clockEpoch();
+  int32_t p = (int32_t)lround(lastPowerW * 10), v = (int32_t)lround(lastVoltageV * 10), ma = (int32_t)lround(lastCurrentA * 1000);
+  mqttSamples++;
+  if (!mqBatch.t0) mqBatch.t0 = now;
+  if (p == mqLastP && v == mqLastV && ma == mqLastMa) mqttCoalesced++;
+  else if (mqBatch.n < MQTT_BATCH_MAX){
+    uint8_t i = mqBatch.n++;
+    mqBatch.dt[i] = (int32_t)(now - mqBatch.t0); mqBatch.p[i] = p; mqBatch.v[i] = v; mqBatch.ma[i] = ma;
+    mqLastP = p; mqLastV = v; mqLastMa = ma;
+  }
+  if (now - mqBatch.t0 >= MQTT_BATCH_MS / 1000 || mqBatch.n == MQTT_BATCH_MAX){
+    if (mqBatch.n){   // [seconds after t0, W, V, A]; missing seconds repeat the row before
+      int k = snprintf(buf, sizeof(buf), "{\"t0\":%u,\"s\":[", (unsigned)mqBatch.t0);
+      for (uint8_t i = 0; i < mqBatch.n && k < (int)sizeof(buf) - 48; i++)
+        k += snprintf(buf + k, sizeof(buf) - k, "%s[%d,%.1f,%.1f,%.3f]", i ? "," : "",
+                      (int)mqBatch.dt[i], mqBatch.p[i] / 10.0, mqBatch.v[i] / 10.0, mqBatch.ma[i] / 1000.0);
+      k += snprintf(buf + k, sizeof(buf) - k, "]}");
+      if (mqttEnqueue("samples", buf, k, 0, false)) mqttSampleBytes += k;
+    }
+    mqBatch.t0 = 0; mqBatch.n = 0;
+    // throughput over the batch window, for /api/mqtt
+    uint32_t pub = mqttPublished, ms = millis();
+    if (mqRateMs) mqRateMsgsPerS = (pub - mqRatePub) * 1000.0f / (float)(ms - mqRateMs);
+    mqRatePub = pub; mqRateMs = ms;
+  }
+}
+
+static void handleMqttStats(AsyncWebServerRequest* req){
+  if (!hasAuth(req)) { req->send(401); return; }
+  ArenaLease lease(req);
+  JsonDocument d(lease.alloc());
+  MqttBroker b; mqttBrokerGet(b);
+  d["enabled"]   = b.host[0] != 0;
+  d["connected"] = mqState == MQ_UP;
+  d["broker"]    = b.host;
+  d["port"]      = b.port;
+  d["queued"]    = mqCount;
+  d["published"] = mqttPublished.load();
+  d["bytes"]     = mqttBytes.load();
+  d["dropped"]   = mqttDropped.load();
+  d["connects"]  = mqttConnects.load();
+  d["samples"]   = mqttSamples.load();
+  d["coalesced"] = mqttCoalesced.load();
+  d["msgs_per_s"] = mqRateMsgsPerS;
+  d["bytes_per_sample"] = mqttSamples ? (float)mqttSampleBytes.load() / (float)mqttSamples.load() : 0.0f;
+  sendJson(req, d, lease.a);
+}
+
+/* ===================== OTA update (compressed, into the inactive slot) ===================== */
+// POST /api/ota?sha256=<hex of the uncompressed image>, body = firmware.bin,
+// raw or gzipped (gzip -9n, roughly half the bytes over the AP link). Send it
+// as application/octet-stream; a form content type never reaches the body hook:
+//   curl -b SID=... -H "Content-Type: application/octet-stream" --data-binary @firmware.bin.gz
+//        "http://192.168.4.1/api/ota?sha256=$(sha256sum firmware.bin | cut -c1-64)"
+// The body is inflated as it arrives, by the ROM tinfl through its 32 KB
+// window, straight into the inactive ota_0/ota_1 slot, so RAM use is one fixed
+// OtaJob whatever the image size. All of it runs in the async_tcp body
+// callback; loop() keeps metering and switching relays throughout.
+// The new image boots on trial: it has to reach controlReady and stay up for
+// OTA_SOAK_MS within OTA_TRIAL_BOOTS boots, or the previous slot boots again.
+static const uint32_t OTA_WINDOW      = TINFL_LZ_DICT_SIZE;   // deflate's max distance
+static const uint32_t OTA_DEADLINE_MS = 120000;   // controlReady by then
+static const uint32_t OTA_SOAK_MS     = 30000;    // then stay up this long
+static const uint8_t  OTA_TRIAL_BOOTS = 3;
+
+enum OtaPhase : uint8_t { OTA_IDLE, OTA_RECEIVING, OTA_DONE, OTA_FAILED };
+enum OtaGzState : uint8_t { GZ_FIXED, GZ_XLEN, GZ_XDATA, GZ_NAME, GZ_COMMENT, GZ_HCRC, GZ_BODY, GZ_BAD };
+struct OtaJob {
+  tinfl_decompressor inf;
+  uint8_t  window[OTA_WINDOW];
+  size_t   winPos;
+  mbedtls_sha256_context sha;
+  uint8_t  want[32];
+  bool     gzip, end;
+  uint8_t  gzState, gzFlags, gzN;
+  uint16_t gzSkip;
+};
+static OtaJob*                otaJob = nullptr;
+static AsyncWebServerRequest* otaOwner = nullptr;   // the upload holding otaJob
+static volatile OtaPhase      otaPhase = OTA_IDLE;
+static const char*            otaError = "";
+static uint32_t otaBytesIn = 0, otaBytesOut = 0, otaStartMs = 0, otaMs = 0;
+static volatile uint32_t otaRebootAtMs = 0;
+static bool     otaTrial = false;     // this boot is a new image on trial
+static uint32_t otaReadyMs = 0;
+static char     otaPrev[17] = "";     // slot to go back to
+
+static void otaRollback(const char* why){
+  Serial.printf("[OTA] rolling back to %s: %s\n", otaPrev, why);
+  Preferences p;
+  if(p.begin("ota", false)){ p.putBool("trial", false); p.end(); }
+  esp_ota_img_states_t st;
+  if(esp_ota_get_state_partition(esp_ota_get_running_partition(), &st) == ESP_OK && st == ESP_OTA_IMG_PENDING_VERIFY)
+    esp_ota_mark_app_invalid_rollback_and_reboot();   // bootloader-managed rollback, when built in
+  const esp_partition_t* prev = esp_partition_find_first(ESP_PARTITION_TYPE_APP, (esp_partition_subtype_t)ESP_PARTITION_SUBTYPE_ANY, otaPrev);
+  if(prev) esp_ota_set_boot_partition(prev);
+  delay(100);
+  ESP.restart();
+}
+
+// Early in setup(): counts the boots of an image on trial and goes back once
+// it has used them up (panics and watchdog resets land here too).
+static void otaBootCheck(){
+  Preferences p;
+  if(!p.begin("ota", false)) return;
+  otaTrial = p.getBool("trial", false);
+  if(otaTrial){
+    uint8_t boots = p.getUChar("boots", 0) + 1;
+    p.putUChar("boots", boots);
+    p.getString("prev", otaPrev, sizeof(otaPrev));
+    p.end();
+    if(boots > OTA_TRIAL_BOOTS){ otaRollback("no healthy boot"); return; }
+    Serial.printf("[OTA] trial boot %u/%u of %s\n", (unsigned)boots, (unsigned)OTA_TRIAL_BOOTS, esp_ota_get_running_partition()->label);
+    return;
+  }
+  p.end();
+}
+
+// loop(): restarts after a finished upload, and settles a trial boot.
+static void otaTick(){
+  uint32_t now = millis();
+  if(otaRebootAtMs && (int32_t)(now - otaRebootAtMs) >= 0){
+    configCommitMaybe(true);
+    savePauseSnapshot();
+    ESP.restart();
+  }
+  if(!otaTrial) return;
+  if(!controlReady){
+    if(now > OTA_DEADLINE_MS) otaRollback("not ready in time");
+    return;
+  }
+  if(!otaReadyMs) otaReadyMs = now;
+  if(now - otaReadyMs < OTA_SOAK_MS) return;
+  otaTrial = false;
+  esp_ota_mark_app_valid_cancel_rollback();
+  Preferences p;
+  if(p.begin("ota", false)){ p.putBool("trial", false); p.end(); }
+  Serial.println("[OTA] new image confirmed");
+}
+
+// Flags after the fixed gzip header, in file order (RFC 1952).
+static uint8_t otaGzNext(OtaJob& j, uint8_t from){
+  if(from < GZ_XLEN    && (j.gzFlags & 0x04)) return GZ_XLEN;
+  if(from < GZ_NAME    && (j.gzFlags & 0x08)) return GZ_NAME;
+  if(from < GZ_COMMENT && (j.gzFlags & 0x10)) return GZ_COMMENT;
+  if(from < GZ_HCRC    && (j.gzFlags & 0x02)){ j.gzN = 0; return GZ_HCRC; }
+  return GZ_BODY;
+}
+// Consumes gzip header bytes; returns how many. Leaves gzState at GZ_BODY once
+// the deflate data starts, GZ_BAD on a header this can't take.
+static size_t otaGzHeader(OtaJob& j, const uint8_t* d, size_t len){
+  size_t i = 0;
+  while(i < len && j.gzState < GZ_BODY){
+    uint8_t b = d[i++];
+    switch(j.gzState){
+      case GZ_FIXED:
+        if((j.gzN == 0 && b != 0x1F) || (j.gzN == 1 && b != 0x8B) || (j.gzN == 2 && b != 8) || (j.gzN == 3 && (b & 0xE0))){
+          j.gzState = GZ_BAD; break;
+        }
+        if(j.gzN == 3) j.gzFlags = b;
+        if(++j.gzN == 10){ j.gzN = 0; j.gzState = otaGzNext(j, GZ_FIXED); }
+        break;
+      case GZ_XLEN:
+        j.gzSkip |= (uint16_t)b << (8 * j.gzN);
+        if(++j.gzN == 2) j.gzState = j.gzSkip ? GZ_XDATA : otaGzNext(j, GZ_XDATA);
+        break;
+      case GZ_XDATA:  if(--j.gzSkip == 0) j.gzState = otaGzNext(j, GZ_XDATA); break;
+      case GZ_NAME:
+      case GZ_COMMENT: if(!b) j.gzState = otaGzNext(j, j.gzState); break;
+      case GZ_HCRC:   if(++j.gzN == 2) j.gzState = GZ_BODY; break;
+    }
+  }
+  return i;
+}
+
+static bool otaWrite(OtaJob& j, uint8_t* p, size_t n){
+  mbedtls_sha256_update(&j.sha, p, n);
+  if(Update.write(p, n) != n){ otaError = Update.errorString(); return false; }
+  otaBytesOut += n;
+  return true;
+}
+// Inflates body bytes into the slot; the window doubles as the write buffer.
+static bool otaInflate(OtaJob& j, const uint8_t* in, size_t len){
+  while(!j.end){
+    size_t inN = len, outN = OTA_WINDOW - j.winPos;
+    tinfl_status st = tinfl_decompress(&j.inf, in, &inN, j.window, j.window + j.winPos, &outN, TINFL_FLAG_HAS_MORE_INPUT);
+    in += inN; len -= inN;
+    if(outN && !otaWrite(j, j.window + j.winPos, outN)) return false;
+    j.winPos = (j.winPos + outN) & (OTA_WINDOW - 1);
+    if(st == TINFL_STATUS_DONE) j.end = true;   // what follows is the gzip trailer
+    else if(st < 0){ otaError = "corrupt gzip data"; return false; }
+    else if(st == TINFL_STATUS_NEEDS_MORE_INPUT) break;
+  }
+  return true;
+}
+
+static void otaRelease(){
+  if(otaJob){ mbedtls_sha256_free(&otaJob->sha); free(otaJob); otaJob = nullptr; }
+  otaOwner = nullptr;
+}
+static void otaFail(AsyncWebServerRequest* req, int code, const char* why){
+  Update.abort();
+  otaRelease();
+  otaError = why; otaPhase = OTA_FAILED; otaFailures++;
+  Serial.printf("[OTA] failed after %u bytes: %s\n", (unsigned)otaBytesIn, why);
+  if(req) req->send(code, "text/plain", why);
+}
+
+static bool otaParseSha(const String& hex, uint8_t out[32]){
+  if(hex.length() != 64) return false;
+  for(int i = 0; i < 64; i++){
+    char c = hex[i];
+    int v = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+    if(v < 0) return false;
+    out[i / 2] = (i & 1) ? (out[i / 2] | v) : (uint8_t)(v << 4);
+  }
+  return true;
+}
+
+// POST /api/ota  (body streamed, see above)
+void handleOtaBody(AsyncWebServerRequest* req, uint8_t* data, size_t len, size_t index, size_t total){
+  if(index == 0){
+    if(!hasAuth(req)){ req->send(401); return; }
+    if(otaOwner || otaRebootAtMs){ req->send(409, "text/plain", "Update already in progress"); return; }
+    uint8_t want[32];
+    const AsyncWebParameter* h = req->getParam("sha256");
+    if(!h || !otaParseSha(h->value(), want)){ req->send(400, "text/plain", "Missing or bad sha256"); return; }
+    OtaJob* j = (OtaJob*)malloc(sizeof(OtaJob));
+    if(!j){ req->send(503, "text/plain", "Not enough memory"); return; }
+    if(!Update.begin(UPDATE_SIZE_UNKNOWN)){ free(j); req->send(500, "text/plain", Update.errorString()); return; }
+    memcpy(j->want, want, sizeof(want));
+    j->gzip = len && data[0] == 0x1F;
+    j->end = false; j->winPos = 0;
+    j->gzState = GZ_FIXED; j->gzFlags = 0; j->gzN = 0; j->gzSkip = 0;
+    tinfl_init(&j->inf);
+    mbedtls_sha256_init(&j->sha);
+    mbedtls_sha256_starts(&j->sha, 0);
+    otaJob = j; otaOwner = req; otaPhase = OTA_RECEIVING; otaError = "";
+    otaBytesIn = otaBytesOut = 0; otaStartMs = millis();
+    reqOnDisconnect(req, [req](){ if(otaOwner == req) otaFail(nullptr, 0, "client went away"); });
+    Serial.printf("[OTA] receiving %u bytes (%s) into %s\n", (unsigned)total, j->gzip ? "gzip" : "raw",
+                  esp_ota_get_next_update_partition(nullptr)->label);
+  } else if(req != otaOwner) return;   // already answered
+
+  OtaJob& j = *otaJob;
+  otaBytesIn += len;
+  if(j.gzip){
+    size_t used = j.gzState < GZ_BODY ? otaGzHeader(j, data, len) : 0;
+    if(j.gzState == GZ_BAD){ otaFail(req, 400, "unsupported gzip header"); return; }
+    if(j.gzState == GZ_BODY && !otaInflate(j, data + used, len - used)){ otaFail(req, 422, otaError); return; }
+  } else if(!otaWrite(j, data, len)){ otaFail(req, 422, otaError); return; }
+  if(index + len != total) return;
+
+  if(j.gzip && !j.end){ otaFail(req, 400, "truncated gzip stream"); return; }
+  uint8_t got[32];
+  mbedtls_sha256_finish(&j.sha, got);
+  if(memcmp(got, j.want, sizeof(got)) != 0){ otaFail(req, 422, "SHA-256 mismatch"); return; }
+  if(!Update.end(true)){ otaFail(req, 500, Update.errorString()); return; }   // also switches the boot slot
+
+  Preferences p;
+  if(p.begin("ota", false)){
+    p.putString("prev", esp_ota_get_running_partition()->label);
+    p.putUChar("boots", 0);
+    p.putBool("trial", true);
+    p.end();
+  }
+  otaRelease();
+  otaMs = millis() - otaStartMs;
+  otaPhase = OTA_DONE; otaUpdates++;
+  Serial.printf("[OTA] %u -> %u bytes in %u ms, restarting\n", (unsigned)otaBytesIn, (unsigned)otaBytesOut, (unsigned)otaMs);
+  char out[128];
+  snprintf(out, sizeof(out), "{\"ok\":true,\"bytes_in\":%u,\"bytes_out\":%u,\"ms\":%u,\"restarting\":true}",
+           (unsigned)otaBytesIn, (unsigned)otaBytesOut, (unsigned)otaMs);
+  req->send(200, "application/json", out);
+  otaRebootAtMs = (millis() + 1500) | 1;   // let the reply go out first
+}
+
+// GET /api/ota  -> slots and the state of the last upload
+static void handleOtaStatus(AsyncWebServerRequest* req){
+  if (!hasAuth(req)) { req->send(401); return; }
+  ArenaLease lease(req);
+  JsonDocument d(lease.alloc());
+  static const char* const PHASES[] = { "idle", "receiving", "done", "failed" };
+  d["running"]   = esp_ota_get_running_partition()->label;
+  d["next"]      = esp_ota_get_next_update_partition(nullptr)->label;
+  d["trial"]     = otaTrial;
+  d["phase"]     = PHASES[otaPhase];
+  d["error"]     = otaError;
+  d["bytes_in"]  = otaBytesIn;
+  d["bytes_out"] = otaBytesOut;
+  d["ms"]        = otaMs;
+  d["ratio"]     = otaBytesOut ? (float)otaBytesIn / (float)otaBytesOut : 0.0f;
+  sendJson(req, d, lease.a);
+}
+
+/* ===================== HTTP APIs ===================== */
+void handleStatus(AsyncWebServerRequest*req){
+  ArenaLease lease(req);
+  JsonDocument doc(lease.alloc());
+  doc["remainingPct"]=currentStatus.remainingPct;
+  doc["usedKWh"]=currentStatus.usedKWh;
+  doc["remKWh"]=currentStatus.remKWh;
+  doc["p1"]=currentStatus.p1; doc["p2"]=currentStatus.p2; doc["p3"]=currentStatus.p3; doc["p4"]=currentStatus.p4;
+  doc["paused"]=currentStatus.paused;
+  doc["budget"]=currentStatus.budget;
+  doc["show_usage_graph"]=appcfg.show_usage_graph;
+  doc["show_prio_status"]=appcfg.show_prio_status;
+  doc["show_prio_controls"]=appcfg.show_prio_controls;
+  doc["depleted"] = (currentStatus.remKWh <= 0.0 || currentStatus.remainingPct <= 0.0f);
+  doc["powerW"]   = lastPowerW;
+  doc["voltageV"] = lastVoltageV;
+  doc["currentA"] = lastCurrentA;
+  doc["energy_raw_kwh"]     = lastGoodTotal;
+  doc["energy_virtual_kwh"] = virtualTotalCached();
+  doc["ready"] = systemReady;
+  doc["control_ready"] = controlReady;
+
+  sendJson(req, doc, lease.a);
+}
+
+// GET /api/history/recent?since=<seq>[&max=<n>]  -> samples with seq > since, oldest
+// first (at most the newest n, capped at what a graph can draw); the last sample
+// is always `seq`, so clients just remember that for next time. Streamed a few
+// samples per chunk, so a full resync never builds the whole body in RAM.
+static const uint32_t HIST_SEND_MAX = 2048;
+struct HistStream {
+  uint32_t seq, last;
+  bool     first = true, done = false;
+  char     line[96];
+  size_t   lineLen = 0, linePos = 0;
+};
+// Formats the next piece into s.line; false when the response is complete.
+static bool histStreamNext(HistStream& s){
+  if (s.done) return false;
+  if (s.seq > s.last){
+    s.lineLen = snprintf(s.line, sizeof(s.line), "]}");
+    s.done = true;
+    return true;
+  }
+  HistSample h;
+  portENTER_CRITICAL(&histMux);
+  if (histSeq > s.seq + HIST_CAP - 1) s.seq = histSeq - HIST_CAP + 1;   // overwritten while streaming; skip ahead
+  h = histRing[s.seq % HIST_CAP];
+  portEXIT_CRITICAL(&histMux);
+  s.lineLen = snprintf(s.line, sizeof(s.line), s.first ? "[%.6g,%.6g]" : ",[%.6g,%.6g]",
+                       (double)halfToFloat(h.used), (double)halfToFloat(h.rem));
+  s.first = false;
+  s.seq++;
+  return true;
+}
+void handleHistoryRecent(AsyncWebServerRequest* req){
+  uint32_t since = 0, maxN = HIST_SEND_MAX;
+  if(req->hasParam("since")) since = (uint32_t)strtoul(req->getParam("since")->value().c_str(), nullptr, 10);
+  if(req->hasParam("max"))   maxN  = (uint32_t)strtoul(req->getParam("max")->value().c_str(), nullptr, 10);
+  if(!maxN || maxN > HIST_SEND_MAX) maxN = HIST_SEND_MAX;
+
+  portENTER_CRITICAL(&histMux);
+  uint32_t last = histSeq;
+  portEXIT_CRITICAL(&histMux);
+
+  uint32_t oldest = (last > HIST_CAP) ? last - HIST_CAP + 1 : 1;
+  uint32_t first  = max(since + 1, oldest);
+  if(since > last) first = oldest;          // device rebooted: client must resync
+  if(last >= maxN && first < last - maxN + 1) first = last - maxN + 1;
+
+  auto st = std::make_shared<HistStream>();
+  st->seq = first; st->last = last;
+  st->lineLen = snprintf(st->line, sizeof(st->line), "{\"seq\":%u,\"period_ms\":%u,\"budget\":%.6f,\"samples\":[",
+                         (unsigned)last, (unsigned)HIST_PERIOD_MS, (double)budgetKWh);
+  AsyncWebServerResponse* res = req->beginChunkedResponse("application/json",
+    [st](uint8_t* buf, size_t maxLen, size_t) -> size_t {
+      HistStream& s = *st;
+      size_t out = 0;
+      while (out < maxLen){
+        if (s.linePos < s.lineLen){
+          size_t n = min(maxLen - out, s.lineLen - s.linePos);
+          memcpy(buf + out, s.line + s.linePos, n);
+          out += n; s.linePos += n;
+          continue;
+        }
+        if (!histStreamNext(s)) break;
+        s.linePos = 0;
+      }
+      return out;
+    });
+  res->addHeader("Cache-Control", "no-store");
+  req->send(res);
+}
+
+/* ===== Config HTTP handlers (REST) ===== */
+// POST /api/config/import  -> re-reads /config.csv from the card
+void handleConfigImport(AsyncWebServerRequest* req){
+  if(!hasAuth(req)){ req->send(401); return; }
+  if(!configImportCsv()){ req->send(503, "text/plain", "No readable /config.csv"); return; }
+  if(!appcfg.show_prio_controls) manualMask = 0;
+  req->send(200, "text/plain", "OK");
+}
+void handleConfigGet(AsyncWebServerRequest* req){
+  if(!hasAuth(req)){ req->send(401); return; }
+  ArenaLease lease(req);
+  JsonDocument d(lease.alloc());
+  d["username"]=appcfg.username;
+  d["budget_kwh"]=appcfg.budget_kwh;
+  d["show_usage_graph"]=appcfg.show_usage_graph;
+  d["show_prio_status"]=appcfg.show_prio_status;
+  d["show_prio_controls"]=appcfg.show_prio_controls;
+  d["pq_log"]=appcfg.pq_log;
+  d["mqtt_host"]=appcfg.mqtt_host;
+  d["mqtt_port"]=appcfg.mqtt_port;
+  sendJson(req, d, lease.a);
+}
+void handleConfigBody(AsyncWebServerRequest* req, uint8_t* data, size_t len, size_t index, size_t total){
+  if (!hasAuth(req)) { req->send(401); return; }
+  char* body = collectBody(req, data, len, index, total);
+  if (!body) return;
+  ReqArena* a = arenaFind(req);
+  JsonDocument d(a ? (ArduinoJson::Allocator*)a : &heapAlloc);
+
+  const char* u = nullptr;
+  const char* p = nullptr;
+  float  budget = appcfg.budget_kwh;
+  bool   sGraph = appcfg.show_usage_graph;
+  bool   sStatus= appcfg.show_prio_status;
+  bool   sCtrl  = appcfg.show_prio_controls;
+  bool   sPq    = appcfg.pq_log;
+  const char* mHost = nullptr;
+  long   mPort  = appcfg.mqtt_port;
+
+  if (contentTypeIs(req, "application/x-www-form-urlencoded") || contentTypeIs(req, "text/plain")) {
+    forEachFormField(body, [&](const char* key, const char* val){
+      if      (!strcasecmp(key,"username")) u = val;
+      else if (!strcasecmp(key,"password")) p = val;
+      else if (!strcasecmp(key,"budget_kwh")) budget = atof(val);
+      else if (!strcasecmp(key,"show_usage_graph")) sGraph = parseBoolStr(val);
+      else if (!strcasecmp(key,"show_prio_status")) sStatus= parseBoolStr(val);
+      else if (!strcasecmp(key,"show_prio_controls")) sCtrl = parseBoolStr(val);
+      else if (!strcasecmp(key,"pq_log")) sPq = parseBoolStr(val);
+      else if (!strcasecmp(key,"mqtt_host")) mHost = val;
+      else if (!strcasecmp(key,"mqtt_port")) mPort = atol(val);
+    });
+  } else {
+    // application/json, or anything unlabelled
+    if (deserializeJson(d, (const char*)body, total) == DeserializationError::Ok) {
       if (d["username"].is<const char*>()) u = d["username"].as<const char*>();
       if (d["password"].is<const char*>()) p = d["password"].as<const char*>();
       if (d["budget_kwh"].is<float>())     budget = d["budget_kwh"].as<float>();
       if (d["show_usage_graph"].is<bool>())    sGraph = d["show_usage_graph"].as<bool>();
       if (d["show_prio_status"].is<bool>())    sStatus= d["show_prio_status"].as<bool>();
       if (d["show_prio_controls"].is<bool>())  sCtrl  = d["show_prio_controls"].as<bool>();
+      if (d["pq_log"].is<bool>())              sPq    = d["pq_log"].as<bool>();
+      if (d["mqtt_host"].is<const char*>())    mHost  = d["mqtt_host"].as<const char*>();
+      if (d["mqtt_port"].is<long>())           mPort  = d["mqtt_port"].as<long>();
     }
   }
 
-  delete (String*)req->_tempObject; req->_tempObject=nullptr;
-
-  if (budget <= 0.0f) { req->send(400, "text/plain", "budget_kwh>0"); return; }
+  if (budget <= 0.0f) { arenaRelease(req); req->send(400, "text/plain", "budget_kwh>0"); return; }
+  if ((u && strlen(u) > 31) || (p && strlen(p) > 31)) { arenaRelease(req); req->send(400, "text/plain", "username/password: 31 chars max"); return; }
+  if (mPort < 1 || mPort > 65535 || (mHost && (strlen(mHost) > 63 || strchr(mHost, ',')))) {
+    arenaRelease(req); req->send(400, "text/plain", "Invalid MQTT broker"); return;
+  }
 
-  appcfg.username = u;
-  appcfg.password = p;
+  if (u) appcfg.username = u;
+  if (p) appcfg.password = p;
   appcfg.budget_kwh = budget;
   appcfg.show_usage_graph = sGraph;
   appcfg.show_prio_status = sStatus;
   appcfg.show_prio_controls = sCtrl;
+  appcfg.pq_log = sPq;
+  if (mHost) appcfg.mqtt_host = mHost;
+  appcfg.mqtt_port = (uint16_t)mPort;
 
   if(!appcfg.show_prio_controls) manualMask = 0;
 
   budgetKWh = appcfg.budget_kwh;
   currentStatus.budget = budgetKWh;
 
-  persistConfig();
-
-  JsonDocument out;
-  out["ok"] = true;
-  out["username"] = appcfg.username;
-  out["budget_kwh"] = appcfg.budget_kwh;
-  out["show_usage_graph"] = appcfg.show_usage_graph;
-  out["show_prio_status"] = appcfg.show_prio_status;
-  out["show_prio_controls"] = appcfg.show_prio_controls;
-  String s; serializeJson(out, s);
-  req->send(200, "application/json", s);
+  configChanged();
+
+  d.clear();
+  d["ok"] = true;
+  d["username"] = appcfg.username;
+  d["budget_kwh"] = appcfg.budget_kwh;
+  d["show_usage_graph"] = appcfg.show_usage_graph;
+  d["show_prio_status"] = appcfg.show_prio_status;
+  d["show_prio_controls"] = appcfg.show_prio_controls;
+  d["pq_log"] = appcfg.pq_log;
+  d["mqtt_host"] = appcfg.mqtt_host;
+  d["mqtt_port"] = appcfg.mqtt_port;
+  sendJson(req, d, a);
+  arenaRelease(req);
 }
 
 /* ===== CSV end-points ===== */
@@ -653,14 +2822,18 @@ bool isCsvNameSafe(String p) {
   }
   return true;
 }
+// GET /api/sd/csvs?dir=&skip=  -> [{name,size}]. A listing cut short by the
+// time slice says where to go on in X-Next-Skip.
 void handleCsvList(AsyncWebServerRequest* req) {
   if (!hasAuth(req)) { req->send(401); return; }
+  uint32_t skip = req->hasParam("skip") ? (uint32_t)req->getParam("skip")->value().toInt() : 0, seen = 0;
   String dir = "/";
   if (req->hasParam("dir")) {
     dir = req->getParam("dir")->value();
     if (dir.length()==0 || dir[0] != '/') dir = "/" + dir;
   }
-  if (!SD.begin(SD_CS)) { req->send(500, "application/json", "{\"error\":\"SD not mounted\"}"); return; }
+  SdLock lk(SD_PRIO_INTERACTIVE);
+  if (!lk) { req->send(503, "application/json", "{\"error\":\"SD not mounted\"}"); return; }
   File root = SD.open(dir);
   if (!root || !root.isDirectory()) { req->send(404, "application/json", "{\"error\":\"dir not found\"}"); return; }
 
@@ -671,7 +2844,7 @@ void handleCsvList(AsyncWebServerRequest* req) {
     if (!f) break;
     if (!f.isDirectory()) {
       String name = String(f.name()); String low=name; low.toLowerCase();
-      if (low.endsWith(".csv")) {
+      if (low.endsWith(".csv") && seen++ >= skip) {
         if (!first) res->print(",");
         first = false;
         res->print("{\"name\":\""); res->print(name);
@@ -679,9 +2852,7 @@ void handleCsvList(AsyncWebServerRequest* req) {
       }
     }
     f.close();
-    // yield to avoid watchdog on huge dirs
-    static uint32_t lastY = millis();
-    if (millis() - lastY > 10) { delay(0); lastY = millis(); }
+    if (sliceSpent()) { res->addHeader("X-Next-Skip", String(seen)); break; }
   }
   root.close();
   res->print("]");
@@ -694,78 +2865,144 @@ void handleCsvGet(AsyncWebServerRequest* req) {
   if (name.length()==0) { req->send(400, "text/plain", "Invalid name"); return; }
   if (name[0] != '/') name = "/" + name;
   if (!isCsvNameSafe(name)) { req->send(400, "text/plain", "Invalid or unsupported filename"); return; }
-  if (!SD.begin(SD_CS))      { req->send(500, "text/plain", "SD not mounted"); return; }
-  if (!SD.exists(name))      { req->send(404, "text/plain", "Not found"); return; }
-  AsyncWebServerResponse *res = req->beginResponse(SD, name, "text/csv");
-  if (req->hasParam("download")) {
-    String leaf = name.substring(name.lastIndexOf('/') + 1);
-    res->addHeader("Content-Disposition", "attachment; filename=\"" + leaf + "\"");
+  String leaf = name.substring(name.lastIndexOf('/') + 1);
+  sdStreamFile(req, name, "text/csv", req->hasParam("download") ? leaf.c_str() : nullptr);
+}
+
+// GET /api/sd/bench?name=<csv>[&bytes=N]  -> reads the first N bytes (at most
+// SD_BENCH_MAX) of one CSV twice, once through the Stream line path the log
+// handlers used to take and once through SdBlockReader, and reports throughput
+// for each. The reading runs in its own low-priority task that steps aside for
+// other SD users between lines; the response waits with RESPONSE_TRY_AGAIN.
+// One run at a time. tools/reader_bench.cpp is the host-side counterpart.
+static const uint32_t SD_BENCH_MAX = 1UL << 20;
+struct SdBench {
+  String   name;
+  uint32_t limit = 0;
+  std::atomic<bool>    busy{false}, done{false};
+  std::atomic<uint8_t> refs{0};   // task + response
+  char     out[256];
+  size_t   len = 0, pos = 0;
+};
+static SdBench sdBench;
+static void sdBenchRelease(){ if (--sdBench.refs == 0) sdBench.busy = false; }
+
+static void sdBenchTask(void*){
+  SdBench& b = sdBench;
+  uint32_t size = 0, lines0 = 0, lines1 = 0, legacyUs = 0, blockUs = 0;
+  bool ok = false;
+  {
+    SdLock lk(SD_PRIO_BULK);
+    File f = lk ? SD.open(b.name, "r") : File();
+    if (f) {
+      size = min((uint32_t)f.size(), b.limit);
+      uint32_t t0 = micros();
+      while (f.available() && f.position() < size) {
+        f.readStringUntil('\n');
+        if (++lines0 % 64 == 0) lk.yieldToHigher();
+      }
+      legacyUs = micros() - t0;
+
+      f.seek(0);
+      t0 = micros();
+      {
+        SdBlockReader rd(f);
+        while (rd.tell() < size && rd.next()) if (++lines1 % 64 == 0) lk.yieldToHigher();
+      }
+      blockUs = micros() - t0;
+      f.close();
+      ok = true;
+    }
+  }
+  auto mbps = [&](uint32_t us){ return us ? (double)size / us : 0.0; };   // bytes/us == MB/s
+  if (ok) b.len = snprintf(b.out, sizeof(b.out),
+    "{\"bytes\":%u,\"legacy\":{\"lines\":%u,\"us\":%u,\"mb_s\":%.3f},"
+    "\"block\":{\"lines\":%u,\"us\":%u,\"mb_s\":%.3f}}",
+    (unsigned)size, (unsigned)lines0, (unsigned)legacyUs, mbps(legacyUs),
+    (unsigned)lines1, (unsigned)blockUs, mbps(blockUs));
+  else b.len = snprintf(b.out, sizeof(b.out), "{\"error\":\"file could not be read\"}");
+  b.done = true;
+  sdBenchRelease();
+  vTaskDelete(NULL);
+}
+
+void handleSdBench(AsyncWebServerRequest* req) {
+  if (!hasAuth(req)) { req->send(401); return; }
+  if (!req->hasParam("name")) { req->send(400, "text/plain", "Missing name"); return; }
+  String name = req->getParam("name")->value();
+  if (name.length() && name[0] != '/') name = "/" + name;
+  if (!isCsvNameSafe(name)) { req->send(400, "text/plain", "Invalid or unsupported filename"); return; }
+  uint32_t limit = SD_BENCH_MAX;
+  if (req->hasParam("bytes")) limit = constrain(req->getParam("bytes")->value().toInt(), 1L, (long)SD_BENCH_MAX);
+  {
+    SdLock lk(SD_PRIO_BULK);
+    if (!lk) { sdBusy(req); return; }
+    if (!SD.exists(name)) { req->send(404, "text/plain", "Not found"); return; }
+  }
+  bool idle = false;
+  if (!sdBench.busy.compare_exchange_strong(idle, true)) {
+    AsyncWebServerResponse* r = req->beginResponse(503, "text/plain", "A benchmark is running");
+    r->addHeader("Retry-After", "5");
+    req->send(r);
+    return;
+  }
+  sdBench.name = name; sdBench.limit = limit;
+  sdBench.done = false; sdBench.len = sdBench.pos = 0;
+  sdBench.refs = 2;
+  if (xTaskCreatePinnedToCore(sdBenchTask, "sdBench", 4096, nullptr, 1, nullptr, 0) != pdPASS) {
+    sdBench.refs = 0; sdBench.busy = false;
+    req->send(503, "text/plain", "Out of memory");
+    return;
   }
+  std::shared_ptr<SdBench> hold(&sdBench, [](SdBench*){ sdBenchRelease(); });
+  AsyncWebServerResponse* res = req->beginChunkedResponse("application/json",
+    [hold](uint8_t* buf, size_t maxLen, size_t) -> size_t {
+      SdBench& b = *hold;
+      if (!b.done) return RESPONSE_TRY_AGAIN;
+      size_t n = min(maxLen, b.len - b.pos);
+      memcpy(buf, b.out + b.pos, n);
+      b.pos += n;
+      return n;
+    });
   req->send(res);
 }
 
 /* ===== Login/Logout ===== */
 void handleLoginBody(AsyncWebServerRequest* req, uint8_t* data, size_t len, size_t index, size_t total){
-  if (index==0) req->_tempObject = new String();
-  String* body = (String*)req->_tempObject;
-  body->reserve(total);
-  body->concat((const char*)data, len);
-  if (index + len != total) return;
-
-  String contentType="";
-  if (req->hasHeader("Content-Type")) contentType = req->getHeader("Content-Type")->value();
-  contentType.toLowerCase();
-
-  String u, p;
-
-  if (contentType.indexOf("application/json")>=0) {
-    JsonDocument d;
-    DeserializationError e = deserializeJson(d, *body);
-    if (!e) {
-      const char* uu = d["username"].is<const char*>() ? d["username"].as<const char*>() : "";
-      const char* pp = d["password"].is<const char*>() ? d["password"].as<const char*>() : "";
-      u = String(uu);
-      p = String(pp);
-    }
-  } else if (contentType.indexOf("application/x-www-form-urlencoded")>=0) {
-    String b = *body;
-    int start=0;
-    while (start < (int)b.length()) {
-      int amp = b.indexOf('&', start); if (amp<0) amp = b.length();
-      int eq  = b.indexOf('=', start);
-      if (eq>start && eq<amp) {
-        String key = b.substring(start, eq);
-        String val = b.substring(eq+1, amp);
-        key.toLowerCase();
-        val = urlDecode(val);
-        if (key=="username") u = val;
-        else if (key=="password") p = val;
-      }
-      start = amp+1;
-    }
+  char* body = collectBody(req, data, len, index, total);
+  if (!body) return;
+  ReqArena* a = arenaFind(req);
+  JsonDocument d(a ? (ArduinoJson::Allocator*)a : &heapAlloc);
+
+  const char* u = "";
+  const char* p = "";
+
+  if (contentTypeIs(req, "application/x-www-form-urlencoded")) {
+    forEachFormField(body, [&](const char* key, const char* val){
+      if      (!strcasecmp(key,"username")) u = val;
+      else if (!strcasecmp(key,"password")) p = val;
+    });
   } else {
-    JsonDocument d;
-    if (deserializeJson(d, *body) == DeserializationError::Ok) {
-      const char* uu = d["username"].is<const char*>() ? d["username"].as<const char*>() : "";
-      const char* pp = d["password"].is<const char*>() ? d["password"].as<const char*>() : "";
-      u = String(uu);
-      p = String(pp);
+    if (deserializeJson(d, (const char*)body, total) == DeserializationError::Ok) {
+      if (d["username"].is<const char*>()) u = d["username"].as<const char*>();
+      if (d["password"].is<const char*>()) p = d["password"].as<const char*>();
     }
   }
 
-  delete (String*)req->_tempObject; req->_tempObject=nullptr;
+  bool ok = (strcmp(u, appcfg.username.c_str())==0 && strcmp(p, appcfg.password.c_str())==0);
+  arenaRelease(req);
 
-  if (u == appcfg.username && p == appcfg.password){
-    isLoggedIn = true; sessionId = randomHex(16);
+  if (ok){
+    char sid[33]; sessionCreate(sid);
     AsyncWebServerResponse *res = req->beginResponse(200, "application/json", "{\"ok\":true}");
-    res->addHeader("Set-Cookie", "SID="+sessionId+"; Path=/; HttpOnly");
+    res->addHeader("Set-Cookie", String("SID=") + sid + "; Path=/; HttpOnly");
     req->send(res);
   } else {
     req->send(401, "application/json", "{\"ok\":false,\"err\":\"Invalid credentials\"}");
   }
 }
 void handleLogout(AsyncWebServerRequest* req){
-  isLoggedIn=false; sessionId="";
+  sessionEnd(req);
   AsyncWebServerResponse *res = req->beginResponse(200, "application/json", "{\"ok\":true}");
   res->addHeader("Set-Cookie","SID=deleted; Path=/; Max-Age=0");
   req->send(res);
@@ -773,274 +3010,1606 @@ void handleLogout(AsyncWebServerRequest* req){
 
 /* ===================== LOGS (merge+filter across logs_*.csv) ===================== */
 struct LogRow {
-  String ts;  // "YYYY-MM-DD HH:MM:SS"
+  char   ts[20];  // "YYYY-MM-DD HH:MM:SS"
   double budget, rem, used;
 };
-static time_t parseTimestampLocal(const String& s){
-  if (s.length() < 19) return 0;
-  int y = s.substring(0,4).toInt();
-  int m = s.substring(5,7).toInt();
-  int d = s.substring(8,10).toInt();
-  int hh= s.substring(11,13).toInt();
-  int mm= s.substring(14,16).toInt();
-  int ss= s.substring(17,19).toInt();
-  DateTime dt(y,m,d,hh,mm,ss);
+static int digitsAt(const char* s, int pos, int n){
+  int v=0; for(int i=0;i<n;i++){ char c=s[pos+i]; if(c<'0'||c>'9') return v; v=v*10+(c-'0'); } return v;
+}
+// Accepts "YYYY-MM-DD HH:MM:SS" or the datetime-local "YYYY-MM-DDTHH:MM:SS".
+static time_t parseTimestampLocal(const char* s){
+  if (strnlen(s, 19) < 19) return 0;
+  DateTime dt(digitsAt(s,0,4), digitsAt(s,5,2), digitsAt(s,8,2),
+              digitsAt(s,11,2), digitsAt(s,14,2), digitsAt(s,17,2));
   return dt.unixtime(); // treat as local
 }
+static void rangeFromParams(AsyncWebServerRequest* req, time_t& tFrom, time_t& tTo){
+  tFrom = req->hasParam("from") ? parseTimestampLocal(req->getParam("from")->value().c_str()) : 0;
+  tTo   = req->hasParam("to")   ? parseTimestampLocal(req->getParam("to")->value().c_str())   : 0;
+}
+// "/logs_YYYYMMDD_h_AM.csv" -> YYYYMMDDHH on a 24 h clock, 0 if it doesn't parse.
+// Names carry an unpadded 12 h hour, so this (not the name) is the sort key.
+static uint32_t logFileKey(const String& name){
+  const char* p = strstr(name.c_str(), "logs_");
+  unsigned ymd = 0, h = 0; char ap[3] = "";
+  if (!p || sscanf(p, "logs_%8u_%u_%2s", &ymd, &h, ap) != 3 || h < 1 || h > 12) return 0;
+  return ymd * 100u + (h % 12) + ((ap[0]=='P' || ap[0]=='p') ? 12 : 0);
+}
+static uint32_t logKeyOf(time_t t){
+  DateTime d(t);
+  return (uint32_t)d.year() * 1000000u + d.month() * 10000u + d.day() * 100u + d.hour();
+}
 static bool isLogsCsv(const String& name){
   String low = name; low.toLowerCase();
   if (low.length() && low[0]=='/') low.remove(0,1);
   return low.startsWith("logs_") && low.endsWith(".csv");
 }
-static void collectLogFiles(std::vector<String>& out){
-  if (!SD.begin(SD_CS)) return;
-  File root = SD.open("/");
+struct LogFileRef {
+  String   path;
+  uint32_t key;       // YYYYMMDDHH of the first hour covered
+  bool     archive;   // a whole day in ARCHIVE_DIR
+};
+static uint32_t logFileKeyHi(const LogFileRef& r){ return r.archive ? r.key + 23 : r.key; }
+static const char* ARCHIVE_DIR = "/archive";
+// "logs_YYYYMMDD.lga" -> YYYYMMDD, 0 if it doesn't parse.
+static uint32_t archiveDayOf(const String& name){
+  const char* p = strstr(name.c_str(), "logs_");
+  unsigned ymd = 0; char ext[4] = "";
+  if (!p || sscanf(p, "logs_%8u.%3s", &ymd, ext) != 2 || strcasecmp(ext, "lga")) return 0;
+  return ymd;
+}
+// Calls fn(leafName) for every plain file in dir.
+template<typename F> static void forEachFileIn(const char* dir, F fn){
+  File root = SD.open(dir);
   if (!root || !root.isDirectory()) return;
+  uint32_t lastY = millis();
   while(true){
     File f = root.openNextFile();
     if (!f) break;
     if (!f.isDirectory()){
       String nm = String(f.name());
-      if (isLogsCsv(nm)){
-        if (nm[0] != '/') nm = "/" + nm;
-        out.push_back(nm);
-      }
+      int slash = nm.lastIndexOf('/');
+      if (slash >= 0) nm.remove(0, slash + 1);
+      fn(nm);
     }
     f.close();
-    static uint32_t lastY = millis();
     if (millis() - lastY > 10) { delay(0); lastY = millis(); }
   }
   root.close();
-  std::sort(out.begin(), out.end()); // filename order is chronological by hour
-}
-static bool parseCsvLine(const String& line, LogRow& row){
-  int c1 = line.indexOf(','); if (c1<0) return false;
-  int c2 = line.indexOf(',', c1+1); if (c2<0) return false;
-  int c3 = line.indexOf(',', c2+1); if (c3<0) return false;
-  row.ts    = line.substring(0, c1);
-  row.budget= line.substring(c1+1, c2).toDouble();
-  row.rem   = line.substring(c2+1, c3).toDouble();
-  row.used  = line.substring(c3+1).toDouble();
+}
+// Hourly CSVs in / plus daily archives, in time order. A day that has an
+// archive hides any hourly files left over from an interrupted compaction
+// unless `withShadowed` is set. Caller holds an SdLock.
+static void collectLogFiles(std::vector<LogFileRef>& out, bool withShadowed=false){
+  if (sdState != SD_MOUNTED) return;
+  forEachFileIn("/", [&](const String& nm){
+    if (!isLogsCsv(nm)) return;
+    uint32_t k = logFileKey(nm);
+    if (k) out.push_back({ "/" + nm, k, false });
+  });
+  forEachFileIn(ARCHIVE_DIR, [&](const String& nm){
+    uint32_t d = archiveDayOf(nm);
+    if (d) out.push_back({ String(ARCHIVE_DIR) + "/" + nm, d * 100u, true });
+  });
+  std::sort(out.begin(), out.end(), [](const LogFileRef& a, const LogFileRef& b){
+    return a.key != b.key ? a.key < b.key : (a.archive != b.archive ? a.archive : a.path < b.path);
+  });
+  if (withShadowed) return;
+  uint32_t archivedDay = 0;
+  out.erase(std::remove_if(out.begin(), out.end(), [&](const LogFileRef& r){
+    if (r.archive){ archivedDay = r.key / 100; return false; }
+    return r.key / 100 == archivedDay;
+  }), out.end());
+}
+static bool parseCsvLine(const char* line, LogRow& row){
+  const char* c1 = strchr(line, ','); if (!c1) return false;
+  const char* c2 = strchr(c1+1, ','); if (!c2) return false;
+  const char* c3 = strchr(c2+1, ','); if (!c3) return false;
+  size_t tl = min<size_t>(c1 - line, sizeof(row.ts) - 1);
+  memcpy(row.ts, line, tl); row.ts[tl] = 0;
+  row.budget= strtod(c1+1, nullptr);
+  row.rem   = strtod(c2+1, nullptr);
+  row.used  = strtod(c3+1, nullptr);
   return true;
 }
-static void handleLogsQuery(AsyncWebServerRequest* req){
-  if (!hasAuth(req)) { req->send(401); return; }
 
-  time_t tFrom = 0, tTo = 0;
-  if (req->hasParam("from")) { String f = req->getParam("from")->value(); f.replace('T',' '); tFrom = parseTimestampLocal(f); }
-  if (req->hasParam("to"))   { String t = req->getParam("to")->value();   t.replace('T',' '); tTo   = parseTimestampLocal(t); }
+/* ===================== Daily archives (block-compressed, see log_format.h) ===================== */
 
-  std::vector<String> files; files.reserve(64);
-  collectLogFiles(files);
+static String archivePath(uint32_t day){
+  char p[40]; snprintf(p, sizeof(p), "%s/logs_%08u.lga", ARCHIVE_DIR, (unsigned)day);
+  return p;
+}
+// Reads and checks trailer + index. Caller holds an SdLock.
+static bool archiveLoadIndex(File& f, std::vector<ArchiveBlockIdx>& idx, ArchiveTrailer& tr){
+  size_t sz = f.size();
+  if (sz < sizeof(tr) || !f.seek(sz - sizeof(tr))) return false;
+  if (f.read((uint8_t*)&tr, sizeof(tr)) != sizeof(tr) || tr.magic != ARCHIVE_MAGIC) return false;
+  if (tr.blocks > 4096 || tr.indexOff + tr.blocks * sizeof(ArchiveBlockIdx) != sz - sizeof(tr)) return false;
+  idx.resize(tr.blocks);
+  size_t n = tr.blocks * sizeof(ArchiveBlockIdx);
+  if (!f.seek(tr.indexOff) || f.read((uint8_t*)idx.data(), n) != n) return false;
+  return crc32((const uint8_t*)idx.data(), n) == tr.indexCrc;
+}
+static void archiveRowToLog(const ArchiveRow& a, LogRow& r){
+  DateTime d(a.epoch);
+  snprintf(r.ts, sizeof(r.ts), "%04u-%02u-%02u %02u:%02u:%02u",
+           (unsigned)d.year() % 10000, d.month(), d.day(), d.hour(), d.minute(), d.second());
+  r.budget = a.budget / 1e6;
+  r.rem    = a.rem    / 1e6;
+  r.used   = a.used   / 1e6;
+}
 
-  auto *res = req->beginResponseStream("application/json");
-  res->print("{\"items\":[");
-  bool firstOut = true;
-  uint32_t lastY = millis();
-  size_t rowCount = 0;
-
-  for (size_t i=0;i<files.size();++i){
-    File f = SD.open(files[i], "r");
-    if (!f) continue;
-    while (f.available()){
-      String line = f.readStringUntil('\n'); line.trim();
-      if (line.length()==0 || line.startsWith("timestamp")) continue;
-      LogRow r; if (!parseCsvLine(line, r)) continue;
-      time_t tRow = parseTimestampLocal(r.ts);
-      if (tFrom && tRow < tFrom) continue;
-      if (tTo   && tRow > tTo)   continue;
-
-      if (!firstOut) res->print(",");
-      firstOut = false;
-      res->print("{\"timestamp\":\""); res->print(r.ts);
-      res->print("\",\"budget_kwh\":"); res->print(r.budget, 6);
-      res->print(",\"remaining_kwh\":"); res->print(r.rem, 6);
-      res->print(",\"used_kwh\":"); res->print(r.used, 6);
-      res->print("}");
-
-      // cooperative yield every ~200 rows or 10ms
-      if (++rowCount % 200 == 0 || (millis() - lastY > 10)) { delay(0); lastY = millis(); }
+// One log file, hourly CSV or daily archive, read row by row. pos() is a
+// resumable position for the row last returned: the line's byte offset in a
+// CSV, block * ARCHIVE_BLOCK_ROWS + row in an archive.
+// The caller holds an SdLock around construction, destruction and every call.
+class LogSource {
+public:
+  explicit LogSource(const LogFileRef& ref) : archive(ref.archive) {
+    f = SD.open(ref.path, "r");
+    if (!f) return;
+    if (!archive){ rd.reset(new SdBlockReader(f)); return; }
+    ArchiveTrailer tr;
+    blk = (uint8_t*)malloc(ARCHIVE_BUF_BYTES);
+    if (!blk || !archiveLoadIndex(f, idx, tr)) idx.clear();
+  }
+  ~LogSource(){ rd.reset(); if (f) f.close(); free(blk); }
+  explicit operator bool() const { return f && (archive ? !idx.empty() : (rd && *rd)); }
+  size_t size(){ return f ? f.size() : 0; }
+
+  bool next(LogRow& r, time_t& t){
+    if (!archive){
+      while (const char* line = rd->next()){
+        if (!*line || !strncmp(line, "timestamp", 9)) continue;
+        if (!parseCsvLine(line, r)) continue;
+        t = parseTimestampLocal(r.ts);
+        lastPos = rd->lineOffset();
+        return true;
+      }
+      return false;
+    }
+    for(;;){
+      if (row >= blkRows && !loadBlock(blkNo + 1)) return false;
+      const uint8_t* np = archiveDecodeRow(dp, dend, prev);
+      if (!np){ row = blkRows; continue; }    // short block: move on
+      dp = np;
+      lastPos = (uint32_t)blkNo * ARCHIVE_BLOCK_ROWS + row++;
+      archiveRowToLog(prev, r);
+      t = prev.epoch;
+      return true;
     }
-    f.close();
-    if (millis() - lastY > 10) { delay(0); lastY = millis(); }
+  }
+  uint32_t pos() const { return lastPos; }
+
+  // Resume so that next() returns the row at a pos() taken earlier.
+  void seek(uint32_t p){
+    if (!archive){ rd->seek(p); return; }
+    if (!loadBlock(p / ARCHIVE_BLOCK_ROWS) || blkNo != (int32_t)(p / ARCHIVE_BLOCK_ROWS)) return;
+    for (uint32_t k = p % ARCHIVE_BLOCK_ROWS; k && row < blkRows; k--, row++){
+      const uint8_t* np = archiveDecodeRow(dp, dend, prev);
+      if (!np){ row = blkRows; break; }
+      dp = np;
+    }
+  }
+  // Positions near the end, so the last rows come back without a full scan.
+  void seekTail(){
+    if (!archive){ size_t sz = f.size(); if (sz > SD_READ_BLOCK) rd->seek(sz - SD_READ_BLOCK / 2); return; }
+    blkNo = (int32_t)idx.size() - 2; row = blkRows = 0;
+  }
+  // Archives: skip blocks that end before t (CSV files are an hour; no-op).
+  void seekTime(time_t t){
+    if (!archive) return;
+    size_t i = 0;
+    while (i < idx.size() && (time_t)idx[i].hi < t) i++;
+    blkNo = (int32_t)i - 1; row = blkRows = 0;
   }
 
-  res->print("]}");
-  req->send(res);
+private:
+  File f;
+  bool archive;
+  std::unique_ptr<SdBlockReader> rd;
+  std::vector<ArchiveBlockIdx> idx;
+  uint8_t* blk = nullptr;
+  int32_t  blkNo = -1;
+  uint16_t row = 0, blkRows = 0;
+  const uint8_t *dp = nullptr, *dend = nullptr;
+  ArchiveRow prev{0, 0, 0, 0};
+  uint32_t lastPos = 0;
+
+  bool loadBlock(int32_t n){
+    for (; n < (int32_t)idx.size(); n++){
+      const ArchiveBlockIdx& e = idx[n];
+      if (e.len > ARCHIVE_BUF_BYTES || !f.seek(e.off)) continue;
+      uint32_t t0 = micros();
+      if (f.read(blk, e.len) != e.len || crc32(blk, e.len) != e.crc){ archiveCrcErrors++; continue; }
+      archiveDecodeBytes.fetch_add(e.len, std::memory_order_relaxed);
+      archiveDecodeUs.fetch_add(micros() - t0, std::memory_order_relaxed);
+      blkNo = n; row = 0; blkRows = e.rows;
+      dp = blk; dend = blk + e.len; prev = ArchiveRow{0, 0, 0, 0};
+      return true;
+    }
+    blkNo = (int32_t)idx.size(); row = blkRows = 0;
+    return false;
+  }
+};
+
+/* ===== Key-ordered walk over the log files ===== */
+// Paged readers start at a key rather than listing the card: a day is its
+// archive when there is one, else its hourly CSVs, each found by name. That is
+// two SD.exists() per hour walked, however long the history is. Files are only
+// ever removed by folding a day into its archive, so the oldest day, once
+// looked up, holds until the next mount. Callers hold an SdLock.
+static time_t logKeyTime(uint32_t key){
+  return DateTime(key / 1000000, key / 10000 % 100, key / 100 % 100, key % 100, 0, 0).unixtime();
+}
+static uint32_t logKeyNext(uint32_t key){ return logKeyOf(logKeyTime(key) + 3600); }
+static uint32_t logFirstKey(){
+  if (!logOldestDay){
+    std::vector<LogFileRef> files;
+    collectLogFiles(files);
+    if (files.empty()) return logKeyOf(clockEpoch());   // nothing older can appear; look again next time
+    logOldestDay = files[0].key / 100;
+  }
+  return logOldestDay * 100u;
+}
+// The first file at or after `key` (and not past keyTo), spending at most
+// `probes` lookups; on a miss `key` is where the next call should carry on.
+static bool logFileFrom(uint32_t& key, uint32_t keyTo, LogFileRef& out, uint16_t& probes){
+  uint32_t day = 0;
+  while (key <= keyTo && probes){
+    if (key / 100 != day){
+      day = key / 100; probes--;
+      String a = archivePath(day);
+      if (SD.exists(a)){ out = { a, day * 100u, true }; return true; }
+    }
+    if (!probes) break;
+    String h = makeLogName(DateTime(logKeyTime(key))); probes--;
+    if (SD.exists(h)){ out = { h, key, false }; return true; }
+    key = logKeyNext(key);
+  }
+  return false;
 }
-static void handleLogsExport(AsyncWebServerRequest* req){
-  if (!hasAuth(req)) { req->send(401); return; }
 
-  time_t tFrom = 0, tTo = 0;
-  if (req->hasParam("from")) { String f = req->getParam("from")->value(); f.replace('T',' '); tFrom = parseTimestampLocal(f); }
-  if (req->hasParam("to"))   { String t = req->getParam("to")->value();   t.replace('T',' '); tTo   = parseTimestampLocal(t); }
+/* ===== Per-hour summaries (format in log_format.h) ===== */
+// A closed day's 24 hour summaries come from a small RAM LRU, else its .sum
+// file, else one scan of its log files (which then writes the .sum).
+// archiveCompactDay writes the .sum as it folds the day, so scans are only
+// for days archived before summaries existed, or not archived yet.
+static const uint8_t SUM_CACHE_DAYS = 8;   // "last 7 days" plus one
+struct SumDay { uint32_t day, lastUse; LogSummary h[24]; };
+static SumDay       sumCache[SUM_CACHE_DAYS];
+static uint32_t     sumUseTick = 0;
+static portMUX_TYPE sumMux = portMUX_INITIALIZER_UNLOCKED;   // archiveTask fills it too
+
+static String summaryPath(uint32_t day){
+  char p[40]; snprintf(p, sizeof(p), "%s/logs_%08u.sum", ARCHIVE_DIR, (unsigned)day);
+  return p;
+}
+static bool sumCacheGet(uint32_t day, LogSummary* h){
+  bool hit = false;
+  portENTER_CRITICAL(&sumMux);
+  for (auto& e : sumCache) if (e.day == day){ memcpy(h, e.h, sizeof(e.h)); e.lastUse = ++sumUseTick; hit = true; break; }
+  portEXIT_CRITICAL(&sumMux);
+  return hit;
+}
+static void sumCachePut(uint32_t day, const LogSummary* h){
+  portENTER_CRITICAL(&sumMux);
+  SumDay* slot = &sumCache[0];
+  for (auto& e : sumCache){
+    if (e.day == day){ slot = &e; break; }
+    if (e.lastUse < slot->lastUse) slot = &e;
+  }
+  slot->day = day; slot->lastUse = ++sumUseTick;
+  memcpy(slot->h, h, sizeof(slot->h));
+  portEXIT_CRITICAL(&sumMux);
+}
+// Caller holds an SdLock.
+static bool summaryRead(uint32_t day, LogSummary* h){
+  File f = SD.open(summaryPath(day), "r");
+  if (!f) return false;
+  const size_t n = 24 * sizeof(LogSummary);
+  SummaryTrailer tr;
+  bool ok = f.size() == n + sizeof(tr) && f.read((uint8_t*)h, n) == n
+         && f.read((uint8_t*)&tr, sizeof(tr)) == sizeof(tr)
+         && tr.magic == SUMMARY_MAGIC && tr.day == day && tr.crc == crc32(h, n);
+  f.close();
+  return ok;
+}
+// Caller holds an SdLock. A torn write just fails its CRC and is rebuilt.
+static bool summaryWrite(uint32_t day, const LogSummary* h){
+  if (!SD.exists(ARCHIVE_DIR)) SD.mkdir(ARCHIVE_DIR);
+  File f = SD.open(summaryPath(day), "w");
+  if (!f) return false;
+  const size_t n = 24 * sizeof(LogSummary);
+  SummaryTrailer tr = { day, crc32(h, n), SUMMARY_MAGIC };
+  bool ok = f.write((const uint8_t*)h, n) == n && f.write((const uint8_t*)&tr, sizeof(tr)) == sizeof(tr);
+  f.close();
+  return ok;
+}
+static void summaryAddRow(LogSummary* h, uint32_t day, const LogRow& r, time_t t){
+  uint32_t d = digitsAt(r.ts, 0, 4) * 10000u + digitsAt(r.ts, 5, 2) * 100u + digitsAt(r.ts, 8, 2);
+  int hr = digitsAt(r.ts, 11, 2);
+  if (d != day || hr > 23) return;
+  summaryAdd(h[hr], { (uint32_t)t, llround(r.budget * 1e6), llround(r.rem * 1e6), llround(r.used * 1e6) });
+}
+// Adds the rows of one log file that fall on `day` to its hour buckets. False
+// when it stopped part way for a more urgent bus user (async_tcp only).
+static bool summaryScan(const LogFileRef& ref, uint32_t day, LogSummary* h, SdLock& lk){
+  LogSource src(ref);
+  if (!src) return true;
+  LogRow r; time_t t; uint32_t n = 0;
+  while (src.next(r, t)){
+    summaryAddRow(h, day, r, t);
+    if (++n % 64 == 0 && !lk.yieldToHigher()) return false;
+  }
+  return true;
+}
+
+// Folds one closed day's hourly CSVs into its archive: written to a temp
+// file, renamed into place, and only then are the CSVs removed. A valid
+// archive found on entry means an earlier run stopped before the removal.
+static bool archiveCompactDay(uint32_t day, const std::vector<LogFileRef>& hourly){
+  String dst = archivePath(day), tmp = String(ARCHIVE_DIR) + "/.tmp";
+  {
+    SdLock lk(SD_PRIO_BULK);
+    if (!lk) return false;
+    if (!SD.exists(ARCHIVE_DIR)) SD.mkdir(ARCHIVE_DIR);
+    File a = SD.open(dst, "r");
+    if (a){
+      std::vector<ArchiveBlockIdx> ix; ArchiveTrailer tr;
+      bool valid = archiveLoadIndex(a, ix, tr);
+      a.close();
+      if (valid){ for (const auto& h : hourly) SD.remove(h.path); return true; }
+      SD.remove(dst);
+    }
+  }
+  std::unique_ptr<ArchiveBlockWriter> w(new (std::nothrow) ArchiveBlockWriter());
+  if (!w) return false;
+  std::unique_ptr<LogSummary[]> hours(new (std::nothrow) LogSummary[24]());   // optional: rebuilt on demand
+  std::vector<ArchiveBlockIdx> idx;
+  uint32_t rows = 0, inBytes = 0;
+  bool ok = true;
+  File out;
+  { SdLock lk(SD_PRIO_BULK); if (lk) out = SD.open(tmp, "w"); }
+  if (!out) return false;
+
+  // caller holds the lock
+  auto flush = [&](){
+    ArchiveBlockIdx e = { w->lo, w->hi, (uint32_t)out.position(), (uint16_t)w->len, w->rows, crc32(w->buf, w->len) };
+    if (out.write(w->buf, w->len) != w->len) ok = false;
+    idx.push_back(e);
+    w->reset();
+  };
+  for (const auto& h : hourly){
+    SdLock lk(SD_PRIO_BULK);
+    if (!lk){ ok = false; break; }
+    LogSource src(h);
+    inBytes += src.size();
+    LogRow r; time_t t; uint32_t n = 0;
+    while (ok && src.next(r, t)){
+      w->add({ (uint32_t)t, llround(r.budget * 1e6), llround(r.rem * 1e6), llround(r.used * 1e6) });
+      if (hours) summaryAddRow(hours.get(), day, r, t);
+      rows++;
+      if (w->full()) flush();
+      if (++n % 64 == 0) lk.yieldToHigher();
+    }
+    if (!ok) break;
+  }
+
+  SdLock lk(SD_PRIO_BULK);
+  if (!lk) ok = false;
+  if (ok && w->rows) flush();
+  if (ok){
+    size_t n = idx.size() * sizeof(ArchiveBlockIdx);
+    ArchiveTrailer tr = { (uint32_t)out.position(), (uint32_t)idx.size(), rows, day,
+                          crc32((const uint8_t*)idx.data(), n), ARCHIVE_MAGIC };
+    ok = out.write((const uint8_t*)idx.data(), n) == n && out.write((const uint8_t*)&tr, sizeof(tr)) == sizeof(tr);
+  }
+  uint32_t outBytes = out.size();
+  out.close();
+  if (!ok){ if (lk) SD.remove(tmp); return false; }
+  SD.remove(dst);
+  if (!SD.rename(tmp, dst)){ sdFault("archive rename"); return false; }
+  for (const auto& h : hourly) SD.remove(h.path);
+  if (hours && summaryWrite(day, hours.get())) sumCachePut(day, hours.get());
+
+  archiveDays++; archiveRowsIn += rows; archiveBytesIn += inBytes; archiveBytesOut += outBytes;
+  Serial.printf("[ARCHIVE] %08u: %u files, %u rows, %u -> %u bytes\n",
+                (unsigned)day, (unsigned)hourly.size(), (unsigned)rows, (unsigned)inBytes, (unsigned)outBytes);
+  return true;
+}
+
+// Background job: compacts the oldest closed day (one per pass) once the
+// clock is trusted, so "closed" really means before today.
+static const uint32_t ARCHIVE_SCAN_MS = 60000;
+static void archiveTask(void*){
+  for(;;){
+    vTaskDelay(pdMS_TO_TICKS(ARCHIVE_SCAN_MS));
+    if (!systemReady || !clockSynced) continue;
+    uint32_t today = logKeyOf(clockEpoch()) / 100;
+    std::vector<LogFileRef> files;
+    {
+      SdLock lk(SD_PRIO_BULK);
+      if (!lk) continue;
+      collectLogFiles(files, true);
+    }
+    std::vector<LogFileRef> day;
+    uint32_t d = 0;
+    for (const auto& f : files){
+      if (f.archive) continue;
+      uint32_t fd = f.key / 100;
+      if (fd >= today) break;
+      if (d && fd != d) break;
+      d = fd; day.push_back(f);
+    }
+    if (d) archiveCompactDay(d, day);
+  }
+}
 
-  std::vector<String> files; files.reserve(64);
+// Newest archived row, for restoring when no hourly CSV is left.
+static bool latestArchivedRow(double& budget, double& rem, double& used){
+  SdLock lk(SD_PRIO_INTERACTIVE);
+  if (!lk) return false;
+  std::vector<LogFileRef> files;
   collectLogFiles(files);
+  for (size_t i = files.size(); i-- > 0; ){
+    if (!files[i].archive) continue;
+    LogSource src(files[i]);
+    if (!src) continue;
+    src.seekTail();
+    LogRow r; time_t t; bool any = false;
+    while (src.next(r, t)){ budget = r.budget; rem = r.rem; used = r.used; any = true; }
+    if (any) return true;
+  }
+  return false;
+}
+// Summary mode of /api/logs/query: ?res=hour|day[&format=csv] returns one
+// bucket per hour or day that has rows (rows, kWh consumed, first/last used,
+// min remaining). Ranges are taken to whole hours; the default is the last
+// 7 days. Closed buckets come from the day summaries, and their rendered text
+// is cached by (range, res, format) until the open hour rolls over, or for
+// good when the range is all in the past. Only the open hour is read live.
+// Days still lacking a .sum are built a slice at a time (503 + Retry-After
+// until done), so a first long-range query can't pin async_tcp.
+enum SumRes : uint8_t { SUM_HOUR, SUM_DAY };
+static const uint8_t  QCACHE_SLOTS    = 4;
+static const size_t   QCACHE_BODY_MAX = 32768;   // a week of hourly JSON is ~25 KB
+static const size_t   QCACHE_HEAP_MAX = 32768;   // all bodies together, without PSRAM
+static const uint16_t SUM_RANGE_DAYS  = 400;
+struct QCacheEntry {
+  uint32_t keyFrom, keyTo;
+  uint32_t openKey;        // open hour when built; 0 = range all closed, never stale
+  uint32_t lastUse;
+  uint8_t  res, fmt;
+  bool     items;          // JSON: body holds at least one item
+  char*    body;
+  size_t   len;
+};
+static QCacheEntry qcache[QCACHE_SLOTS];
+static uint32_t    qcacheTick = 0;
 
-  auto *res = req->beginResponseStream("text/csv");
-  res->addHeader("Content-Disposition", "attachment; filename=\"smartload_logs.csv\"");
-  res->print("timestamp,budget_kwh,remaining_kwh,used_kwh\n");
+// Today: each hour is summarized once it has closed (its CSV no longer
+// grows); only touched from async_tcp.
+static uint32_t   sumTodayDay = 0, sumTodayMask = 0;
+static LogSummary sumToday[24], sumScratch[24];
 
-  uint32_t lastY = millis();
-  size_t rowCount = 0;
-
-  for (size_t i=0;i<files.size();++i){
-    File f = SD.open(files[i], "r");
-    if (!f) continue;
-    while (f.available()){
-      String line = f.readStringUntil('\n'); line.trim();
-      if (line.length()==0 || line.startsWith("timestamp")) continue;
-      LogRow r; if (!parseCsvLine(line, r)) continue;
-      time_t tRow = parseTimestampLocal(r.ts);
-      if (tFrom && tRow < tFrom) continue;
-      if (tTo   && tRow > tTo)   continue;
-
-      res->print(r.ts); res->print(",");
-      res->print(String(r.budget, 6)); res->print(",");
-      res->print(String(r.rem, 6));    res->print(",");
-      res->print(String(r.used, 6));   res->print("\n");
-
-      if (++rowCount % 200 == 0 || (millis() - lastY > 10)) { delay(0); lastY = millis(); }
+static uint32_t nextDay(uint32_t ymd){
+  DateTime d(DateTime(ymd / 10000, ymd / 100 % 100, ymd % 100, 12, 0, 0).unixtime() + 86400);
+  return (uint32_t)d.year() * 10000u + d.month() * 100u + d.day();
+}
+// Whether one more file scan fits this request: the first always does.
+static bool sumMayScan(uint8_t scans){ return !scans || !sliceSpent(); }
+
+// A closed day's hours into h. False when it would need a scan that no
+// longer fits the slice. `files` is listed on first need.
+static bool summaryDay(uint32_t day, std::vector<LogFileRef>& files, bool& listed, LogSummary* h, SdLock& lk, uint8_t& scans){
+  if (sumCacheGet(day, h)) return true;
+  if (!summaryRead(day, h)){
+    if (!sumMayScan(scans)) return false;
+    if (!listed){ collectLogFiles(files); listed = true; }
+    memset(h, 0, 24 * sizeof(LogSummary));
+    bool any = false;
+    for (const auto& f : files) if (f.key / 100 == day){ if (!summaryScan(f, day, h, lk)) return false; any = true; }
+    if (any) summaryWrite(day, h);
+    sumDaysBuilt++; scans++;
+  }
+  sumCachePut(day, h);
+  return true;
+}
+static bool summaryTodayClosed(uint32_t today, uint8_t openHour, SdLock& lk, uint8_t& scans){
+  if (sumTodayDay != today){ memset(sumToday, 0, sizeof(sumToday)); sumTodayMask = 0; sumTodayDay = today; }
+  for (uint8_t hr = 0; hr < openHour; hr++){
+    if (sumTodayMask & (1u << hr)) continue;
+    if (!sumMayScan(scans)) return false;
+    LogFileRef ref{ makeLogName(DateTime(today / 10000, today / 100 % 100, today % 100, hr, 0, 0)), today * 100u + hr, false };
+    if (!summaryScan(ref, today, sumToday, lk)){ sumToday[hr] = LogSummary{}; return false; }
+    sumTodayMask |= 1u << hr; scans++;
+  }
+  return true;
+}
+
+static size_t summaryRender(char* out, size_t cap, uint32_t key, uint8_t res, uint8_t fmt, const LogSummary& s, bool first){
+  char start[20];
+  if (res == SUM_DAY) snprintf(start, sizeof(start), "%04u-%02u-%02u", (unsigned)(key / 1000000), (unsigned)(key / 10000 % 100), (unsigned)(key / 100 % 100));
+  else snprintf(start, sizeof(start), "%04u-%02u-%02u %02u:00", (unsigned)(key / 1000000), (unsigned)(key / 10000 % 100), (unsigned)(key / 100 % 100), (unsigned)(key % 100));
+  if (fmt) return snprintf(out, cap, "%s,%u,%.6f,%.6f,%.6f,%.6f\n", start, (unsigned)s.rows,
+                           s.consumed / 1e6, s.firstUsed / 1e6, s.lastUsed / 1e6, s.minRem / 1e6);
+  return snprintf(out, cap, "%s{\"start\":\"%s\",\"rows\":%u,\"kwh\":%.6f,\"used_first_kwh\":%.6f,\"used_last_kwh\":%.6f,\"rem_min_kwh\":%.6f}",
+                  first ? "" : ",", start, (unsigned)s.rows, s.consumed / 1e6, s.firstUsed / 1e6, s.lastUsed / 1e6, s.minRem / 1e6);
+}
+
+static void handleLogsSummary(AsyncWebServerRequest* req, uint8_t res){
+  if (!clockSynced) { req->send(503, "text/plain", "Clock not set"); return; }
+  uint8_t fmt = req->hasParam("format") && req->getParam("format")->value() == "csv" ? 1 : 0;
+  time_t now = clockEpoch();
+  time_t tFrom, tTo; rangeFromParams(req, tFrom, tTo);
+  if (!tTo || tTo > now) tTo = now;
+  if (!tFrom){ DateTime d(tTo - 6 * 86400); tFrom = DateTime(d.year(), d.month(), d.day(), 0, 0, 0).unixtime(); }
+  if (tTo < tFrom) { req->send(400, "text/plain", "to before from"); return; }
+  if (tTo - tFrom > (time_t)SUM_RANGE_DAYS * 86400) { req->send(400, "text/plain", "Range too long"); return; }
+  uint32_t keyFrom = logKeyOf(tFrom), keyTo = logKeyOf(tTo), openKey = logKeyOf(now);
+  uint32_t today = openKey / 100;
+  uint8_t  openHour = openKey % 100;
+  bool     live = keyFrom <= openKey && openKey <= keyTo;
+
+  QCacheEntry* hit = nullptr;
+  for (auto& e : qcache)
+    if (e.body && e.keyFrom == keyFrom && e.keyTo == keyTo && e.res == res && e.fmt == fmt && (!e.openKey || e.openKey == openKey)) hit = &e;
+
+  SdLock lk(SD_PRIO_BULK);
+  if (!lk && (!hit || live)) { sdBusy(req); return; }
+  uint8_t scans = 0;
+  if (live && !summaryTodayClosed(today, openHour, lk, scans)) {
+    AsyncWebServerResponse* r = req->beginResponse(503, "text/plain", "Building summaries");
+    r->addHeader("Retry-After", "1"); req->send(r); return;
+  }
+
+  auto* out = req->beginResponseStream(fmt ? "text/csv" : "application/json");
+  out->print(fmt ? "start,rows,kwh,used_first_kwh,used_last_kwh,rem_min_kwh\n"
+                 : (res == SUM_DAY ? "{\"res\":\"day\",\"items\":[" : "{\"res\":\"hour\",\"items\":["));
+  bool first = true;
+  char line[224];
+  if (hit) {
+    out->write((const uint8_t*)hit->body, hit->len);
+    first = !hit->items;
+    hit->lastUse = ++qcacheTick;
+    qcacheHits++;
+  } else {
+    qcacheMisses++;
+    bool psram = psramFound();
+    uint32_t caps = psram ? (MALLOC_CAP_SPIRAM|MALLOC_CAP_8BIT) : MALLOC_CAP_8BIT;
+    char* buf = nullptr;     // grown as the body is rendered, so a short one never holds the cap
+    size_t blen = 0, bcap = 0;
+    bool fits = true;
+    auto emit = [&](uint32_t key, const LogSummary& s){
+      if (!s.rows) return;
+      size_t n = summaryRender(line, sizeof(line), key, res, fmt, s, first);
+      first = false;
+      out->write((const uint8_t*)line, n);
+      if (fits && blen + n > bcap){
+        size_t nc = min(QCACHE_BODY_MAX, max(blen + n, bcap ? bcap * 2 : (size_t)2048));
+        char* nb = blen + n <= nc ? (char*)heap_caps_realloc(buf, nc, caps) : nullptr;
+        if (nb){ buf = nb; bcap = nc; } else fits = false;
+      }
+      if (fits){ memcpy(buf + blen, line, n); blen += n; }
+    };
+    std::vector<LogFileRef> files;
+    bool listed = false, complete = true;
+    LogSummary h[24];
+    for (uint32_t day = keyFrom / 100; day <= keyTo / 100 && day <= today; day = nextDay(day)) {
+      uint8_t hFrom = day == keyFrom / 100 ? keyFrom % 100 : 0;
+      uint8_t hTo   = day == keyTo / 100   ? keyTo % 100   : 23;
+      const LogSummary* hours = h;
+      if (day < today) {
+        if (!summaryDay(day, files, listed, h, lk, scans)) { complete = false; break; }
+      } else {
+        if (live) break;             // today's open part goes out below, uncached
+        if (!summaryTodayClosed(today, openHour, lk, scans)) { complete = false; break; }
+        hours = sumToday;
+      }
+      if (res == SUM_HOUR) for (uint8_t hr = hFrom; hr <= hTo; hr++) emit(day * 100u + hr, hours[hr]);
+      else { LogSummary s = {}; for (uint8_t hr = hFrom; hr <= hTo; hr++) summaryMerge(s, hours[hr]); emit(day * 100u, s); }
     }
-    f.close();
-    if (millis() - lastY > 10) { delay(0); lastY = millis(); }
+    if (!complete) {
+      delete out; heap_caps_free(buf);
+      AsyncWebServerResponse* r = req->beginResponse(503, "text/plain", "Building summaries");
+      r->addHeader("Retry-After", "1"); req->send(r); return;
+    }
+    if (live && res == SUM_HOUR)   // today's closed hours: cached until the open hour rolls
+      for (uint8_t hr = keyFrom / 100 == today ? keyFrom % 100 : 0; hr < openHour; hr++) emit(today * 100u + hr, sumToday[hr]);
+    if (fits) {
+      QCacheEntry* slot = &qcache[0];
+      for (auto& e : qcache) if (e.lastUse < slot->lastUse) slot = &e;
+      if (slot->body){ heap_caps_free(slot->body); slot->body = nullptr; slot->len = 0; }
+      for (size_t held = 0; !psram; held = 0){   // internal RAM: evict oldest until the total fits
+        QCacheEntry* old = nullptr;
+        for (auto& e : qcache) if (e.body){ held += e.len; if (!old || e.lastUse < old->lastUse) old = &e; }
+        if (held + blen <= QCACHE_HEAP_MAX || !old) break;
+        heap_caps_free(old->body); old->body = nullptr; old->len = 0;
+      }
+      *slot = { keyFrom, keyTo, keyTo < openKey ? 0u : openKey, ++qcacheTick, res, fmt, !first,
+                (char*)heap_caps_realloc(buf, blen ? blen : 1, caps), blen };
+      if (!slot->body) { slot->body = buf; }
+    } else heap_caps_free(buf);
+  }
+
+  if (live) {   // the open hour, and for res=day today's bucket around it
+    memset(sumScratch, 0, sizeof(sumScratch));
+    LogFileRef ref{ makeLogName(DateTime(now)), openKey, false };
+    if (!summaryScan(ref, today, sumScratch, lk)) {
+      delete out;
+      AsyncWebServerResponse* r = req->beginResponse(503, "text/plain", "Building summaries");
+      r->addHeader("Retry-After", "1"); req->send(r); return;
+    }
+    LogSummary s = {};
+    if (res == SUM_DAY) for (uint8_t hr = keyFrom / 100 == today ? keyFrom % 100 : 0; hr < openHour; hr++) summaryMerge(s, sumToday[hr]);
+    summaryMerge(s, sumScratch[openHour]);
+    if (s.rows) { size_t n = summaryRender(line, sizeof(line), res == SUM_DAY ? today * 100u : openKey, res, fmt, s, first); out->write((const uint8_t*)line, n); first = false; }
+  }
+  if (!fmt) out->printf("],\"cached\":%s,\"live\":%s}", hit ? "true" : "false", live ? "true" : "false");
+  req->send(out);
+}
+
+// Keyset pages: `limit` rows per call, and `next`/`after` is an opaque cursor
+// "<file key>.<position>.<epoch>.<dup>.<archive>" (hex, position as
+// LogSource::pos(), dup the rows of that second already sent) naming the first
+// row not yet returned. If the cursor's hour has since been folded into the
+// day's archive the page resyncs on (epoch, dup), as replication does.
+// A page finds its start file from the cursor key (logFileFrom) and seeks
+// straight to it, so cost per page doesn't grow with the amount of history.
+// Rows are streamed a few per chunk, each chunk under its own SdLock; a long
+// gap with no files ends the page early with a cursor at the next hour.
+static const uint16_t LOGS_PAGE_DEFAULT = 200;
+static const uint16_t LOGS_PAGE_MAX     = 500;
+static const uint16_t LOGS_PROBE_MAX    = 24 * 32;   // name lookups per page
+struct LogCursor { uint32_t key, off, epoch; uint16_t dup; uint8_t archive; };
+struct LogsQueryStream {
+  time_t    tFrom, tTo;
+  uint32_t  key, keyTo;            // next hour to look for a file at
+  LogCursor after;
+  uint16_t  limit, count = 0, probes = LOGS_PROBE_MAX;
+  std::unique_ptr<LogSource> src;
+  uint32_t  srcKey = 0;
+  uint32_t  lastEpoch = 0;         // of the last row sent, and how many shared it
+  uint16_t  sameSec = 0, dupLeft = 0;
+  bool      srcArchive = false, resume = false, resync = false, done = false;
+  char      line[192];
+  size_t    lineLen = 0, linePos = 0;
+};
+// Opens the next file in range; false when there is none or the lookups ran out.
+static bool logsQueryOpen(LogsQueryStream& s){
+  LogFileRef ref;
+  while (logFileFrom(s.key, s.keyTo, ref, s.probes)){
+    s.key = logKeyNext(logFileKeyHi(ref));
+    std::unique_ptr<LogSource> src(new (std::nothrow) LogSource(ref));
+    if (!src || !*src) continue;
+    // the cursor's own file seeks to the row; an archive that took its hour in resyncs on time
+    bool exact = s.after.epoch && ref.key == s.after.key && ref.archive == (s.after.archive != 0);
+    s.resync = s.after.epoch && !exact && ref.key <= s.after.key;
+    s.resume = exact || s.resync;
+    s.dupLeft = s.resync ? s.after.dup : 0;
+    if (exact) src->seek(s.after.off);
+    else if (s.resync) src->seekTime(s.after.epoch);
+    else if (s.tFrom) src->seekTime(s.tFrom);
+    s.src = std::move(src); s.srcKey = ref.key; s.srcArchive = ref.archive;
+    return true;
+  }
+  return false;
+}
+// Formats the next row (or the closing bracket) into s.line. Caller holds an SdLock.
+static void logsQueryNext(LogsQueryStream& s){
+  LogRow r; time_t tRow;
+  while (s.src || logsQueryOpen(s)){
+    if (!s.src->next(r, tRow)){ s.src.reset(); continue; }
+    if (s.resume && tRow < (time_t)s.after.epoch) continue;   // sent on an earlier page
+    if (s.resync){
+      if ((uint32_t)tRow == s.after.epoch && s.dupLeft){ s.dupLeft--; continue; }
+      s.resync = false;
+    }
+    if (s.tFrom && tRow < s.tFrom) continue;
+    if (s.tTo   && tRow > s.tTo)   continue;
+    if (s.count >= s.limit){   // a full page ends here, at a row we haven't sent
+      unsigned dup = (uint32_t)tRow == s.lastEpoch ? s.sameSec : 0;
+      s.lineLen = snprintf(s.line, sizeof(s.line), "],\"next\":\"%x.%x.%x.%x.%x\"}",
+                           (unsigned)s.srcKey, (unsigned)s.src->pos(), (unsigned)tRow, dup, s.srcArchive ? 1u : 0u);
+      s.done = true;
+      return;
+    }
+    s.sameSec = (uint32_t)tRow == s.lastEpoch ? s.sameSec + 1 : 1;
+    s.lastEpoch = (uint32_t)tRow;
+    s.lineLen = snprintf(s.line, sizeof(s.line),
+                         "%s{\"timestamp\":\"%s\",\"budget_kwh\":%.6f,\"remaining_kwh\":%.6f,\"used_kwh\":%.6f}",
+                         s.count++ ? "," : "", r.ts, r.budget, r.rem, r.used);
+    return;
+  }
+  if (s.key <= s.keyTo && !s.probes)   // out of lookups, not out of hours
+    s.lineLen = snprintf(s.line, sizeof(s.line), "],\"next\":\"%x.0.%x.0.0\"}",
+                         (unsigned)s.key, (unsigned)logKeyTime(s.key));
+  else
+    s.lineLen = snprintf(s.line, sizeof(s.line), "]}");
+  s.done = true;
+}
+
+static void handleLogsQuery(AsyncWebServerRequest* req){
+  if (!hasAuth(req)) { req->send(401); return; }
+  if (req->hasParam("res")) {
+    const String& r = req->getParam("res")->value();
+    if (r == "hour" || r == "day") { handleLogsSummary(req, r == "day" ? SUM_DAY : SUM_HOUR); return; }
+    if (r != "raw") { req->send(400, "text/plain", "res must be raw, hour or day"); return; }
   }
+
+  time_t tFrom, tTo; rangeFromParams(req, tFrom, tTo);
+  uint16_t limit = LOGS_PAGE_DEFAULT;
+  if (req->hasParam("limit")) limit = constrain(req->getParam("limit")->value().toInt(), 1, (long)LOGS_PAGE_MAX);
+  LogCursor after = {0, 0, 0, 0, 0};
+  if (req->hasParam("after")) {
+    unsigned k, o, e, d = 0, a = 0;
+    int n = sscanf(req->getParam("after")->value().c_str(), "%x.%x.%x.%x.%x", &k, &o, &e, &d, &a);
+    if (n != 3 && n != 5) { req->send(400, "text/plain", "Invalid cursor"); return; }
+    after = { k, o, e, (uint16_t)d, (uint8_t)(a ? 1 : 0) };
+  }
+
+  LogsQueryStream* raw = new (std::nothrow) LogsQueryStream();
+  if (!raw) { req->send(503, "text/plain", "Out of memory"); return; }
+  // Dropped on done or disconnect, with the bus held for the file close.
+  std::shared_ptr<LogsQueryStream> st(raw, [](LogsQueryStream* p){
+    if (p->src) sdDispose([p]{ delete p; }); else delete p;
+  });
+  st->tFrom = tFrom; st->tTo = tTo; st->after = after; st->limit = limit;
+  st->lastEpoch = after.epoch; st->sameSec = after.dup;
+  {
+    SdLock lk(SD_PRIO_BULK);
+    if (!lk) { sdBusy(req); return; }
+    st->key = max(max(after.key, tFrom ? logKeyOf(tFrom) : 0u), logFirstKey());
+  }
+  st->keyTo = logKeyOf(tTo ? tTo : (time_t)clockEpoch());
+  st->lineLen = snprintf(st->line, sizeof(st->line), "{\"items\":[");
+
+  AsyncWebServerResponse* res = req->beginChunkedResponse("application/json",
+    [st](uint8_t* buf, size_t maxLen, size_t) -> size_t {
+      LogsQueryStream& s = *st;
+      SdLock lk(SD_PRIO_BULK);
+      size_t out = 0;
+      while (out < maxLen){
+        if (s.linePos < s.lineLen){
+          size_t n = min(maxLen - out, s.lineLen - s.linePos);
+          memcpy(buf + out, s.line + s.linePos, n);
+          out += n; s.linePos += n;
+          continue;
+        }
+        if (s.done) break;
+        if (lk) logsQueryNext(s);
+        else if (sdState == SD_MOUNTED) break;   // bus taken: try again shortly
+        else { s.lineLen = snprintf(s.line, sizeof(s.line), "],\"truncated\":true}"); s.done = true; }
+        s.linePos = 0;
+      }
+      return (out || s.done) ? out : RESPONSE_TRY_AGAIN;
+    });
+  res->addHeader("Cache-Control", "no-store");
   req->send(res);
 }
+/* ===== Replication (incremental binary feed, framing in log_format.h) ===== */
+// GET /api/replicate?cursor=&max= returns the rows after the cursor. The
+// cursor names the file and position of the last row sent, so a client that
+// is caught up costs one lookup by key (logFileFrom) and one seek into the
+// current hour's file. If that file has since been folded into an archive,
+// the reader resyncs on (epoch, dup). Frames are built one at a time and
+// streamed, each chunk under its own SdLock; a long gap with no files ends
+// the batch with a cursor at the next hour and `more` set.
+static const uint16_t REPL_ROWS_DEFAULT = 2048, REPL_ROWS_MAX = 4096;
+struct ReplStream {
+  ReplCursor cur, next;
+  uint32_t   key, keyTo;           // next hour to look for a file at
+  uint16_t   limit, probes = LOGS_PROBE_MAX, dupLeft = 0;
+  uint32_t   count = 0;
+  std::unique_ptr<LogSource> src;
+  uint32_t   srcKey = 0;
+  bool       srcArchive = false, resync = false, more = false, ending = false, done = false;
+  ArchiveBlockWriter w;
+  uint8_t    out[sizeof(ReplFrame) + ARCHIVE_BUF_BYTES];
+  size_t     outLen = 0, outPos = 0;
+};
+static void replFrame(ReplStream& s, const uint8_t* p, uint16_t rows, uint16_t len){
+  ReplFrame f = { REPL_MAGIC, rows, len, crc32(p, len) };
+  memcpy(s.out, &f, sizeof(f));
+  memcpy(s.out + sizeof(f), p, len);
+  s.outLen = sizeof(f) + len; s.outPos = 0;
+  replBytes += s.outLen;
+}
+// Opens the next file after the cursor; false when there is none or the lookups ran out.
+static bool replOpen(ReplStream& s){
+  LogFileRef ref;
+  while (logFileFrom(s.key, s.keyTo, ref, s.probes)){
+    s.key = logKeyNext(logFileKeyHi(ref));
+    std::unique_ptr<LogSource> src(new (std::nothrow) LogSource(ref));
+    if (!src || !*src) continue;
+    const ReplCursor& cur = s.cur;
+    s.resync = cur.epoch && ref.key <= cur.key;   // the cursor's hour is in this file
+    if (s.resync && ref.key == cur.key && ref.archive == (cur.archive != 0)){
+      LogRow r; time_t t;
+      src->seek(cur.pos);   // fast path: re-read the last row sent and check it
+      s.resync = !(src->next(r, t) && (uint32_t)t == cur.epoch && src->pos() == cur.pos);
+      if (s.resync) src->seek(0);
+    } else if (s.resync && ref.archive) src->seekTime(cur.epoch);
+    s.dupLeft = cur.dup;
+    s.src = std::move(src); s.srcKey = ref.key; s.srcArchive = ref.archive;
+    return true;
+  }
+  return false;
+}
+// Builds the next frame into s.out: a full block of rows, then the partial
+// block and the cursor. Rows are read only when `sd` says the caller holds an
+// SdLock on a mounted card; without it the batch just ends where it is.
+static void replNext(ReplStream& s, bool sd){
+  LogRow r; time_t t;
+  while (sd && !s.ending && (s.src || replOpen(s))){
+    if (!s.src->next(r, t)){ s.src.reset(); continue; }
+    uint32_t te = (uint32_t)t;
+    if (s.resync){
+      if (te < s.cur.epoch) continue;
+      if (te == s.cur.epoch && s.dupLeft){ s.dupLeft--; continue; }
+      s.resync = false;
+    }
+    if (s.count >= s.limit){ s.more = true; s.ending = true; break; }
+    s.w.add({ te, llround(r.budget * 1e6), llround(r.rem * 1e6), llround(r.used * 1e6) });
+    s.next.dup = (te == s.next.epoch) ? s.next.dup + 1 : 1;
+    s.next.key = s.srcKey; s.next.pos = s.src->pos(); s.next.epoch = te; s.next.archive = s.srcArchive ? 1 : 0;
+    s.count++;
+    if (s.w.full()){ replFrame(s, s.w.buf, s.w.rows, (uint16_t)s.w.len); s.w.reset(); return; }
+  }
+  if (sd && !s.ending && !s.probes && s.key <= s.keyTo){   // out of lookups, not out of hours
+    s.next = { s.key, 0, (uint32_t)logKeyTime(s.key), 0, 0, 0 };
+    s.more = true;
+  }
+  s.ending = true;
+  if (s.w.rows){ replFrame(s, s.w.buf, s.w.rows, (uint16_t)s.w.len); s.w.reset(); return; }
+  s.next.more = s.more ? 1 : 0;
+  replFrame(s, (const uint8_t*)&s.next, 0, sizeof(s.next));
+  replRows += s.count;
+  s.done = true;
+}
 
-/* ===== NEW: Excel .xls export (SpreadsheetML 2003) ===== */
-static void handleLogsExportXls(AsyncWebServerRequest* req){
+static void handleReplicate(AsyncWebServerRequest* req){
   if (!hasAuth(req)) { req->send(401); return; }
 
-  time_t tFrom = 0, tTo = 0;
-  if (req->hasParam("from")) { String f = req->getParam("from")->value(); f.replace('T',' '); tFrom = parseTimestampLocal(f); }
-  if (req->hasParam("to"))   { String t = req->getParam("to")->value();   t.replace('T',' '); tTo   = parseTimestampLocal(t); }
+  ReplCursor cur = {0, 0, 0, 0, 0, 0};
+  if (req->hasParam("cursor")) {
+    unsigned k, p, e, d, a;
+    if (sscanf(req->getParam("cursor")->value().c_str(), "%x.%x.%x.%x.%x", &k, &p, &e, &d, &a) != 5) {
+      req->send(400, "text/plain", "Invalid cursor"); return;
+    }
+    cur = { k, p, e, (uint16_t)d, (uint8_t)(a ? 1 : 0), 0 };
+  }
+  uint16_t limit = REPL_ROWS_DEFAULT;
+  if (req->hasParam("max")) limit = constrain(req->getParam("max")->value().toInt(), 1, (long)REPL_ROWS_MAX);
 
-  std::vector<String> files; files.reserve(64);
-  collectLogFiles(files);
+  ReplStream* raw = new (std::nothrow) ReplStream();
+  if (!raw) { req->send(503, "text/plain", "Out of memory"); return; }
+  std::shared_ptr<ReplStream> st(raw, [](ReplStream* p){
+    if (p->src) sdDispose([p]{ delete p; }); else delete p;
+  });
+  st->cur = st->next = cur; st->limit = limit;
+  {
+    SdLock lk(SD_PRIO_BULK);
+    if (!lk) { sdBusy(req); return; }
+    st->key = max(cur.key, logFirstKey());
+  }
+  st->keyTo = logKeyOf(clockEpoch());
+
+  AsyncWebServerResponse* res = req->beginChunkedResponse("application/octet-stream",
+    [st](uint8_t* buf, size_t maxLen, size_t) -> size_t {
+      ReplStream& s = *st;
+      SdLock lk(SD_PRIO_BULK);
+      size_t out = 0;
+      while (out < maxLen){
+        if (s.outPos < s.outLen){
+          size_t n = min(maxLen - out, s.outLen - s.outPos);
+          memcpy(buf + out, s.out + s.outPos, n);
+          out += n; s.outPos += n;
+          continue;
+        }
+        if (s.done) break;
+        if (lk) replNext(s, true);
+        else if (sdState == SD_MOUNTED) break;       // bus taken: try again shortly
+        else { s.more = true; replNext(s, false); }  // card gone: close the batch, client comes back
+      }
+      return (out || s.done) ? out : RESPONSE_TRY_AGAIN;
+    });
+  res->addHeader("Cache-Control", "no-store");
+  req->send(res);
+}
+/* ===================== Export pipeline (SD reader -> formatter -> HTTP) ===================== */
+// Exports run as three stages joined by bounded queues of fixed buffers: a
+// reader task on core 0 decodes and filters rows from CSVs and archives, a
+// formatter task on core 1 renders them, and the response filler on
+// async_tcp only copies finished chunks out. The bus is held for one buffer at
+// a time, and both tasks block on their queues when the client reads slowly,
+// so an export never holds the loop task or the SD bus for long. The
+// formatter runs below loop()'s priority, in the time loop() spends in its
+// 50 ms delay, so it never competes with the control tick. The throughput
+// shows up as smartload_export_rows_total / smartload_export_seconds_total.
+enum ExportFmt : uint8_t { EXP_CSV, EXP_XLS, EXP_HTML };
+static const size_t  EXP_BUF     = 4096;
+static const uint8_t EXP_NBUF    = 3;     // buffers per stage
+static const size_t  EXP_ROW_MAX = 320;   // worst-case rendered row
+static const UBaseType_t EXP_FMT_PRIO = tskIDLE_PRIORITY;   // below loop() (1)
+struct ExpBuf { char* data; size_t len; bool last; };
+struct ExportJob {
+  ExportFmt fmt; time_t from, to;
+  std::vector<LogFileRef> files;
+  ExpBuf raw[EXP_NBUF], out[EXP_NBUF];
+  QueueHandle_t rawFree, rawFull, outFree, outFull;
+  ExpBuf* cur; size_t curPos; bool done;   // filler side only
+  uint32_t startMs;
+  std::atomic<bool> cancel;
+  std::atomic<uint8_t> refs;               // reader + formatter + response
+};
+static ExportJob expJob;
+static std::atomic<bool> expBusy{false};
+
+static void exportInit(){
+  uint32_t caps = psramFound() ? (MALLOC_CAP_SPIRAM|MALLOC_CAP_8BIT) : MALLOC_CAP_8BIT;
+  for(uint8_t i=0;i<EXP_NBUF;i++){
+    expJob.raw[i].data = (char*)heap_caps_malloc(EXP_BUF, caps);
+    expJob.out[i].data = (char*)heap_caps_malloc(EXP_BUF, caps);
+  }
+  expJob.rawFree = xQueueCreate(EXP_NBUF, sizeof(ExpBuf*));
+  expJob.rawFull = xQueueCreate(EXP_NBUF, sizeof(ExpBuf*));
+  expJob.outFree = xQueueCreate(EXP_NBUF, sizeof(ExpBuf*));
+  expJob.outFull = xQueueCreate(EXP_NBUF, sizeof(ExpBuf*));
+}
+static bool exportReady(){
+  if(!expJob.rawFree || !expJob.rawFull || !expJob.outFree || !expJob.outFull) return false;
+  for(uint8_t i=0;i<EXP_NBUF;i++) if(!expJob.raw[i].data || !expJob.out[i].data) return false;
+  return true;
+}
+// Last stage out frees the job slot.
+static void exportRelease(ExportJob& j){
+  if(j.refs.fetch_sub(1) == 1) expBusy = false;
+}
+// Blocking queue ops that give up once the job is cancelled.
+static bool expTake(ExportJob& j, QueueHandle_t q, ExpBuf*& b){
+  while(!j.cancel) if(xQueueReceive(q, &b, pdMS_TO_TICKS(100)) == pdTRUE) return true;
+  return false;
+}
+static bool expPut(ExportJob& j, QueueHandle_t q, ExpBuf*& b){
+  while(!j.cancel) if(xQueueSend(q, &b, pdMS_TO_TICKS(100)) == pdTRUE){ b = nullptr; return true; }
+  return false;
+}
+static void expPrintf(ExpBuf* o, const char* fmt, ...){
+  va_list ap; va_start(ap, fmt);
+  int n = vsnprintf(o->data + o->len, EXP_BUF - o->len, fmt, ap);
+  va_end(ap);
+  if(n > 0) o->len = min(EXP_BUF - 1, o->len + (size_t)n);
+}
 
-  auto *res = req->beginResponseStream("application/vnd.ms-excel");
-  res->addHeader("Content-Disposition","attachment; filename=\"smartload_logs.xls\"");
-
-  res->print("<?xml version=\"1.0\"?>\n");
-  res->print("<?mso-application progid=\"Excel.Sheet\"?>\n");
-  res->print("<Workbook xmlns=\"urn:schemas-microsoft-com:office:spreadsheet\" "
-             "xmlns:o=\"urn:schemas-microsoft-com:office:office\" "
-             "xmlns:x=\"urn:schemas-microsoft-com:office:excel\" "
-             "xmlns:ss=\"urn:schemas-microsoft-com:office:spreadsheet\" "
-             "xmlns:html=\"http://www.w3.org/TR/REC-html40\">\n");
-  res->print("<Worksheet ss:Name=\"Logs\"><Table>\n");
-  res->print("<Row>"
-               "<Cell><Data ss:Type=\"String\">timestamp</Data></Cell>"
-               "<Cell><Data ss:Type=\"String\">budget_kwh</Data></Cell>"
-               "<Cell><Data ss:Type=\"String\">remaining_kwh</Data></Cell>"
-               "<Cell><Data ss:Type=\"String\">used_kwh</Data></Cell>"
-             "</Row>\n");
+static const char* const EXP_HEAD[] = {
+  "timestamp,budget_kwh,remaining_kwh,used_kwh\n",
+
+  "<?xml version=\"1.0\"?>\n"
+  "<?mso-application progid=\"Excel.Sheet\"?>\n"
+  "<Workbook xmlns=\"urn:schemas-microsoft-com:office:spreadsheet\" "
+  "xmlns:o=\"urn:schemas-microsoft-com:office:office\" "
+  "xmlns:x=\"urn:schemas-microsoft-com:office:excel\" "
+  "xmlns:ss=\"urn:schemas-microsoft-com:office:spreadsheet\" "
+  "xmlns:html=\"http://www.w3.org/TR/REC-html40\">\n"
+  "<Worksheet ss:Name=\"Logs\"><Table>\n"
+  "<Row>"
+    "<Cell><Data ss:Type=\"String\">timestamp</Data></Cell>"
+    "<Cell><Data ss:Type=\"String\">budget_kwh</Data></Cell>"
+    "<Cell><Data ss:Type=\"String\">remaining_kwh</Data></Cell>"
+    "<Cell><Data ss:Type=\"String\">used_kwh</Data></Cell>"
+  "</Row>\n",
+
+  "<!doctype html><html><head><meta charset='utf-8'>"
+  "<title>SmartLoad Logs</title>"
+  "<style>body{font:14px Arial;margin:24px;} table{border-collapse:collapse;width:100%;}"
+  "th,td{border:1px solid #ccc;padding:6px 8px;text-align:left;} th{background:#f5f5f5;}"
+  "@media print{body{margin:0;} thead{display:table-header-group;}}</style>"
+  "</head><body onload='window.print()'>"
+  "<h2>SmartLoad Logs</h2>"
+  "<table><thead><tr>"
+  "<th>timestamp</th><th>budget_kwh</th><th>remaining_kwh</th><th>used_kwh</th>"
+  "</tr></thead><tbody>",
+};
+static const char* const EXP_ROW[] = {
+  "%s,%.6f,%.6f,%.6f\n",
+  "<Row><Cell><Data ss:Type=\"String\">%s</Data></Cell>"
+  "<Cell><Data ss:Type=\"Number\">%.6f</Data></Cell>"
+  "<Cell><Data ss:Type=\"Number\">%.6f</Data></Cell>"
+  "<Cell><Data ss:Type=\"Number\">%.6f</Data></Cell></Row>\n",
+  "<tr><td>%s</td><td>%.6f</td><td>%.6f</td><td>%.6f</td></tr>",
+};
+static const char* const EXP_FOOT[] = {
+  "",
+  "</Table></Worksheet></Workbook>\n",
+  "</tbody></table></body></html>",
+};
 
-  uint32_t lastY = millis();
-  size_t rowCount = 0;
-
-  for (size_t i=0;i<files.size();++i){
-    File f = SD.open(files[i], "r");
-    if (!f) continue;
-    while (f.available()){
-      String line = f.readStringUntil('\n'); line.trim();
-      if (line.length()==0 || line.startsWith("timestamp")) continue;
-
-      LogRow r; if (!parseCsvLine(line, r)) continue;
-      time_t tRow = parseTimestampLocal(r.ts);
-      if (tFrom && tRow < tFrom) continue;
-      if (tTo   && tRow > tTo)   continue;
-
-      res->print("<Row>");
-      res->print("<Cell><Data ss:Type=\"String\">"); res->print(r.ts);        res->print("</Data></Cell>");
-      res->print("<Cell><Data ss:Type=\"Number\">"); res->print(r.budget, 6); res->print("</Data></Cell>");
-      res->print("<Cell><Data ss:Type=\"Number\">"); res->print(r.rem, 6);    res->print("</Data></Cell>");
-      res->print("<Cell><Data ss:Type=\"Number\">"); res->print(r.used, 6);   res->print("</Data></Cell>");
-      res->print("</Row>\n");
-
-      if (++rowCount % 200 == 0 || (millis() - lastY > 10)) { delay(0); lastY = millis(); }
+// Stage 1 (core 0): log files (CSV or archive) -> raw buffers of LogRow
+// records, already filtered to the requested range.
+static void exportReaderTask(void* arg){
+  ExportJob& j = *(ExportJob*)arg;
+  const size_t cap = EXP_BUF / sizeof(LogRow);
+  uint32_t keyFrom = j.from ? logKeyOf(j.from) : 0;
+  uint32_t keyTo   = j.to   ? logKeyOf(j.to)   : UINT32_MAX;
+  ExpBuf* b = nullptr;
+  bool ok = expTake(j, j.rawFree, b);
+  if(ok) b->len = 0;
+  for(size_t i=0; ok && i<j.files.size(); ++i){
+    const LogFileRef& ref = j.files[i];
+    if(logFileKeyHi(ref) < keyFrom) continue;
+    if(ref.key > keyTo) break;
+    std::unique_ptr<LogSource> src;
+    {
+      SdLock lk(SD_PRIO_BULK);
+      if(!lk) break;
+      src.reset(new LogSource(ref));
+      if(!*src){ src.reset(); continue; }
+      if(j.from) src->seekTime(j.from);
     }
-    f.close();
-    if (millis() - lastY > 10) { delay(0); lastY = millis(); }
+    bool eofFile = false;
+    while(ok && !eofFile){
+      {
+        SdLock lk(SD_PRIO_BULK);
+        if(!lk){ ok = false; break; }
+        LogRow* rows = (LogRow*)b->data;
+        size_t n = b->len / sizeof(LogRow);
+        time_t t;
+        while(n < cap){
+          if(!src->next(rows[n], t)){ eofFile = true; break; }
+          if((j.from && t < j.from) || (j.to && t > j.to)) continue;
+          n++;
+        }
+        b->len = n * sizeof(LogRow);
+      }
+      if(!eofFile){
+        b->last = false;
+        ok = expPut(j, j.rawFull, b) && expTake(j, j.rawFree, b);
+        if(ok) b->len = 0;
+      }
+    }
+    SdLock lk(SD_PRIO_BULK);
+    src.reset();   // closes the file under the bus lock
+  }
+  // A bus failure still ends the stream cleanly (truncated) rather than hanging it.
+  if(b && !j.cancel){ b->last = true; expPut(j, j.rawFull, b); }
+  exportRelease(j);
+  vTaskDelete(nullptr);
+}
+
+// Stage 2 (core 1): LogRow records -> rendered rows in output buffers.
+static void exportFormatTask(void* arg){
+  ExportJob& j = *(ExportJob*)arg;
+  ExpBuf* o = nullptr;
+  bool ok = expTake(j, j.outFree, o);
+  if(ok){ o->len = 0; expPrintf(o, "%s", EXP_HEAD[j.fmt]); }
+  bool last = false;
+  while(ok && !last){
+    ExpBuf* r;
+    if(!expTake(j, j.rawFull, r)) break;
+    last = r->last;
+    const LogRow* rows = (const LogRow*)r->data;
+    size_t n = r->len / sizeof(LogRow);
+    for(size_t k=0; ok && k<n; k++){
+      if(o->len + EXP_ROW_MAX > EXP_BUF){
+        o->last = false;
+        ok = expPut(j, j.outFull, o) && expTake(j, j.outFree, o);
+        if(ok) o->len = 0;
+      }
+      if(ok){ expPrintf(o, EXP_ROW[j.fmt], rows[k].ts, rows[k].budget, rows[k].rem, rows[k].used); exportRows++; }
+    }
+    xQueueSend(j.rawFree, &r, 0);
+  }
+  if(ok && !j.cancel){
+    if(o->len + strlen(EXP_FOOT[j.fmt]) + 1 > EXP_BUF){
+      o->last = false;
+      ok = expPut(j, j.outFull, o) && expTake(j, j.outFree, o);
+      if(ok) o->len = 0;
+    }
+    if(ok){ expPrintf(o, "%s", EXP_FOOT[j.fmt]); o->last = true; expPut(j, j.outFull, o); }
+  }
+  exportRelease(j);
+  vTaskDelete(nullptr);
+}
+
+static void exportStart(AsyncWebServerRequest* req, ExportFmt fmt, const char* contentType, const char* filename){
+  if (!hasAuth(req)) { req->send(401); return; }
+  if (!exportReady()) { req->send(503, "text/plain", "Export unavailable"); return; }
+  bool idle = false;
+  if (!expBusy.compare_exchange_strong(idle, true)) {
+    AsyncWebServerResponse* r = req->beginResponse(503, "text/plain", "Another export is running");
+    r->addHeader("Retry-After", "5");
+    req->send(r);
+    return;
   }
 
-  res->print("</Table></Worksheet></Workbook>\n");
+  ExportJob& j = expJob;
+  j.fmt = fmt;
+  rangeFromParams(req, j.from, j.to);
+  j.files.clear();
+  {
+    SdLock lk(SD_PRIO_BULK);
+    if (!lk) { expBusy = false; sdBusy(req); return; }
+    collectLogFiles(j.files);
+  }
+  xQueueReset(j.rawFree); xQueueReset(j.rawFull); xQueueReset(j.outFree); xQueueReset(j.outFull);
+  for(uint8_t i=0;i<EXP_NBUF;i++){
+    ExpBuf* rb = &j.raw[i]; xQueueSend(j.rawFree, &rb, 0);
+    ExpBuf* ob = &j.out[i]; xQueueSend(j.outFree, &ob, 0);
+  }
+  j.cur = nullptr; j.curPos = 0; j.done = false; j.startMs = millis();
+  j.cancel = false;
+  j.refs = 3;
+  bool okR = xTaskCreatePinnedToCore(exportReaderTask, "expRead", 4096, &j, 1, nullptr, 0) == pdPASS;
+  if (!okR) j.refs--;
+  bool okF = xTaskCreatePinnedToCore(exportFormatTask, "expFmt",  4096, &j, EXP_FMT_PRIO, nullptr, 1) == pdPASS;
+  if (!okF) j.refs--;
+  if (!okR || !okF) { j.cancel = true; exportRelease(j); req->send(503, "text/plain", "Out of memory"); return; }
+  exportCount++;
+
+  // Dropping the response (done or client gone) cancels the stages.
+  std::shared_ptr<ExportJob> hold(&j, [](ExportJob* p){ p->cancel = true; exportRelease(*p); });
+  AsyncWebServerResponse* res = req->beginChunkedResponse(contentType,
+    [hold](uint8_t* buf, size_t maxLen, size_t) -> size_t {
+      ExportJob& j = *hold;
+      if(!j.cur){
+        if(j.done) return 0;
+        if(xQueueReceive(j.outFull, &j.cur, pdMS_TO_TICKS(20)) != pdTRUE) return RESPONSE_TRY_AGAIN;
+        j.curPos = 0;
+      }
+      size_t n = min(maxLen, j.cur->len - j.curPos);
+      memcpy(buf, j.cur->data + j.curPos, n);
+      j.curPos += n;
+      if(j.curPos >= j.cur->len){
+        if(j.cur->last){ j.done = true; exportMs += millis() - j.startMs; }
+        xQueueSend(j.outFree, &j.cur, 0);
+        j.cur = nullptr;
+      }
+      exportBytes.fetch_add(n, std::memory_order_relaxed);
+      return (n || j.done) ? n : RESPONSE_TRY_AGAIN;
+    });
+  if (filename) {
+    String cd = "attachment; filename=\""; cd += filename; cd += "\"";
+    res->addHeader("Content-Disposition", cd);
+  }
   req->send(res);
 }
 
+static void handleLogsExport(AsyncWebServerRequest* req){
+  exportStart(req, EXP_CSV, "text/csv", "smartload_logs.csv");
+}
+
+/* ===== NEW: Excel .xls export (SpreadsheetML 2003) ===== */
+static void handleLogsExportXls(AsyncWebServerRequest* req){
+  exportStart(req, EXP_XLS, "application/vnd.ms-excel", "smartload_logs.xls");
+}
+
 /* ===== NEW: Print (printer-friendly HTML) ===== */
 static void handleLogsPrint(AsyncWebServerRequest* req){
-  if (!hasAuth(req)) { req->send(401); return; }
-
-  time_t tFrom = 0, tTo = 0;
-  if (req->hasParam("from")) { String f = req->getParam("from")->value(); f.replace('T',' '); tFrom = parseTimestampLocal(f); }
-  if (req->hasParam("to"))   { String t = req->getParam("to")->value();   t.replace('T',' '); tTo   = parseTimestampLocal(t); }
+  exportStart(req, EXP_HTML, "text/html; charset=utf-8", nullptr);
+}
 
-  std::vector<String> files; files.reserve(64);
-  collectLogFiles(files);
+/* ===== Event summary (time in zone, sheds, energy per zone) ===== */
+// One streaming pass over the monthly event files (the last 7 days unless
+// `from` is given, at most EV_RANGE_DAYS), starting a month before `from` so
+// the state in force at `from` is known (EV_MARK guarantees a record at least
+// hourly). Intervals are clipped to [from, to]; energy is the meter
+// delta across each interval, prorated when clipped. A gap that ends in
+// EV_BOOT counts as unknown: the device was off or restarting. When the time
+// slice runs out first the result is cut at a record: `truncated` is set, it
+// covers [from, to), and the client asks again from `to`.
+static const uint8_t  AGG_PAUSED = 5, AGG_UNKNOWN = 6;
+static const uint32_t EV_RANGE_DAYS = 92;   // longest span one request may cover
+struct EvAgg {
+  uint32_t sec[7];     // zones 0..4, paused, unknown
+  double   kwh[7];
+  uint32_t entered[5], sheds[4];
+  uint32_t events, zoneDrops, manualChanges, stops, resumes, restarts, staleSpells, badRecords;
+};
+static void evAccumulate(EvAgg& g, uint8_t bucket, uint32_t t0, uint32_t t1, uint32_t dwh0, uint32_t dwh1, uint32_t from, uint32_t to){
+  if (t1 <= t0) return;
+  uint32_t a = max(t0, from), b = min(t1, to);
+  if (b <= a) return;
+  g.sec[bucket] += b - a;
+  if (dwh1 >= dwh0) g.kwh[bucket] += (dwh1 - dwh0) / 10000.0 * (double)(b - a) / (double)(t1 - t0);
+}
+static void handleEventsSummary(AsyncWebServerRequest* req){
+  if (!hasAuth(req)) { req->send(401); return; }
 
-  auto *res = req->beginResponseStream("text/html; charset=utf-8");
-  res->print("<!doctype html><html><head><meta charset='utf-8'>"
-             "<title>SmartLoad Logs</title>"
-             "<style>body{font:14px Arial;margin:24px;} table{border-collapse:collapse;width:100%;}"
-             "th,td{border:1px solid #ccc;padding:6px 8px;text-align:left;} th{background:#f5f5f5;}"
-             "@media print{body{margin:0;} thead{display:table-header-group;}}</style>"
-             "</head><body onload='window.print()'>"
-             "<h2>SmartLoad Logs</h2>"
-             "<table><thead><tr>"
-             "<th>timestamp</th><th>budget_kwh</th><th>remaining_kwh</th><th>used_kwh</th>"
-             "</tr></thead><tbody>");
+  time_t tFrom, tTo; rangeFromParams(req, tFrom, tTo);
+  uint32_t now  = (uint32_t)clockEpoch();
+  uint32_t to   = tTo ? min((uint32_t)tTo, now) : now;
+  uint32_t from = tFrom ? (uint32_t)tFrom : 0;
+  if (!from){ DateTime d(to - 6 * 86400); from = DateTime(d.year(), d.month(), d.day(), 0, 0, 0).unixtime(); }   // the last 7 days
+  if (to < from) { req->send(400, "text/plain", "to before from"); return; }
+  if (to - from > EV_RANGE_DAYS * 86400) { req->send(400, "text/plain", "Range too long"); return; }
+  DateTime d(from);
+  int y = d.year(), m = d.month() - 1;
+  if (m == 0){ m = 12; y--; }
+  uint32_t startMonth = y * 100 + m;
+
+  EvAgg g; memset(&g, 0, sizeof(g));
+  bool have = false, done = false, busy = false, cut = false;
+  uint32_t lastT = 0, lastDWh = 0;
+  uint8_t bucket = AGG_UNKNOWN, manual = 0;
+  {
+    SdLock lk(SD_PRIO_BULK);
+    if (!lk) { sdBusy(req); return; }
+    std::vector<String> files;
+    forEachFileIn(EVENTS_DIR, [&](const String& nm){
+      unsigned ym;
+      if (sscanf(nm.c_str(), "ev_%6u.bin", &ym) == 1 && ym >= startMonth) files.push_back(String(EVENTS_DIR) + "/" + nm);
+    });
+    std::sort(files.begin(), files.end());   // ev_YYYYMM sorts chronologically
+
+    for (size_t i = 0; i < files.size() && !done; i++){
+      File f = SD.open(files[i], "r");
+      if (!f) continue;
+      {
+        SdBlockReader rd(f);
+        EventRec e; size_t got = 0; uint32_t n = 0;
+        while (size_t k = rd.read((uint8_t*)&e + got, sizeof(e) - got)){
+          if ((got += k) < sizeof(e)) continue;
+          got = 0;
+          if (++n % 256 == 0 && !lk.yieldToHigher()){ busy = true; done = true; break; }
+          if ((uint8_t)crc32((const uint8_t*)&e, sizeof(e) - 1) != e.check){ g.badRecords++; continue; }
+
+          uint32_t dwh = eventMeterDWh(e);
+          if (have) evAccumulate(g, e.type == EV_BOOT ? AGG_UNKNOWN : bucket, lastT, e.epoch, lastDWh, dwh, from, to);
+          if (e.epoch > to){ done = true; break; }
+          if (e.epoch > from && e.epoch > lastT && sliceSpent()){ to = e.epoch; cut = done = true; break; }
+          if (e.epoch >= from){
+            g.events++;
+            switch (e.type){
+              case EV_ZONE:
+                if (e.to < 5) g.entered[e.to]++;
+                if (e.to < e.from) g.zoneDrops++;
+                break;
+              case EV_RELAYS:   // automatic sheds only: not paused, not a manual override
+                if (!(e.state & 1) && e.from != 0xFF)
+                  for (uint8_t b = 0; b < 4; b++) if ((e.from & ~e.to & ~manual) & (1u << b)) g.sheds[b]++;
+                break;
+              case EV_MANUAL:     g.manualChanges++; break;
+              case EV_STOP:       g.stops++; break;
+              case EV_RESUME:     g.resumes++; break;
+              case EV_RESTART:    g.restarts++; break;
+              case EV_PZEM_STALE: if (e.to) g.staleSpells++; break;
+              default: break;
+            }
+          }
+          if (e.type == EV_MANUAL) manual = e.to;
+          bucket = (e.state & 1) ? AGG_PAUSED : (e.zone < 5 ? e.zone : AGG_UNKNOWN);
+          lastT = e.epoch; lastDWh = dwh; have = true;
+        }
+      }
+      f.close();
+    }
+  }
+  if (busy) { sdBusy(req); return; }
+  // nothing after the last record: it still holds, up to `to` on the live meter
+  if (have && !done) evAccumulate(g, bucket, lastT, now, lastDWh, meterNowDWh(), from, to);
+
+  ArenaLease lease(req);
+  JsonDocument doc(lease.alloc());
+  doc["from"] = from; doc["to"] = to; doc["events"] = g.events;
+  if (cut) doc["truncated"] = true;
+  JsonArray zones = doc["zones"].to<JsonArray>();
+  for (uint8_t z = 0; z < 5; z++){
+    JsonObject o = zones.add<JsonObject>();
+    o["zone"] = z; o["seconds"] = g.sec[z]; o["kwh"] = g.kwh[z]; o["entered"] = g.entered[z];
+  }
+  doc["paused"]["seconds"]  = g.sec[AGG_PAUSED];  doc["paused"]["kwh"]  = g.kwh[AGG_PAUSED];
+  doc["unknown"]["seconds"] = g.sec[AGG_UNKNOWN]; doc["unknown"]["kwh"] = g.kwh[AGG_UNKNOWN];
+  JsonArray sheds = doc["sheds"].to<JsonArray>();
+  for (uint8_t b = 0; b < 4; b++) sheds.add(g.sheds[b]);
+  doc["zone_drops"]        = g.zoneDrops;
+  doc["manual_changes"]    = g.manualChanges;
+  doc["stops"]             = g.stops;
+  doc["resumes"]           = g.resumes;
+  doc["restarts"]          = g.restarts;
+  doc["pzem_stale_spells"] = g.staleSpells;
+  doc["bad_records"]       = g.badRecords;
+  sendJson(req, doc, lease.a);
+}
 
-  uint32_t lastY = millis();
-  size_t rowCount = 0;
-
-  for (size_t i=0;i<files.size();++i){
-    File f = SD.open(files[i], "r");
-    if (!f) continue;
-    while (f.available()){
-      String line = f.readStringUntil('\n'); line.trim();
-      if (line.length()==0 || line.startsWith("timestamp")) continue;
-      LogRow r; if (!parseCsvLine(line, r)) continue;
-      time_t tRow = parseTimestampLocal(r.ts);
-      if (tFrom && tRow < tFrom) continue;
-      if (tTo   && tRow > tTo)   continue;
-
-      res->print("<tr>");
-      res->print("<td>"); res->print(r.ts);        res->print("</td>");
-      res->print("<td>"); res->print(r.budget, 6); res->print("</td>");
-      res->print("<td>"); res->print(r.rem, 6);    res->print("</td>");
-      res->print("<td>"); res->print(r.used, 6);   res->print("</td>");
-      res->print("</tr>");
-
-      if (++rowCount % 200 == 0 || (millis() - lastY > 10)) { delay(0); lastY = millis(); }
+/* ===== Power-quality query (CSV stream) ===== */
+// /api/pq?from=&to= : walks the day files in range, binary-searches each
+// sparse index for `from`, and decodes one CRC-checked block per bus hold.
+// The flushed blocks are followed by the pending and current RAM blocks. Rows
+// at or before the last one sent are skipped, so a block flushed mid-query is
+// not sent twice.
+struct PqStream {
+  int64_t  fromMs, toMs, lastMs = INT64_MIN;
+  uint32_t day, lastDay;              // epoch / 86400
+  File     f;
+  std::vector<PqIdx> idx;
+  size_t   bi = 0;
+  uint8_t  liveStage = 0;             // 1 pending block, 2 current block
+  uint8_t  blk[PQ_BUF_BYTES];
+  const uint8_t *p = nullptr, *end = nullptr;
+  uint16_t left = 0;
+  PqDecodeState st;
+  bool     done = false;
+  char     line[96];
+  size_t   lineLen = 0, linePos = 0;
+};
+static bool pqLoadLive(PqStream& s){
+  while (s.liveStage < 2){
+    s.liveStage++;
+    bool got = false;
+    portENTER_CRITICAL(&pqMux);
+    PqBlockWriter* w = s.liveStage == 1 ? (pqDonePending ? pqDone : nullptr) : pqCur;
+    if (w && w->rows){
+      memcpy(s.blk, w->buf, w->len);
+      s.end = s.blk + w->len; s.left = w->rows;
+      pqDecodeBegin(s.st, w->t0Ms);
+      got = true;
     }
-    f.close();
-    if (millis() - lastY > 10) { delay(0); lastY = millis(); }
+    portEXIT_CRITICAL(&pqMux);
+    if (got){ s.p = s.blk; return true; }
   }
+  return false;
+}
+// 1 = a block is loaded, 0 = nothing left, -1 = bus busy, try again
+static int pqNextBlock(PqStream& s){
+  for (;;){
+    if (s.liveStage) return pqLoadLive(s) ? 1 : 0;
+    SdLock lk(SD_PRIO_BULK, 50);
+    if (!lk.held) return -1;
+    if (!lk){ if (s.f) s.f.close(); s.day = s.lastDay + 1; }   // no card: only the RAM blocks
+    if (!s.f){
+      if (s.day > s.lastDay) return pqLoadLive(s) ? 1 : 0;
+      uint32_t epoch = s.day++ * 86400UL;
+      File x = SD.open(pqPath(epoch, "pqi"), "r");
+      s.idx.clear();
+      if (x){
+        s.idx.resize(x.size() / sizeof(PqIdx));
+        if (x.read((uint8_t*)s.idx.data(), s.idx.size() * sizeof(PqIdx)) != s.idx.size() * sizeof(PqIdx)) s.idx.clear();
+        x.close();
+      }
+      if (s.idx.empty()) continue;
+      s.f = SD.open(pqPath(epoch, "pqb"), "r");
+      if (!s.f) continue;
+      // last block starting at or before `from`
+      uint32_t fromS = (uint32_t)(s.fromMs / 1000);
+      auto it = std::upper_bound(s.idx.begin(), s.idx.end(), fromS, [](uint32_t t, const PqIdx& e){ return t < e.firstS; });
+      s.bi = it == s.idx.begin() ? 0 : (size_t)(it - s.idx.begin()) - 1;
+    }
+    if (s.bi >= s.idx.size()){ s.f.close(); continue; }
+    const PqIdx& e = s.idx[s.bi++];
+    PqBlockHdr h;
+    if (!s.f.seek(e.off) || s.f.read((uint8_t*)&h, sizeof(h)) != sizeof(h) || h.magic != PQ_MAGIC || h.len > PQ_BUF_BYTES
+        || s.f.read(s.blk, h.len) != h.len || crc32(s.blk, h.len) != h.crc){ pqCrcErrors++; continue; }
+    if (h.t0Ms > s.toMs){ s.f.close(); s.done = true; return 0; }
+    pqDecodeBegin(s.st, h.t0Ms);
+    s.p = s.blk; s.end = s.blk + h.len; s.left = h.rows;
+    return 1;
+  }
+}
+static void handlePqQuery(AsyncWebServerRequest* req){
+  if (!hasAuth(req)) { req->send(401); return; }
+  time_t tFrom, tTo; rangeFromParams(req, tFrom, tTo);
+  uint32_t now = (uint32_t)clockEpoch();
+  uint32_t from = tFrom ? (uint32_t)tFrom : now - 3600;   // default: the last hour
+  uint32_t to   = tTo ? (uint32_t)tTo : now;
+  if (to < from){ req->send(400, "text/plain", "to before from"); return; }
+
+  PqStream* raw = new (std::nothrow) PqStream();
+  if (!raw){ req->send(503, "text/plain", "Out of memory"); return; }
+  std::shared_ptr<PqStream> st(raw, [](PqStream* p){ if (p->f) sdDispose([p]{ p->f.close(); delete p; }); else delete p; });
+  st->fromMs = (int64_t)from * 1000; st->toMs = (int64_t)to * 1000 + 999;
+  st->day = from / 86400; st->lastDay = to / 86400;
+  st->lineLen = snprintf(st->line, sizeof(st->line), "t_ms,voltage_v,current_a,power_w,pf,frequency_hz\n");
+
+  AsyncWebServerResponse* res = req->beginChunkedResponse("text/csv",
+    [st](uint8_t* buf, size_t maxLen, size_t) -> size_t {
+      PqStream& s = *st;
+      size_t out = 0;
+      while (out < maxLen){
+        if (s.linePos < s.lineLen){
+          size_t n = min(maxLen - out, s.lineLen - s.linePos);
+          memcpy(buf + out, s.line + s.linePos, n);
+          out += n; s.linePos += n;
+          continue;
+        }
+        if (s.done) break;
+        if (!s.left){
+          int r = pqNextBlock(s);
+          if (r < 0){ if (out) break; return RESPONSE_TRY_AGAIN; }
+          if (r == 0){ s.done = true; continue; }
+        }
+        s.left--;
+        const uint8_t* np = pqDecodeRow(s.p, s.end, s.st);
+        if (!np){ s.left = 0; continue; }
+        s.p = np;
+        const PqSample& x = s.st.prev;
+        if (x.tMs <= s.lastMs || x.tMs < s.fromMs) continue;
+        if (x.tMs > s.toMs){ s.done = true; continue; }
+        s.lastMs = x.tMs;
+        s.lineLen = snprintf(s.line, sizeof(s.line), "%lld,%.1f,%.3f,%.1f,%.2f,%.1f\n",
+                             (long long)x.tMs, x.dV / 10.0, x.mA / 1000.0, x.dW / 10.0, x.cPf / 100.0, x.dHz / 10.0);
+        s.linePos = 0;
+      }
+      return out;
+    });
+  res->addHeader("Cache-Control", "no-store");
+  req->send(res);
+}
 
-  res->print("</tbody></table></body></html>");
+/* ===== Trace dump (Chrome trace_event JSON) ===== */
+// /api/trace : both rings, oldest first, pid = core and tid = task. The rings
+// stay frozen while they stream and record again once the response is gone.
+#if SMARTLOAD_TRACE
+struct TraceDump {
+  uint8_t  core = 0, stage = 0;           // 0 events, 1 thread names, 2 done
+  uint32_t i = 0, n = 0;
+  const char* tasks[16]; uint8_t taskCount = 0;
+  bool     first = true;
+  char     line[160];
+  size_t   lineLen = 0, linePos = 0;
+};
+static uint8_t traceTaskId(TraceDump& d, const char* task){
+  for (uint8_t k = 0; k < d.taskCount; k++) if (!strncmp(d.tasks[k], task, 8)) return k + 1;
+  if (d.taskCount == 16) return 0;
+  d.tasks[d.taskCount++] = task;   // points into the frozen ring
+  return d.taskCount;
+}
+static void traceDumpWindow(TraceDump& d){
+  uint32_t head = traceRings[d.core].head.load();
+  d.n = head < TRACE_EVENTS ? head : TRACE_EVENTS;
+  d.i = head - d.n;
+}
+// Fills d.line with the next event; false when there is none left.
+static bool traceDumpNext(TraceDump& d){
+  while (d.stage == 0){
+    if (d.n == 0){
+      if (++d.core == 2){ d.stage = 1; d.i = 0; break; }
+      traceDumpWindow(d);
+      continue;
+    }
+    const TraceEvent& e = traceRings[d.core].ev[d.i++ & (TRACE_EVENTS - 1)];
+    d.n--;
+    if (!e.name) continue;
+    uint32_t durNs = (uint32_t)((uint64_t)e.durCycles * 1000u / traceMhz);
+    d.lineLen = snprintf(d.line, sizeof(d.line), "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%u,\"dur\":%u.%03u}",
+                         d.first ? "" : ",\n", e.name, (unsigned)d.core, (unsigned)traceTaskId(d, e.task),
+                         (unsigned)e.tsUs, (unsigned)(durNs / 1000), (unsigned)(durNs % 1000));
+    d.first = false;
+    return true;
+  }
+  if (d.stage == 1){
+    if (d.i < 2u + d.taskCount){
+      uint32_t k = d.i++;
+      const char* sep = d.first ? "" : ",\n";
+      if (k < 2) d.lineLen = snprintf(d.line, sizeof(d.line),
+        "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"core %u\"}}", sep, (unsigned)k, (unsigned)k);
+      else {   // task ids are shared by both cores
+        unsigned tid = k - 1; const char* t = d.tasks[k - 2];
+        d.lineLen = snprintf(d.line, sizeof(d.line),
+          "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"%.8s\"}},\n"
+          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%.8s\"}}", sep, tid, t, tid, t);
+      }
+      d.first = false;
+      return true;
+    }
+    d.stage = 2;
+    d.lineLen = snprintf(d.line, sizeof(d.line), "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return true;
+  }
+  return false;
+}
+#endif
+static void handleTrace(AsyncWebServerRequest* req){
+  if (!hasAuth(req)) { req->send(401); return; }
+#if SMARTLOAD_TRACE
+  TraceDump* raw = new (std::nothrow) TraceDump();
+  if (!raw){ req->send(503, "text/plain", "Out of memory"); return; }
+  traceFrozen = true;
+  std::shared_ptr<TraceDump> st(raw, [](TraceDump* p){ delete p; traceFrozen = false; });
+  traceDumpWindow(*st);
+  st->lineLen = snprintf(st->line, sizeof(st->line), "{\"traceEvents\":[\n");
+  AsyncWebServerResponse* res = req->beginChunkedResponse("application/json",
+    [st](uint8_t* buf, size_t maxLen, size_t) -> size_t {
+      TraceDump& d = *st;
+      size_t out = 0;
+      while (out < maxLen){
+        if (d.linePos < d.lineLen){
+          size_t n = min(maxLen - out, d.lineLen - d.linePos);
+          memcpy(buf + out, d.line + d.linePos, n);
+          out += n; d.linePos += n;
+          continue;
+        }
+        if (!traceDumpNext(d)) break;
+        d.linePos = 0;
+      }
+      return out;
+    });
+  res->addHeader("Cache-Control", "no-store");
   req->send(res);
+#else
+  req->send(404, "text/plain", "Tracing not built in (build with -DSMARTLOAD_TRACE=1)");
+#endif
 }
 
 /* ===================== URL decode helpers ===================== */
-static String urlDecode(const String &s){
-  String out; out.reserve(s.length());
-  for (size_t i=0;i<s.length();++i){
-    char c=s[i];
-    if (c=='%'){
-      if (i+2<s.length()){
-        char h1=s[i+1], h2=s[i+2];
-        auto hex=[&](char h)->int{ if(h>='0'&&h<='9') return h-'0'; if(h>='A'&&h<='F') return h-'A'+10; if(h>='a'&&h<='f') return h-'a'+10; return 0; };
-        out += char((hex(h1)<<4)|hex(h2)); i+=2;
-      }
-    } else if (c=='+') out+=' ';
-    else out+=c;
+static void urlDecodeInPlace(char* s){
+  auto hex=[](char h)->int{ if(h>='0'&&h<='9') return h-'0'; if(h>='A'&&h<='F') return h-'A'+10; if(h>='a'&&h<='f') return h-'a'+10; return 0; };
+  char* o = s;
+  for (; *s; ++s){
+    if (*s=='%' && s[1] && s[2]){ *o++ = char((hex(s[1])<<4)|hex(s[2])); s+=2; }
+    else if (*s=='+') *o++ = ' ';
+    else *o++ = *s;
+  }
+  *o = 0;
+}
+static bool parseBoolStr(const char* v){
+  return !strcasecmp(v,"1") || !strcasecmp(v,"true") || !strcasecmp(v,"yes") || !strcasecmp(v,"on");
+}
+
+/* ===================== Captive DNS (own task) ===================== */
+// Every name resolves to the AP address. The responder blocks on its own UDP
+// socket and answers each query as it arrives, by rewriting the request in
+// place and appending a prebuilt A record, so loop() stalls (PZEM, SD, the
+// 50 ms tick) never delay a phone's captive-portal probe.
+static const uint16_t DNS_PORT  = 53;
+static const uint32_t DNS_TTL_S = 60;
+static uint8_t dnsAnswer[16];   // name ptr to the question, A, IN, TTL, len 4, address
+
+// Turns the query in buf[0..n) into its reply; returns the reply length, or 0
+// for anything that isn't a plain one-question query.
+static size_t dnsBuildReply(uint8_t* buf, size_t n){
+  if(n < 12 || (buf[2] & 0x80) || (buf[2] & 0x78) || buf[4] || buf[5] != 1) return 0;
+  size_t i = 12;
+  while(i < n && buf[i]){
+    if(buf[i] > 63) return 0;   // no compression in a question
+    i += buf[i] + 1;
   }
-  return out;
+  if(i + 5 > n) return 0;
+  uint16_t qtype = (uint16_t)(buf[i+1] << 8 | buf[i+2]);
+  size_t q = i + 5;
+  bool answer = qtype == 1 || qtype == 255;   // A or ANY; others get an empty NOERROR
+  buf[2] = (uint8_t)(0x84 | (buf[2] & 0x01));   // response, authoritative, keep RD
+  buf[3] = 0x80;                                 // RA, NOERROR
+  buf[6] = 0; buf[7] = answer ? 1 : 0;
+  buf[8] = buf[9] = buf[10] = buf[11] = 0;       // drops EDNS and the like
+  if(!answer) return q;
+  memcpy(buf + q, dnsAnswer, sizeof(dnsAnswer));
+  return q + sizeof(dnsAnswer);
+}
+static void dnsTask(void*){
+  int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  sockaddr_in addr; memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET; addr.sin_port = htons(DNS_PORT); addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if(s < 0 || bind(s, (sockaddr*)&addr, sizeof(addr)) < 0){
+    Serial.println("[DNS] bind failed");
+    if(s >= 0) close(s);
+    vTaskDelete(nullptr);
+    return;
+  }
+  timeval tv = { 1, 0 };   // wake once a second to roll the rate window
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  uint8_t buf[512];
+  uint32_t winStart = millis(), winCount = 0;
+  for(;;){
+    sockaddr_in from; socklen_t fromLen = sizeof(from);
+    int n = recvfrom(s, buf, sizeof(buf) - sizeof(dnsAnswer), 0, (sockaddr*)&from, &fromLen);
+    if(millis() - winStart >= 1000){ dnsRatePerS = winCount; winCount = 0; winStart = millis(); }
+    if(n <= 0) continue;
+    TRACE_SCOPE("dns_reply");
+    dnsQueries++; winCount++;
+    size_t len = dnsBuildReply(buf, (size_t)n);
+    if(!len){ dnsIgnored++; continue; }
+    if(sendto(s, buf, len, 0, (sockaddr*)&from, fromLen) == (int)len) dnsAnswered++;
+  }
+}
+static void dnsStart(IPAddress ip){
+  const uint8_t tail[16] = { 0xC0, 0x0C, 0, 1, 0, 1,
+                             (uint8_t)(DNS_TTL_S >> 24), (uint8_t)(DNS_TTL_S >> 16), (uint8_t)(DNS_TTL_S >> 8), (uint8_t)DNS_TTL_S,
+                             0, 4, ip[0], ip[1], ip[2], ip[3] };
+  memcpy(dnsAnswer, tail, sizeof(dnsAnswer));
+  xTaskCreatePinnedToCore(dnsTask, "dns", 3072, nullptr, 3, nullptr, 0);
 }
-static bool parseBoolStr(String v){ v.toLowerCase(); return (v=="1"||v=="true"||v=="yes"||v=="on"); }
 
 /* ===================== Wi-Fi ===================== */
 void startWiFi(){
@@ -1061,64 +4630,241 @@ void startWiFi(){
   WiFi.softAP(AP_SSID, AP_PASSWORD, channel, hidden, max_conn);
 
   // Captive-portal DNS (everything -> AP IP)
-  dnsServer.start(53, "*", apIP);
+  dnsStart(apIP);
 
   Serial.println("AP started.");
   Serial.print("IP: "); Serial.println(WiFi.softAPIP());
 }
 
-/* ===================== SLOW INIT TASK ===================== */
-void slowInitTask(void*){
-  // SD (robust)
-  sd_mount_with_retries();
-
-  // NTP / RTC (quick)
-  ntpSynced = syncNTP_quick();
-  if(!rtc.begin()){
-    Serial.println("RTC not found");
-  } else {
-    rtcReady = true;
-    if(ntpSynced) rtc.adjust(nowLocal());
-  }
-
-  // Config + PZEM + snapshot restore
-  loadConfig();
+/* ===================== SLOW INIT (staged boot graph) ===================== */
+// Boot work is split into stages with explicit dependencies; every stage runs
+// in its own short-lived task (pinned alternately to both cores) and waits
+// only for the bits it needs, so I2C, SPI/SD and UART bring-up overlap.
+// Readiness is staged: controlReady flips once config, the fast state tier
+// (RTC memory / LittleFS journal) and the meter are up (or, with no fast copy,
+// once the CSV restore is done), systemReady once the SD logs are available too. State restores after config, so the budget in the
+// RTC checkpoint or journal (written on every budget change) wins over the
+// config record's.
+enum BootStageId : uint8_t { BS_RTC, BS_NTP, BS_CLOCK, BS_SD, BS_CONFIG, BS_PZEM, BS_STATE, BS_CSV, BS_COUNT };
+#define BS_BIT(id) ((EventBits_t)1 << (id))
+struct BootStage {
+  const char* name;
+  EventBits_t deps;
+  BaseType_t  core;
+  uint16_t    stack;
+  bool      (*fn)();
+  int64_t     startUs, endUs;
+  bool        ok;
+};
+static EventGroupHandle_t bootEvents = nullptr;
+static bool    stateRestored = false;
+static int64_t controlReadyUs = 0, systemReadyUs = 0;
 
+static bool bootRtc(){
+  if(!rtc.begin()){ Serial.println("RTC not found"); return false; }
+  rtcReady = true;
+  return true;
+}
+static bool bootNtp(){ ntpSynced = syncNTP_quick(); return ntpSynced; }
+static bool bootClock(){
+  if(ntpSynced){ clockSyncFromNtp(); if(rtcReady) rtc.adjust(nowLocal()); }
+  else clockSyncFromRtc();
+  return clockSynced;
+}
+static bool bootSd(){ sd_mount_with_retries(); return sdMounted; }
+// NVS first; the card is only waited for when there is nothing there yet.
+static bool bootConfig(){
+  if(configLoadNvs()){ Serial.println("[CFG] loaded from NVS"); return true; }
+  xEventGroupWaitBits(bootEvents, BS_BIT(BS_SD), pdFALSE, pdTRUE, portMAX_DELAY);
+  return configImportCsv();
+}
+static bool bootPzem(){
   PZEMSerial.begin(9600, SERIAL_8N1, PZEM_RX, PZEM_TX);
   lastEnergyUpdateMs = millis();
+  return true;
+}
+// Fast tier: RTC slow memory after a warm reset, else the LittleFS journal.
+static bool bootState(){
+  stateRestored = loadRtcCheckpoint() || loadPauseSnapshot();
+  return stateRestored;
+}
+// Slow tier: only consulted when neither fast copy exists (first boot on a
+// new board, wiped flash).
+static bool bootCsv(){
+  if(stateRestored) return true;
+  if(loadSnapshotFromCsv()){ stateRestored = true; return true; }
+  frozenRem = budgetKWh; frozenPct = 100.0f; frozenUsed = 0.0;   // defaults
+  return false;
+}
 
-  // Default snapshot
-  frozenRem = budgetKWh;
-  frozenPct = 100.0f;
-  frozenUsed = 0.0;
+static BootStage bootStages[BS_COUNT] = {
+  /* BS_RTC    */ { "rtc",    0,                                             0, 3072, bootRtc,    0, 0, false },
+  /* BS_NTP    */ { "ntp",    0,                                             1, 3072, bootNtp,    0, 0, false },
+  /* BS_CLOCK  */ { "clock",  BS_BIT(BS_RTC)|BS_BIT(BS_NTP),                 1, 3072, bootClock,  0, 0, false },
+  /* BS_SD     */ { "sd",     0,                                             0, 4096, bootSd,     0, 0, false },
+  /* BS_CONFIG */ { "config", 0,                                             0, 4096, bootConfig, 0, 0, false },
+  /* BS_PZEM   */ { "pzem",   0,                                             1, 3072, bootPzem,   0, 0, false },
+  /* BS_STATE  */ { "state",  BS_BIT(BS_CONFIG),                             1, 4096, bootState,  0, 0, false },
+  /* BS_CSV    */ { "csv",    BS_BIT(BS_SD)|BS_BIT(BS_CONFIG)|BS_BIT(BS_PZEM)|BS_BIT(BS_STATE), 0, 6144, bootCsv, 0, 0, false },
+};
 
-  bool restored = false;
-  if(loadSnapshotFromCsv()){ restored = true; }
-  else if(loadPauseSnapshot()){ restored = true; }
+static void bootStageTask(void* arg){
+  BootStage& st = bootStages[(uintptr_t)arg];
+  if(st.deps) xEventGroupWaitBits(bootEvents, st.deps, pdFALSE, pdTRUE, portMAX_DELAY);
+  st.startUs = esp_timer_get_time();
+  st.ok = st.fn();
+  st.endUs = esp_timer_get_time();
+  Serial.printf("[BOOT] %-6s %s in %lld ms (core %d)\n", st.name, st.ok ? "ok" : "FAIL",
+                (long long)((st.endUs - st.startUs) / 1000), (int)xPortGetCoreID());
+  xEventGroupSetBits(bootEvents, BS_BIT((uintptr_t)arg));
+  vTaskDelete(NULL);
+}
 
+void slowInitTask(void*){
+  bootEvents = xEventGroupCreate();
+  for(uintptr_t i=0;i<BS_COUNT;i++){
+    xTaskCreatePinnedToCore(bootStageTask, bootStages[i].name, bootStages[i].stack, (void*)i, 1, nullptr, bootStages[i].core);
+  }
+
+  xEventGroupWaitBits(bootEvents, BS_BIT(BS_CONFIG)|BS_BIT(BS_STATE)|BS_BIT(BS_PZEM), pdFALSE, pdTRUE, portMAX_DELAY);
+  // No fast copy: the CSV restore rewrites budget and baseline and reads the
+  // meter, so it has to finish before loop() and the API take over.
+  if(!stateRestored) xEventGroupWaitBits(bootEvents, BS_BIT(BS_CSV), pdFALSE, pdTRUE, portMAX_DELAY);
   paused = true;
+  controlReadyUs = esp_timer_get_time();
+  controlReady = true;   // relays can be resumed from the fast snapshot now
+
+  xEventGroupWaitBits(bootEvents, (1u << BS_COUNT) - 1, pdFALSE, pdTRUE, portMAX_DELAY);
   forceLogNext = true;
 
+  systemReadyUs = esp_timer_get_time();
   systemReady = true;   // we’re good
-  Serial.println("[INIT] Background init complete.");
+  Serial.printf("[INIT] Background init complete: control %lld ms, full %lld ms.\n",
+                (long long)(controlReadyUs / 1000), (long long)(systemReadyUs / 1000));
+  slowInitStackHwm = uxTaskGetStackHighWaterMark(nullptr);
   vTaskDelete(NULL);
 }
 
+// GET /api/boot  -> per-stage timings (ms since boot)
+void handleBoot(AsyncWebServerRequest* req){
+  ArenaLease lease(req);
+  JsonDocument d(lease.alloc());
+  d["control_ready_ms"] = controlReadyUs / 1000.0;
+  d["system_ready_ms"]  = systemReadyUs / 1000.0;
+  d["restored"]         = stateRestored;
+  JsonArray arr = d["stages"].to<JsonArray>();
+  for(uint8_t i=0;i<BS_COUNT;i++){
+    const BootStage& st = bootStages[i];
+    JsonObject o = arr.add<JsonObject>();
+    o["name"] = st.name;
+    o["core"] = st.core;
+    JsonArray deps = o["deps"].to<JsonArray>();
+    for(uint8_t j=0;j<BS_COUNT;j++) if(st.deps & BS_BIT(j)) deps.add(bootStages[j].name);
+    bool done = st.endUs != 0;
+    o["done"] = done;
+    o["ok"]   = st.ok;
+    if(st.startUs) o["start_ms"] = st.startUs / 1000.0;
+    if(done)       o["end_ms"]   = st.endUs / 1000.0;
+    if(done)       o["dur_ms"]   = (st.endUs - st.startUs) / 1000.0;
+  }
+  sendJson(req, d, lease.a);
+}
+
+/* ===================== Route registration ===================== */
+static const char* methodName(WebRequestMethodComposite m){
+  switch(m){ case HTTP_GET: return "GET"; case HTTP_POST: return "POST"; default: return "ANY"; }
+}
+// server.on() behind admission control, with the handler timed under
+// smartload_http_request_duration_seconds
+static void route(const char* path, WebRequestMethodComposite m, ArRequestHandlerFunction fn, ReqClass cls = RC_STATUS){
+  LatencyHist* h = httpHist(path, methodName(m));
+  server.on(path, m, [h, fn, cls, path](AsyncWebServerRequest* r){
+    TRACE_SCOPE(path);
+    sdNetTask = xTaskGetCurrentTaskHandle();
+    if(!admit(r, cls)) return;
+    sliceStartUs = micros(); sliceBudgetUs = REQ_CLASSES[cls].sliceUs;
+    if(h){ ScopedTimer t(*h); fn(r); } else fn(r);
+    sliceBudgetUs = 0;
+  });
+}
+// A body arriving in several chunks is timed from its first chunk to its last,
+// so one POST is one sample. Only async_tcp touches the table; an entry left by
+// a client that went away mid-body is simply reused.
+struct BodyTiming { const AsyncWebServerRequest* req; uint32_t t0; };
+static BodyTiming bodyTimings[4];
+static uint8_t    bodyTimingNext = 0;
+static void routeBody(const char* path, WebRequestMethodComposite m, ArBodyHandlerFunction body, ReqClass cls = RC_STATUS){
+  LatencyHist* h = httpHist(path, methodName(m));
+  server.on(path, m, [](AsyncWebServerRequest*){}, nullptr,
+    [h, body, path, cls](AsyncWebServerRequest* r, uint8_t* d, size_t len, size_t index, size_t total){
+      TRACE_SCOPE(path);
+      sdNetTask = xTaskGetCurrentTaskHandle();
+      if(index == 0 ? !admit(r, cls) : !rcHeld(r)) return;
+      uint32_t t0 = micros();
+      bool last = index + len >= total;
+      if(h && index == 0 && !last){
+        bodyTimings[bodyTimingNext] = { r, t0 };
+        bodyTimingNext = (bodyTimingNext + 1) % 4;
+      }
+      sliceStartUs = t0; sliceBudgetUs = REQ_CLASSES[cls].sliceUs;
+      body(r, d, len, index, total);
+      sliceBudgetUs = 0;
+      if(!h || !last) return;
+      if(index == 0){ h->observe(micros() - t0); return; }
+      for(auto& b : bodyTimings) if(b.req == r){ h->observe(micros() - b.t0); b.req = nullptr; break; }
+    });
+}
+
 /* ===================== Setup / Loop ===================== */
 uint32_t lastPrint = 0;
 uint32_t lastStateSaveMs = 0;
+volatile uint32_t snapshotDueMs = 0;   // deferred save requested by a handler, 0 = none
+
+// Stop / resume / restart: the handler answers at once and loop() applies the
+// newest request, so the meter read for a new baseline and the journal append
+// stay on loop()'s side. Stop has already cut the relays in the handler.
+enum CtlCmd : uint8_t { CTL_NONE, CTL_STOP, CTL_RESUME, CTL_RESTART };
+static std::atomic<uint8_t> ctlPending{CTL_NONE};
+static void controlApply(){
+  uint8_t cmd = ctlPending.exchange(CTL_NONE);
+  if (cmd == CTL_NONE) return;
+  if (cmd == CTL_STOP) {
+    paused = true;
+    eventRecord(EV_STOP, 0, 0);
+  } else {
+    manualMask = 0;
+    if (cmd == CTL_RESTART || (firstResume && !baselineFromSnapshot)) restartCycle();
+    else firstResume = false;
+    paused = false;
+    lastStateSaveMs = millis();
+    eventRecord(cmd == CTL_RESTART ? EV_RESTART : EV_RESUME, 0, 0);
+  }
+  savePauseSnapshot();
+}
 
 void setup(){
   Serial.begin(115200); delay(100);
+  loopTaskHandle = xTaskGetCurrentTaskHandle();
+  metricsInit();
+  traceInit();
+  arenaInit();
+  storageInit();
+  otaBootCheck();   // may roll back to the previous slot
+  eventRecord(EV_BOOT, (uint8_t)esp_reset_reason(), 0);
+  sdReaderInit();
+  pqInit();
+  exportInit();
 
   // Mount LittleFS (fast)
   if(LittleFS.begin(true, "/littlefs", 10, "littlefs")){
     littlefsMounted = true;
     Serial.println("[LittleFS] mounted");
+    stateJournalInit();
   } else {
     littlefsMounted = false;
     Serial.println("[LittleFS] mount/format failed");
   }
+  uiBundleInit();   // static UI from the mapped partition, if flashed
 
   initGroupPins(); allGroups(false);
 
@@ -1126,54 +4872,50 @@ void setup(){
   startWiFi();
 
   // Minimal always-on routes (respond immediately)
-  server.on("/ping", HTTP_GET, [](AsyncWebServerRequest* r){
+  route("/ping", HTTP_GET, [](AsyncWebServerRequest* r){
     r->send(200, "application/json", systemReady ? "{\"ok\":true,\"ready\":true}" : "{\"ok\":true,\"ready\":false}");
   });
-  server.on("/login",HTTP_GET,[](AsyncWebServerRequest* r){
+  route("/login",HTTP_GET,[](AsyncWebServerRequest* r){
+    if(uiSend(r,"/login.html")) return;
     if(LittleFS.exists("/login.html")) r->send(LittleFS,"/login.html","text/html");
     else r->send(200,"text/html","<!doctype html><meta name=viewport content='width=device-width,initial-scale=1'><h3>SmartLoad</h3><p>Booting…</p><p><a href=\"/ping\">Check readiness</a></p>");
   });
 
   // Full routes
-  server.on("/",HTTP_GET,[](AsyncWebServerRequest* r){ r->redirect("/dashboard"); });
-  server.on("/dashboard",HTTP_GET,[](AsyncWebServerRequest* r){ if(hasAuth(r)) r->send(LittleFS,"/dashboard.html","text/html"); else r->redirect("/login"); });
-  server.on("/configuration",HTTP_GET,[](AsyncWebServerRequest* r){ if(hasAuth(r)) r->send(LittleFS,"/configuration.html","text/html"); else r->redirect("/login"); });
-  server.on("/logs",HTTP_GET,[](AsyncWebServerRequest* r){ if(hasAuth(r)) r->send(LittleFS,"/logs.html","text/html"); else r->redirect("/login"); });
+  route("/",HTTP_GET,[](AsyncWebServerRequest* r){ r->redirect("/dashboard"); });
+  route("/dashboard",HTTP_GET,[](AsyncWebServerRequest* r){ if(hasAuth(r)) sendPage(r,"/dashboard.html"); else r->redirect("/login"); });
+  route("/configuration",HTTP_GET,[](AsyncWebServerRequest* r){ if(hasAuth(r)) sendPage(r,"/configuration.html"); else r->redirect("/login"); });
+  route("/logs",HTTP_GET,[](AsyncWebServerRequest* r){ if(hasAuth(r)) sendPage(r,"/logs.html"); else r->redirect("/login"); });
 
-  // Static after specific
+  // Static after specific: bundle first, LittleFS for anything it lacks
+  server.addHandler(new UiBundleHandler());
   server.serveStatic("/",LittleFS,"/");
 
   // APIs
-  server.on("/api/status",HTTP_GET,handleStatus);
-  server.on("/api/stop",HTTP_POST,[](AsyncWebServerRequest* req){
+  route("/api/status",HTTP_GET,handleStatus);
+  route("/api/history/recent",HTTP_GET,handleHistoryRecent);
+  route("/api/mem",HTTP_GET,handleMem);
+  route("/metrics",HTTP_GET,handleMetrics);
+  route("/api/boot",HTTP_GET,handleBoot);
+  route("/api/stop",HTTP_POST,[](AsyncWebServerRequest* req){
     paused = true; manualMask = 0;
     currentStatus.p1=currentStatus.p2=currentStatus.p3=currentStatus.p4=false;
     allGroups(false);
     forceLogNext = true;
-    savePauseSnapshot();
+    ctlPending = CTL_STOP;   // loop() records and saves it
     req->send(200);
-  });
-  server.on("/api/resume",HTTP_POST,[](AsyncWebServerRequest* req){
-    manualMask = 0;
-    if(firstResume && !baselineFromSnapshot) {
-      restartCycle();
-    } else {
-      firstResume = false;
-    }
-    paused = false;
-    lastStateSaveMs = 0;
-    savePauseSnapshot();
+  }, RC_CONTROL);
+  route("/api/resume",HTTP_POST,[](AsyncWebServerRequest* req){
+    if(!controlReady){ req->send(503,"text/plain","Booting"); return; }
+    ctlPending = CTL_RESUME;
     req->send(200);
-  });
-  server.on("/api/restart",HTTP_POST,[](AsyncWebServerRequest* req){
-    manualMask = 0;
-    restartCycle();
-    paused = false;
-    lastStateSaveMs = 0;
-    savePauseSnapshot();
+  }, RC_CONTROL);
+  route("/api/restart",HTTP_POST,[](AsyncWebServerRequest* req){
+    if(!controlReady){ req->send(503,"text/plain","Booting"); return; }
+    ctlPending = CTL_RESTART;
     req->send(200);
-  });
-  server.on("/api/budget",HTTP_POST,[](AsyncWebServerRequest*req){
+  }, RC_CONTROL);
+  route("/api/budget",HTTP_POST,[](AsyncWebServerRequest*req){
     if(!req->hasParam("val")){ req->send(400,"text/plain","Missing val"); return; }
     float v=req->getParam("val")->value().toFloat();
     if(v<=0.0f||isnan(v)){ req->send(400,"text/plain","Invalid val"); return; }
@@ -1183,18 +4925,18 @@ void setup(){
       double usedFromPct = budgetKWh * (1.0 - (frozenPct/100.0));
       frozenUsed = usedFromPct;
       frozenRem  = max(0.0, budgetKWh - frozenUsed);
-      savePauseSnapshot();
+      snapshotDueMs = (millis() + CONFIG_SETTLE_MS) | 1;   // loop() saves once the slider settles
     }
-    persistConfig();
+    configChanged();
     req->send(200,"text/plain","OK");
-  });
-  server.on("/api/relays",HTTP_GET,[](AsyncWebServerRequest* req){
-    JsonDocument doc;
+  }, RC_CONTROL);
+  route("/api/relays",HTTP_GET,[](AsyncWebServerRequest* req){
+    ArenaLease lease(req);
+    JsonDocument doc(lease.alloc());
     doc["p1"]=currentStatus.p1; doc["p2"]=currentStatus.p2; doc["p3"]=currentStatus.p3; doc["p4"]=currentStatus.p4;
-    String out; serializeJson(doc,out);
-    req->send(200,"application/json",out);
+    sendJson(req, doc, lease.a);
   });
-  server.on("/api/relays/set",HTTP_POST,[](AsyncWebServerRequest* req){
+  route("/api/relays/set",HTTP_POST,[](AsyncWebServerRequest* req){
     if(!req->hasParam("prio") || !req->hasParam("on")){ req->send(400,"text/plain","Missing prio/on"); return; }
     int pr = req->getParam("prio")->value().toInt();
     bool on = req->getParam("on")->value()=="1";
@@ -1208,19 +4950,28 @@ void setup(){
     }
     manualMask |= (1u << (pr-1));
     req->send(200,"text/plain","OK");
-  });
-  server.on("/api/config",HTTP_GET,handleConfigGet);
-  server.on("/api/config", HTTP_POST, [](AsyncWebServerRequest* req){}, NULL, handleConfigBody);
-  server.on("/api/login",  HTTP_POST, [](AsyncWebServerRequest* req){}, NULL, handleLoginBody);
-  server.on("/api/logout", HTTP_POST, handleLogout);
-  server.on("/api/sd/csvs", HTTP_GET, handleCsvList);
-  server.on("/api/sd/csv",  HTTP_GET, handleCsvGet);
+  }, RC_CONTROL);
+  route("/api/config",HTTP_GET,handleConfigGet);
+  routeBody("/api/config", HTTP_POST, handleConfigBody, RC_CONTROL);
+  route("/api/config/import", HTTP_POST, handleConfigImport, RC_CONTROL);
+  routeBody("/api/login",  HTTP_POST, handleLoginBody);
+  route("/api/logout", HTTP_POST, handleLogout);
+  route("/api/sd/csvs", HTTP_GET, handleCsvList, RC_BULK);
+  route("/api/sd/csv",  HTTP_GET, handleCsvGet,  RC_BULK);
+  route("/api/sd/bench",HTTP_GET, handleSdBench, RC_BULK);
 
   // Logs APIs
-  server.on("/api/logs/query",      HTTP_GET, handleLogsQuery);
-  server.on("/api/logs/export",     HTTP_GET, handleLogsExport);     // CSV
-  server.on("/api/logs/export.xls", HTTP_GET, handleLogsExportXls);  // Excel
-  server.on("/api/logs/print",      HTTP_GET, handleLogsPrint);      // Print
+  route("/api/logs/query",      HTTP_GET, handleLogsQuery,     RC_BULK);
+  route("/api/logs/export",     HTTP_GET, handleLogsExport,    RC_BULK);  // CSV
+  route("/api/logs/export.xls", HTTP_GET, handleLogsExportXls, RC_BULK);  // Excel
+  route("/api/logs/print",      HTTP_GET, handleLogsPrint,     RC_BULK);  // Print
+  route("/api/events/summary",  HTTP_GET, handleEventsSummary, RC_BULK);
+  route("/api/mqtt",             HTTP_GET, handleMqttStats);
+  route("/api/replicate",       HTTP_GET, handleReplicate,     RC_BULK);
+  route("/api/pq",              HTTP_GET, handlePqQuery,       RC_BULK);
+  route("/api/ota",             HTTP_GET, handleOtaStatus);
+  route("/api/trace",           HTTP_GET, handleTrace,         RC_BULK);
+  routeBody("/api/ota",         HTTP_POST, handleOtaBody,      RC_BULK);
 
   // Always send *something* quickly
   server.onNotFound([](AsyncWebServerRequest* r){
@@ -1231,18 +4982,27 @@ void setup(){
   Serial.println("HTTP server started.");
 
   // --- Kick off the slow stuff in background (core 1 is usually WiFi/Net) ---
-  xTaskCreatePinnedToCore(slowInitTask, "slowInit", 8192, nullptr, 1, nullptr, 1);
+  xTaskCreatePinnedToCore(slowInitTask, "slowInit", 4096, nullptr, 1, nullptr, 1);
+  xTaskCreatePinnedToCore(storageTask, "storage", 3072, nullptr, 1, nullptr, 0);
+  xTaskCreatePinnedToCore(archiveTask, "archive", 4096, nullptr, 1, nullptr, 0);
 
   manualMask = 0;
   forceLogNext = true;
 }
 
 void loop() {
-  dnsServer.processNextRequest();   // keep captive-portal DNS responsive
-
+  controlApply();
   currentStatus = computeStatus();
+  if (paused && controlReady && millis() - meterPolledMs >= METER_PAUSED_POLL_MS) virtualTotalKWh();   // keep V/A/W live
   enforceRelays(currentStatus);
-  appendLogMaybe();
+  eventWatch();
+  if (systemReady) appendLogMaybe();  // SD + restored state first
+  if (systemReady) eventFlush();
+  if (systemReady) pqSample();
+  if (controlReady) mqttTick();
+  if (controlReady) rtcCheckpoint();  // not before restore has had its chance
+  if (systemReady) clockMaintain();
+  otaTick();
 
   if (millis() - lastPrint >= 1000) {
     const double virtE = currentStatus.usedKWh + energyBaseline;
@@ -1253,12 +5013,17 @@ void loop() {
       virtE, energyBaseline, lastGoodTotal, (int)systemReady
     );
     lastPrint = millis();
+    memSample();
   }
 
-  if (!paused && millis() - lastStateSaveMs > 60000UL) {
+  if (!paused && millis() - lastStateSaveMs > STATE_CHECKPOINT_MS) {
     savePauseSnapshot();
     lastStateSaveMs = millis();
   }
+  if (snapshotDueMs && (int32_t)(millis() - snapshotDueMs) >= 0) {
+    snapshotDueMs = 0;
+    savePauseSnapshot();
+  }
 
   delay(50);  // snappier than 200ms so DNS + web stay responsive
 }
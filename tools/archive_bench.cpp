@@ -0,0 +1,143 @@
+// Host benchmark for the daily archive codec: encodes rows into blocks with
+// ArchiveBlockWriter and decodes them with archiveDecodeRow (src/log_format.h,
+// the same code the firmware runs), CRC32 per block included as on the card,
+// and prints rows/s, MB/s of equivalent CSV, and the compression ratio.
+// Without a file argument it uses --rows synthetic rows at one per second;
+// with one it reads an hourly CSV ("timestamp,budget,remaining,used").
+//
+// Host numbers rank codec changes by CPU cost only; on target,
+// smartload_archive_decode_bytes_total / _seconds_total give the real rate.
+//
+// Build:  g++ -std=c++17 -O2 -o archive_bench tools/archive_bench.cpp
+// Run:    archive_bench [--rows N] [--repeat R] [file.csv]
+#include "../src/log_format.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+static uint32_t crc32(const void* data, size_t len){
+  const uint8_t* p = (const uint8_t*)data;
+  uint32_t crc = ~0u;
+  while(len--){
+    crc ^= *p++;
+    for(int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+  }
+  return ~crc;
+}
+
+static double seconds(std::chrono::steady_clock::time_point t0){
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+struct Block { size_t off; uint16_t len, rows; uint32_t crc; };
+
+static size_t encodeAll(const std::vector<ArchiveRow>& rows, std::vector<uint8_t>& out, std::vector<Block>& blocks){
+  static ArchiveBlockWriter w;
+  out.clear(); blocks.clear(); w.reset();
+  auto flush = [&]{
+    blocks.push_back({ out.size(), (uint16_t)w.len, w.rows, crc32(w.buf, w.len) });
+    out.insert(out.end(), w.buf, w.buf + w.len);
+    w.reset();
+  };
+  for(const ArchiveRow& r : rows){
+    w.add(r);
+    if(w.full()) flush();
+  }
+  if(w.rows) flush();
+  return out.size();
+}
+
+static size_t decodeAll(const std::vector<uint8_t>& in, const std::vector<Block>& blocks, int64_t& sum){
+  size_t n = 0;
+  for(const Block& b : blocks){
+    const uint8_t* p = in.data() + b.off;
+    const uint8_t* end = p + b.len;
+    if(crc32(p, b.len) != b.crc) return 0;
+    ArchiveRow prev{0, 0, 0, 0};
+    for(uint16_t k = 0; k < b.rows && (p = archiveDecodeRow(p, end, prev)); k++, n++) sum += prev.used;
+  }
+  return n;
+}
+
+int main(int argc, char** argv){
+  long count = 86400;
+  int repeat = 20;
+  const char* path = nullptr;
+  for(int i = 1; i < argc; i++){
+    if(!strcmp(argv[i], "--rows") && i + 1 < argc) count = atol(argv[++i]);
+    else if(!strcmp(argv[i], "--repeat") && i + 1 < argc) repeat = atoi(argv[++i]);
+    else if(argv[i][0] == '-'){ fprintf(stderr, "usage: %s [--rows N] [--repeat R] [file.csv]\n", argv[0]); return 2; }
+    else path = argv[i];
+  }
+
+  std::vector<ArchiveRow> rows;
+  size_t csvBytes = 0;
+  if(path){
+    FILE* f = fopen(path, "r");
+    if(!f){ perror(path); return 1; }
+    char line[256];
+    while(fgets(line, sizeof(line), f)){
+      struct tm tm = {};
+      double b, r, u;
+      if(sscanf(line, "%d-%d-%d %d:%d:%d,%lf,%lf,%lf", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &b, &r, &u) != 9) continue;
+      tm.tm_year -= 1900; tm.tm_mon -= 1;
+      rows.push_back({ (uint32_t)timegm(&tm), llround(b * 1e6), llround(r * 1e6), llround(u * 1e6) });
+      csvBytes += strlen(line);
+    }
+    fclose(f);
+  } else {
+    char line[96];
+    for(long i = 0; i < count; i++){
+      double used = i * 1.2e-5 + (i % 7) * 1e-6;   // a slow ramp with meter jitter
+      ArchiveRow r{ (uint32_t)(1735689600 + i), 4000000, llround((4.0 - used) * 1e6), llround(used * 1e6) };
+      rows.push_back(r);
+      csvBytes += snprintf(line, sizeof(line), "2025-01-01 00:00:00,%.6f,%.6f,%.6f\r\n", 4.0, 4.0 - used, used);
+    }
+  }
+  if(rows.empty()){ fprintf(stderr, "no rows\n"); return 1; }
+
+  std::vector<uint8_t> enc;
+  std::vector<Block> blocks;
+  double bestEnc = 1e9, bestDec = 1e9;
+  size_t encBytes = 0, decRows = 0;
+  int64_t sum = 0;
+  for(int r = 0; r < repeat; r++){
+    auto t0 = std::chrono::steady_clock::now();
+    encBytes = encodeAll(rows, enc, blocks);
+    double s = seconds(t0);
+    if(s < bestEnc) bestEnc = s;
+    t0 = std::chrono::steady_clock::now();
+    decRows = decodeAll(enc, blocks, sum);
+    s = seconds(t0);
+    if(s < bestDec) bestDec = s;
+  }
+
+  // the round trip must give back every row exactly
+  bool ok = decRows == rows.size();
+  size_t i = 0;
+  for(const Block& b : blocks){
+    const uint8_t* p = enc.data() + b.off;
+    ArchiveRow prev{0, 0, 0, 0};
+    for(uint16_t k = 0; ok && k < b.rows; k++, i++){
+      p = archiveDecodeRow(p, enc.data() + b.off + b.len, prev);
+      const ArchiveRow& o = rows[i];
+      ok = p && prev.epoch == o.epoch && prev.budget == o.budget && prev.rem == o.rem && prev.used == o.used;
+    }
+  }
+
+  double n = (double)rows.size(), mb = csvBytes / 1e6;
+  printf("%s: %zu rows, %.2f MB as CSV, %zu blocks, best of %d\n",
+         path ? path : "synthetic", rows.size(), mb, blocks.size(), repeat);
+  printf("  archive   %8zu B  %5.2f B/row  (CSV / %.1f)\n", encBytes, encBytes / n, csvBytes / (double)encBytes);
+  printf("  encode  %10.2f Mrows/s  %8.1f MB/s of CSV\n", n / bestEnc / 1e6, mb / bestEnc);
+  printf("  decode  %10.2f Mrows/s  %8.1f MB/s of CSV  %8.1f MB/s of archive\n",
+         n / bestDec / 1e6, mb / bestDec, encBytes / 1e6 / bestDec);
+  printf("  round trip %s\n", ok ? "ok" : "MISMATCH");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,251 @@
+// Host-side log collector: polls one or more controllers' /api/replicate and
+// appends the rows to a local column store, one directory per controller:
+//
+//   <store>/<name>/epoch.u32    local wall time, as in the device CSV
+//   <store>/<name>/budget.i64   kWh * 1e6, little endian
+//   <store>/<name>/remaining.i64
+//   <store>/<name>/used.i64
+//   <store>/<name>/state        "<rows> <cursor>", rewritten after each append
+//
+// Columns are truncated back to <rows> at start-up, so a crash between the
+// append and the state write never leaves half a row or a duplicate.
+//
+// Build:  g++ -std=c++17 -O2 -o collector tools/collector.cpp
+// Run:    collector -d ./store [-i 10] [-u admin -p admin] name=host[:port] ...
+#include "../src/log_format.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static uint32_t crc32(const void* data, size_t len){
+  const uint8_t* p = (const uint8_t*)data;
+  uint32_t crc = ~0u;
+  while(len--){
+    crc ^= *p++;
+    for(int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+  }
+  return ~crc;
+}
+
+/* ===================== Minimal HTTP/1.1 client ===================== */
+struct HttpResponse { int status = 0; std::string cookie, body; };
+
+static bool httpRequest(const std::string& host, const std::string& port, const std::string& method,
+                        const std::string& path, const std::string& cookie, const std::string& body,
+                        HttpResponse& out){
+  addrinfo hints{}, *ai = nullptr;
+  hints.ai_family = AF_INET; hints.ai_socktype = SOCK_STREAM;
+  if(getaddrinfo(host.c_str(), port.c_str(), &hints, &ai) != 0 || !ai) return false;
+  int s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  timeval tv = { 10, 0 };
+  if(s >= 0){ setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)); setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)); }
+  bool ok = s >= 0 && connect(s, ai->ai_addr, ai->ai_addrlen) == 0;
+  freeaddrinfo(ai);
+  if(!ok){ if(s >= 0) close(s); return false; }
+
+  std::string req = method + " " + path + " HTTP/1.1\r\nHost: " + host + "\r\nConnection: close\r\n";
+  if(!cookie.empty()) req += "Cookie: " + cookie + "\r\n";
+  if(!body.empty()) req += "Content-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) + "\r\n";
+  req += "\r\n" + body;
+  for(size_t sent = 0; sent < req.size(); ){
+    ssize_t n = send(s, req.data() + sent, req.size() - sent, 0);
+    if(n <= 0){ close(s); return false; }
+    sent += (size_t)n;
+  }
+  std::string raw;
+  char buf[4096];
+  for(ssize_t n; (n = recv(s, buf, sizeof(buf), 0)) > 0; ) raw.append(buf, (size_t)n);
+  close(s);
+
+  size_t he = raw.find("\r\n\r\n");
+  if(he == std::string::npos || sscanf(raw.c_str(), "HTTP/1.%*d %d", &out.status) != 1) return false;
+  std::string head = raw.substr(0, he), rest = raw.substr(he + 4);
+  bool chunked = false;
+  for(size_t a = head.find("\r\n"); a != std::string::npos; ){
+    size_t b = head.find("\r\n", a + 2);
+    std::string line = head.substr(a + 2, b == std::string::npos ? std::string::npos : b - a - 2);
+    if(!strncasecmp(line.c_str(), "Set-Cookie: SID=", 16)) out.cookie = line.substr(12, line.find(';') - 12);
+    if(!strncasecmp(line.c_str(), "Transfer-Encoding: chunked", 26)) chunked = true;
+    a = b;
+  }
+  if(!chunked){ out.body = rest; return true; }
+  out.body.clear();
+  for(size_t p = 0; p < rest.size(); ){
+    size_t nl = rest.find("\r\n", p);
+    if(nl == std::string::npos) return false;
+    size_t len = strtoul(rest.c_str() + p, nullptr, 16);
+    if(!len) return true;
+    if(nl + 2 + len > rest.size()) return false;
+    out.body.append(rest, nl + 2, len);
+    p = nl + 2 + len + 2;
+  }
+  return false;
+}
+
+/* ===================== Column store ===================== */
+struct Controller {
+  std::string name, host, port, dir, cookie;
+  std::string cursor = "0.0.0.0.0";
+  uint64_t rows = 0;
+};
+
+static const char* COLS[4]       = { "epoch.u32", "budget.i64", "remaining.i64", "used.i64" };
+static const size_t COL_WIDTH[4] = { 4, 8, 8, 8 };
+
+static bool storeOpen(Controller& c, const std::string& root){
+  c.dir = root + "/" + c.name;
+  mkdir(root.c_str(), 0755);
+  mkdir(c.dir.c_str(), 0755);
+  if(FILE* f = fopen((c.dir + "/state").c_str(), "r")){
+    char cur[96];
+    unsigned long long rows;
+    if(fscanf(f, "%llu %95s", &rows, cur) == 2){ c.rows = rows; c.cursor = cur; }
+    fclose(f);
+  }
+  for(int i = 0; i < 4; i++){
+    std::string p = c.dir + "/" + COLS[i];
+    if(FILE* f = fopen(p.c_str(), "ab")) fclose(f);
+    if(truncate(p.c_str(), (off_t)(c.rows * COL_WIDTH[i])) != 0){ perror(p.c_str()); return false; }
+  }
+  return true;
+}
+
+static bool storeAppend(Controller& c, const std::vector<ArchiveRow>& rows, const std::string& cursor){
+  if(!rows.empty()){
+    for(int i = 0; i < 4; i++){
+      FILE* f = fopen((c.dir + "/" + COLS[i]).c_str(), "ab");
+      if(!f) return false;
+      for(const ArchiveRow& r : rows){
+        if(i == 0) fwrite(&r.epoch, 4, 1, f);
+        else fwrite(i == 1 ? &r.budget : i == 2 ? &r.rem : &r.used, 8, 1, f);
+      }
+      bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+      fclose(f);
+      if(!ok) return false;
+    }
+  }
+  std::string tmp = c.dir + "/state.tmp";
+  FILE* f = fopen(tmp.c_str(), "w");
+  if(!f) return false;
+  fprintf(f, "%llu %s\n", (unsigned long long)(c.rows + rows.size()), cursor.c_str());
+  bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+  fclose(f);
+  if(!ok || rename(tmp.c_str(), (c.dir + "/state").c_str()) != 0) return false;
+  c.rows += rows.size();
+  c.cursor = cursor;
+  return true;
+}
+
+/* ===================== Replication ===================== */
+// Parses one /api/replicate body. Returns false on any framing or CRC error,
+// in which case nothing from the batch is kept.
+static bool parseBatch(const std::string& body, std::vector<ArchiveRow>& rows, ReplCursor& next){
+  const uint8_t* p = (const uint8_t*)body.data();
+  const uint8_t* end = p + body.size();
+  while(p + sizeof(ReplFrame) <= end){
+    ReplFrame f;
+    memcpy(&f, p, sizeof(f));
+    p += sizeof(f);
+    if(f.magic != REPL_MAGIC || p + f.len > end || crc32(p, f.len) != f.crc) return false;
+    if(!f.rows){
+      if(f.len != sizeof(ReplCursor)) return false;
+      memcpy(&next, p, sizeof(next));
+      return p + f.len == end;
+    }
+    ArchiveRow prev{0, 0, 0, 0};
+    const uint8_t* q = p;
+    for(uint16_t i = 0; i < f.rows; i++){
+      if(!(q = archiveDecodeRow(q, p + f.len, prev))) return false;
+      rows.push_back(prev);
+    }
+    p += f.len;
+  }
+  return false;   // no cursor frame: truncated
+}
+
+static bool login(Controller& c, const std::string& user, const std::string& pass){
+  HttpResponse r;
+  std::string body = "{\"username\":\"" + user + "\",\"password\":\"" + pass + "\"}";
+  if(!httpRequest(c.host, c.port, "POST", "/api/login", "", body, r) || r.status != 200 || r.cookie.empty()) return false;
+  c.cookie = r.cookie;
+  return true;
+}
+
+// Pulls batches until the controller has nothing more ready.
+static void syncOnce(Controller& c, const std::string& user, const std::string& pass){
+  for(int batch = 0; batch < 64; batch++){
+    if(c.cookie.empty() && !login(c, user, pass)){ fprintf(stderr, "[%s] login failed\n", c.name.c_str()); return; }
+    HttpResponse r;
+    if(!httpRequest(c.host, c.port, "GET", "/api/replicate?cursor=" + c.cursor, c.cookie, "", r)){
+      fprintf(stderr, "[%s] unreachable\n", c.name.c_str());
+      return;
+    }
+    if(r.status == 401){ c.cookie.clear(); continue; }
+    if(r.status == 503) return;   // busy; next poll
+    if(r.status != 200){ fprintf(stderr, "[%s] HTTP %d\n", c.name.c_str(), r.status); return; }
+
+    std::vector<ArchiveRow> rows;
+    ReplCursor next;
+    if(!parseBatch(r.body, rows, next)){ fprintf(stderr, "[%s] corrupt batch, retrying\n", c.name.c_str()); return; }
+    char cur[96];
+    snprintf(cur, sizeof(cur), "%x.%x.%x.%x.%x", next.key, next.pos, next.epoch, (unsigned)next.dup, (unsigned)next.archive);
+    if(!storeAppend(c, rows, cur)){ perror(c.dir.c_str()); return; }
+    if(!rows.empty())
+      printf("[%s] +%zu rows (%zu bytes, %.2f B/row), total %llu\n", c.name.c_str(), rows.size(), r.body.size(),
+             (double)r.body.size() / rows.size(), (unsigned long long)c.rows);
+    if(!next.more) return;
+  }
+}
+
+static volatile sig_atomic_t stopping = 0;
+
+int main(int argc, char** argv){
+  std::string store, user = "admin", pass = "admin";
+  int interval = 10;
+  bool once = false;
+  std::vector<Controller> ctl;
+  for(int i = 1; i < argc; i++){
+    std::string a = argv[i];
+    if(a == "-d" && i + 1 < argc) store = argv[++i];
+    else if(a == "-i" && i + 1 < argc) interval = atoi(argv[++i]);
+    else if(a == "-u" && i + 1 < argc) user = argv[++i];
+    else if(a == "-p" && i + 1 < argc) pass = argv[++i];
+    else if(a == "-1") once = true;
+    else if(a.find('=') != std::string::npos){
+      Controller c;
+      c.name = a.substr(0, a.find('='));
+      std::string hp = a.substr(a.find('=') + 1);
+      size_t colon = hp.find(':');
+      c.host = hp.substr(0, colon);
+      c.port = colon == std::string::npos ? "80" : hp.substr(colon + 1);
+      ctl.push_back(c);
+    } else { store.clear(); break; }
+  }
+  if(store.empty() || ctl.empty()){
+    fprintf(stderr, "usage: %s -d STORE [-i SECONDS] [-u USER] [-p PASS] [-1] name=host[:port] ...\n", argv[0]);
+    return 2;
+  }
+  for(Controller& c : ctl) if(!storeOpen(c, store)) return 1;
+  signal(SIGINT, [](int){ stopping = 1; });
+  signal(SIGTERM, [](int){ stopping = 1; });
+  signal(SIGPIPE, SIG_IGN);
+
+  while(!stopping){
+    for(Controller& c : ctl) syncOnce(c, user, pass);
+    if(once) break;
+    for(int s = 0; s < interval && !stopping; s++) sleep(1);
+  }
+  return 0;
+}
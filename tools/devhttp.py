@@ -0,0 +1,64 @@
+"""Minimal client for the controller's HTTP API (stdlib only), shared by the
+host-side soak, load-test and benchmark scripts in tools/.
+
+    dev = Device("192.168.4.1", "admin", "admin")
+    status, headers, body = dev.request("GET", "/api/mem")
+"""
+import http.client
+import json
+
+
+class Device:
+    def __init__(self, host, user="admin", password="admin", timeout=10.0):
+        host, _, port = host.partition(":")
+        self.host, self.port = host, int(port or 80)
+        self.user, self.password, self.timeout = user, password, timeout
+        self.cookie = None
+
+    def login(self):
+        body = json.dumps({"username": self.user, "password": self.password})
+        status, headers, _ = self._send("POST", "/api/login", body, "application/json")
+        sid = [v for k, v in headers if k.lower() == "set-cookie" and v.startswith("SID=")]
+        if status != 200 or not sid:
+            raise RuntimeError("login failed: HTTP %d" % status)
+        self.cookie = sid[0].split(";")[0]
+
+    def request(self, method, path, body=None, ctype=None, sink=None):
+        """(status, headers, body). Logs in on first use and again on a 401.
+        With `sink`, the body is handed over in pieces instead of kept, and the
+        returned body is its length in bytes."""
+        if self.cookie is None:
+            self.login()
+        status, headers, data = self._send(method, path, body, ctype, sink)
+        if status == 401:
+            self.login()
+            status, headers, data = self._send(method, path, body, ctype, sink)
+        return status, headers, data
+
+    def get_json(self, path):
+        status, _, body = self.request("GET", path)
+        if status != 200:
+            raise RuntimeError("%s: HTTP %d" % (path, status))
+        return json.loads(body)
+
+    def _send(self, method, path, body, ctype, sink=None):
+        conn = http.client.HTTPConnection(self.host, self.port, timeout=self.timeout)
+        try:
+            hdrs = {"Connection": "close"}
+            if self.cookie:
+                hdrs["Cookie"] = self.cookie
+            if body is not None:
+                hdrs["Content-Type"] = ctype or "application/octet-stream"
+            conn.request(method, path, body=body, headers=hdrs)
+            r = conn.getresponse()
+            if sink is None:
+                return r.status, r.getheaders(), r.read()
+            n = 0
+            while True:
+                piece = r.read(4096)
+                if not piece:
+                    return r.status, r.getheaders(), n
+                sink(piece)
+                n += len(piece)
+        finally:
+            conn.close()
@@ -0,0 +1,127 @@
+"""Control-path latency under bulk load, against a running controller.
+
+Phase 1 (idle): POST /api/relays/set at --rate for --seconds.
+Phase 2 (loaded): the same, while --exports clients pull /api/logs/export
+back to back.
+
+Each call re-sets a priority group to the state /api/relays reported at the
+start, so no relay moves. It does mark the groups as manually held, exactly
+as the dashboard buttons do, so run it with the controls enabled and expect
+to clear the override afterwards.
+
+Prints p50/p95/p99/max of /api/relays/set per phase, plus the export
+throughput from the smartload_export_* counters in /metrics. Exits 1 when
+the loaded p99 exceeds --max-p99-ms.
+
+    python3 tools/loadtest.py 192.168.4.1 --seconds 60 --from 2025-01-01T00:00:00
+"""
+import argparse
+import re
+import sys
+import threading
+import time
+import urllib.parse
+
+from devhttp import Device
+
+
+def pct(xs, p):
+    xs = sorted(xs)
+    return xs[min(len(xs) - 1, int(round(p / 100.0 * (len(xs) - 1))))] if xs else float("nan")
+
+
+def metric(text, name):
+    m = re.search(r"^%s (\S+)$" % re.escape(name), text, re.M)
+    return float(m.group(1)) if m else 0.0
+
+
+def control_phase(dev, seconds, rate, state):
+    lat, errors, i = [], 0, 0
+    end = time.monotonic() + seconds
+    while time.monotonic() < end:
+        t0 = time.monotonic()
+        prio = 1 + i % 4
+        i += 1
+        try:
+            status, _, _ = dev.request("POST", "/api/relays/set?prio=%d&on=%d" % (prio, state[prio]))
+            if status == 200:
+                lat.append((time.monotonic() - t0) * 1000.0)
+            else:
+                errors += 1
+        except OSError:
+            errors += 1
+        time.sleep(max(0.0, 1.0 / rate - (time.monotonic() - t0)))
+    return lat, errors
+
+
+def exporter(dev, path, stop, stats):
+    while not stop.is_set():
+        t0 = time.monotonic()
+        try:
+            status, _, n = dev.request("GET", path, sink=lambda _: None)
+        except OSError:
+            stats["errors"] += 1
+            continue
+        if status == 200:
+            stats["exports"] += 1
+            stats["bytes"] += n
+            stats["seconds"] += time.monotonic() - t0
+        else:
+            time.sleep(1.0)   # 503: another export is running / bus busy
+
+
+def report(name, lat, errors):
+    print("  %-7s n=%-5d err=%-3d p50 %7.1f  p95 %7.1f  p99 %7.1f  max %7.1f ms"
+          % (name, len(lat), errors, pct(lat, 50), pct(lat, 95), pct(lat, 99), max(lat) if lat else float("nan")))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    ap.add_argument("host")
+    ap.add_argument("-u", "--user", default="admin")
+    ap.add_argument("-p", "--password", default="admin")
+    ap.add_argument("--seconds", type=float, default=30.0, help="per phase")
+    ap.add_argument("--rate", type=float, default=10.0, help="relays/set calls per second")
+    ap.add_argument("--exports", type=int, default=1, help="parallel export clients")
+    ap.add_argument("--from", dest="frm", default="", help="export range start (local time)")
+    ap.add_argument("--to", default="", help="export range end (local time)")
+    ap.add_argument("--max-p99-ms", type=float, default=250.0)
+    a = ap.parse_args()
+
+    dev = Device(a.host, a.user, a.password)
+    relays = dev.get_json("/api/relays")
+    state = {n: 1 if relays.get("p%d" % n) else 0 for n in range(1, 5)}
+    q = {k: v for k, v in (("from", a.frm), ("to", a.to)) if v}
+    path = "/api/logs/export" + ("?" + urllib.parse.urlencode(q) if q else "")
+
+    idle, idle_err = control_phase(dev, a.seconds, a.rate, state)
+
+    _, _, before = dev.request("GET", "/metrics")
+    stop, stats = threading.Event(), {"exports": 0, "bytes": 0, "seconds": 0.0, "errors": 0}
+    workers = [threading.Thread(target=exporter, args=(Device(a.host, a.user, a.password), path, stop, stats))
+               for _ in range(a.exports)]
+    for w in workers:
+        w.start()
+    loaded, loaded_err = control_phase(dev, a.seconds, a.rate, state)
+    stop.set()
+    for w in workers:
+        w.join()
+    _, _, after = dev.request("GET", "/metrics")
+
+    print("/api/relays/set latency (%s)" % a.host)
+    report("idle", idle, idle_err)
+    report("loaded", loaded, loaded_err)
+    before, after = before.decode(), after.decode()
+    rows = metric(after, "smartload_export_rows_total") - metric(before, "smartload_export_rows_total")
+    secs = metric(after, "smartload_export_seconds_total") - metric(before, "smartload_export_seconds_total")
+    print("exports: %d done, %d errors, %.1f KB/s at the client, %s rows/s on the device"
+          % (stats["exports"], stats["errors"],
+             stats["bytes"] / 1024.0 / stats["seconds"] if stats["seconds"] else 0.0,
+             "%.0f" % (rows / secs) if secs else "n/a"))
+    ok = bool(loaded) and pct(loaded, 99) <= a.max_p99_ms
+    print("loadtest: %s" % ("ok" if ok else "p99 over %.0f ms" % a.max_p99_ms))
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,199 @@
+"""Minimal MQTT 3.1.1 broker for checking a controller's publisher.
+
+Accepts the controller's connection, answers CONNECT, PUBLISH (QoS 1) and
+PINGREQ, and every --interval seconds prints msgs/s and bytes/s per topic
+plus connects, PUBACKs sent and malformed packets. Nothing is forwarded.
+
+With --device it points the controller at this broker via POST /api/config
+(setting the port alone also has to restart the client), puts the old broker
+back at exit, and prints the controller's /api/mqtt counters next to its own.
+
+Fault modes, to watch the client recover:
+  --no-connack     never answer CONNECT; the client should give up after its
+                   CONNACK timeout and reconnect every few seconds
+  --drop-every S   close the connection every S seconds
+
+    python3 tools/mqtt_bench.py --port 1884 --device 192.168.4.1 --seconds 120
+
+Exit status 1 when the rate stays below --min-rate or a packet is malformed.
+"""
+import argparse
+import json
+import socket
+import socketserver
+import sys
+import threading
+import time
+
+from devhttp import Device
+
+stats_lock = threading.Lock()
+stats = {"connects": 0, "pubacks": 0, "bad": 0, "topics": {}}
+connect_times = []
+
+
+def count(topic, nbytes):
+    with stats_lock:
+        t = stats["topics"].setdefault(topic, [0, 0])
+        t[0] += 1
+        t[1] += nbytes
+
+
+def read_packet(f):
+    """(type byte, body) or None at EOF."""
+    head = f.read(1)
+    if not head:
+        return None
+    n, shift = 0, 0
+    while True:
+        b = f.read(1)
+        if not b:
+            return None
+        n |= (b[0] & 0x7F) << shift
+        shift += 7
+        if not b[0] & 0x80:
+            break
+        if shift > 21:
+            raise ValueError("remaining length")
+    body = f.read(n)
+    if len(body) != n:
+        return None
+    return head[0], body
+
+
+class Broker(socketserver.StreamRequestHandler):
+    no_connack = False
+    drop_every = 0.0
+
+    def handle(self):
+        self.request.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        opened = time.monotonic()
+        with stats_lock:
+            connect_times.append(time.time())
+        while True:
+            if self.drop_every:
+                self.request.settimeout(max(0.01, self.drop_every - (time.monotonic() - opened)))
+            try:
+                pkt = read_packet(self.rfile)
+            except socket.timeout:
+                return
+            except (ValueError, OSError):
+                with stats_lock:
+                    stats["bad"] += 1
+                return
+            if pkt is None:
+                return
+            kind, body = pkt[0] >> 4, pkt[1]
+            if kind == 1:   # CONNECT
+                if body[:6] != b"\x00\x04MQTT" or body[6] != 4:
+                    with stats_lock:
+                        stats["bad"] += 1
+                    return
+                with stats_lock:
+                    stats["connects"] += 1
+                if not self.no_connack:
+                    self.wfile.write(b"\x20\x02\x00\x00")
+            elif kind == 3:   # PUBLISH
+                qos = (pkt[0] >> 1) & 3
+                tlen = body[0] << 8 | body[1]
+                topic = body[2:2 + tlen].decode("utf-8", "replace")
+                p = 2 + tlen
+                if qos:
+                    self.wfile.write(b"\x40\x02" + body[p:p + 2])
+                    p += 2
+                    with stats_lock:
+                        stats["pubacks"] += 1
+                try:
+                    json.loads(body[p:])
+                except ValueError:
+                    with stats_lock:
+                        stats["bad"] += 1
+                count(topic.rsplit("/", 1)[-1], len(body) + 2)
+            elif kind == 12:   # PINGREQ
+                self.wfile.write(b"\xd0\x00")
+            elif kind == 14:   # DISCONNECT
+                return
+
+
+def local_ip_towards(host):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    try:
+        s.connect((host.partition(":")[0], 80))
+        return s.getsockname()[0]
+    finally:
+        s.close()
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    ap.add_argument("--port", type=int, default=1883)
+    ap.add_argument("--seconds", type=float, default=60.0)
+    ap.add_argument("--interval", type=float, default=10.0)
+    ap.add_argument("--no-connack", action="store_true")
+    ap.add_argument("--drop-every", type=float, default=0.0)
+    ap.add_argument("--min-rate", type=float, default=0.0, help="required msgs/s over the run")
+    ap.add_argument("--device", help="controller to point at this broker")
+    ap.add_argument("-u", "--user", default="admin")
+    ap.add_argument("-p", "--password", default="admin")
+    a = ap.parse_args()
+
+    Broker.no_connack, Broker.drop_every = a.no_connack, a.drop_every
+    socketserver.ThreadingTCPServer.allow_reuse_address = True
+    srv = socketserver.ThreadingTCPServer(("0.0.0.0", a.port), Broker)
+    srv.daemon_threads = True
+    threading.Thread(target=srv.serve_forever, daemon=True).start()
+
+    dev, old = None, None
+    if a.device:
+        dev = Device(a.device, a.user, a.password)
+        cfg = dev.get_json("/api/config")
+        old = {"mqtt_host": cfg.get("mqtt_host", ""), "mqtt_port": cfg.get("mqtt_port", 1883)}
+        mine = {"mqtt_host": local_ip_towards(a.device), "mqtt_port": a.port}
+        status, _, _ = dev.request("POST", "/api/config", json.dumps(mine), "application/json")
+        if status != 200:
+            sys.exit("POST /api/config: HTTP %d" % status)
+        print("device -> %(mqtt_host)s:%(mqtt_port)d" % mine)
+
+    start = time.monotonic()
+    last, prev = start, {}
+    total = 0
+    try:
+        while time.monotonic() - start < a.seconds:
+            time.sleep(min(a.interval, max(0.0, a.seconds - (time.monotonic() - start))))
+            now = time.monotonic()
+            with stats_lock:
+                snap = {k: list(v) for k, v in stats["topics"].items()}
+                line = "connects %(connects)d  pubacks %(pubacks)d  bad %(bad)d" % stats
+            parts = []
+            for topic, (n, b) in sorted(snap.items()):
+                pn, pb = prev.get(topic, (0, 0))
+                parts.append("%s %.2f msg/s %.0f B/s" % (topic, (n - pn) / (now - last), (b - pb) / (now - last)))
+            print("%6.0fs  %s  %s" % (now - start, line, "  ".join(parts) or "no messages"), flush=True)
+            prev, last = snap, now
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if dev:
+            dev.request("POST", "/api/config", json.dumps(old), "application/json")
+
+    elapsed = time.monotonic() - start
+    with stats_lock:
+        total = sum(n for n, _ in stats["topics"].values())
+        bad = stats["bad"]
+        gaps = [b - a_ for a_, b in zip(connect_times, connect_times[1:])]
+    rate = total / elapsed if elapsed else 0.0
+    print("total %d messages in %.0f s: %.2f msg/s" % (total, elapsed, rate))
+    if gaps:
+        print("reconnects %d, interval min %.1f s, max %.1f s" % (len(gaps), min(gaps), max(gaps)))
+    if dev:
+        try:
+            m = dev.get_json("/api/mqtt")
+            print("device: published %s dropped %s connects %s msgs_per_s %.2f" %
+                  (m.get("published"), m.get("dropped"), m.get("connects"), m.get("msgs_per_s", 0.0)))
+        except (OSError, RuntimeError) as e:
+            print("device: /api/mqtt failed: %s" % e)
+    sys.exit(1 if bad or rate < a.min_rate else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,93 @@
+"""Packs data/ into the read-only "ui" flash partition the firmware maps at boot.
+
+Layout (little endian, matches the UI bundle section of src/main.cpp):
+  header  16 B : magic "SLU1", count u16, version u16, size u32, crc32 u32
+                 (crc over everything after the header)
+  entries 64 B : path[48] (NUL padded), off u32, len u32, etag u32, flags u32
+                 sorted by path bytes, so the firmware can binary-search them
+  files        : 4-byte aligned; gzipped (flags bit0) when that is smaller
+
+Standalone:   python3 tools/pack_ui.py [data_dir] [out.bin]
+PlatformIO:   listed in extra_scripts; adds the targets
+              `pio run -t buildui` and `pio run -t uploadui`.
+"""
+import gzip
+import os
+import struct
+import sys
+import zlib
+
+MAGIC = 0x31554C53
+VERSION = 1
+ENTRY = struct.Struct("<48sIIII")
+HEADER = struct.Struct("<IHHII")
+GZIP = 1
+
+
+def pack(data_dir, out_path, limit=None):
+    files = []
+    for root, _, names in os.walk(data_dir):
+        for name in names:
+            full = os.path.join(root, name)
+            rel = "/" + os.path.relpath(full, data_dir).replace(os.sep, "/")
+            if len(rel.encode()) >= 48:
+                raise SystemExit("pack_ui: path too long for the index: " + rel)
+            files.append((rel.encode(), full))
+    files.sort()
+
+    table_end = HEADER.size + ENTRY.size * len(files)
+    entries, blobs, off = [], [], table_end
+    for rel, full in files:
+        raw = open(full, "rb").read()
+        z = gzip.compress(raw, 9, mtime=0)
+        body, flags = (z, GZIP) if len(z) < len(raw) else (raw, 0)
+        pad = (-len(body)) % 4
+        entries.append(ENTRY.pack(rel, off, len(body), zlib.crc32(raw) & 0xFFFFFFFF, flags))
+        blobs.append(body + b"\0" * pad)
+        off += len(body) + pad
+
+    rest = b"".join(entries) + b"".join(blobs)
+    size = HEADER.size + len(rest)
+    if limit and size > limit:
+        raise SystemExit("pack_ui: bundle is %d bytes, partition holds %d" % (size, limit))
+    with open(out_path, "wb") as f:
+        f.write(HEADER.pack(MAGIC, len(files), VERSION, size, zlib.crc32(rest) & 0xFFFFFFFF))
+        f.write(rest)
+    print("pack_ui: %d files, %d bytes -> %s" % (len(files), size, out_path))
+
+
+def ui_partition(csv_path):
+    """(offset, size) of the "ui" row in partitions.csv."""
+    for line in open(csv_path):
+        cols = [c.strip() for c in line.split("#")[0].split(",")]
+        if cols and cols[0] == "ui":
+            return int(cols[3], 0), int(cols[4], 0)
+    raise SystemExit("pack_ui: no ui partition in " + csv_path)
+
+
+try:
+    Import("env")  # noqa: F821  (PlatformIO extra_script)
+except NameError:
+    env = None
+
+if env is not None:
+    proj = env.subst("$PROJECT_DIR")
+    offset, limit = ui_partition(os.path.join(proj, "partitions.csv"))
+    out = os.path.join(env.subst("$BUILD_DIR"), "ui.bin")
+
+    def build_ui(*_args, **_kwargs):
+        pack(os.path.join(proj, "data"), out, limit)
+
+    env.AddCustomTarget("buildui", None, build_ui, title="Build UI bundle")
+    env.AddCustomTarget(
+        "uploadui", None,
+        [build_ui,
+         '"$PYTHONEXE" "$UPLOADER" --chip esp32 --port "$UPLOAD_PORT" --baud $UPLOAD_SPEED '
+         "write_flash 0x%x %s" % (offset, out)],
+        title="Upload UI bundle")
+elif __name__ == "__main__":
+    here = os.path.dirname(os.path.abspath(__file__))
+    data = sys.argv[1] if len(sys.argv) > 1 else os.path.join(here, "..", "data")
+    dest = sys.argv[2] if len(sys.argv) > 2 else "ui.bin"
+    _, lim = ui_partition(os.path.join(here, "..", "partitions.csv"))
+    pack(data, dest, lim)
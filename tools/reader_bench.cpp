@@ -0,0 +1,99 @@
+// Host benchmark for the SD log reader: reads one file the way the log
+// handlers used to (Stream::readStringUntil, i.e. one byte at a time into a
+// growing String) and through BlockLineReader (src/block_reader.h, the same
+// code the firmware runs), and prints MB/s for each. Without a file argument
+// it writes a synthetic log of --rows CSV rows first.
+//
+// Host numbers only rank the two paths by CPU cost; the SD/SPI transfer is
+// not modelled. /api/sd/bench gives the on-target figures.
+//
+// Build:  g++ -std=c++17 -O2 -o reader_bench tools/reader_bench.cpp
+// Run:    reader_bench [--rows N] [--repeat R] [file.csv]
+#include "../src/block_reader.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+struct FileSrc {
+  FILE* f;
+  int  read(uint8_t* dst, size_t n){ return (int)fread(dst, 1, n, f); }
+  bool seek(uint32_t off){ return fseek(f, (long)off, SEEK_SET) == 0; }
+};
+
+static double seconds(std::chrono::steady_clock::time_point t0){
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// Stream::readStringUntil: timedRead() per byte, String += per byte.
+static size_t legacyLines(FILE* f){
+  size_t lines = 0;
+  std::string s;
+  for(;;){
+    s.clear();
+    int c;
+    while((c = fgetc(f)) != EOF && c != '\n') s += (char)c;
+    if(c == EOF && s.empty()) break;
+    lines++;
+    if(c == EOF) break;
+  }
+  return lines;
+}
+
+static size_t blockLines(FILE* f){
+  static uint8_t mem[BLOCK_READER_MEM];
+  FileSrc src{f};
+  BlockLineReader<FileSrc> rd(src, mem, 0);
+  size_t lines = 0;
+  while(rd.next()) lines++;
+  return lines;
+}
+
+int main(int argc, char** argv){
+  long rows = 200000;
+  int repeat = 5;
+  const char* path = nullptr;
+  for(int i = 1; i < argc; i++){
+    if(!strcmp(argv[i], "--rows") && i + 1 < argc) rows = atol(argv[++i]);
+    else if(!strcmp(argv[i], "--repeat") && i + 1 < argc) repeat = atoi(argv[++i]);
+    else if(argv[i][0] == '-'){ fprintf(stderr, "usage: %s [--rows N] [--repeat R] [file.csv]\n", argv[0]); return 2; }
+    else path = argv[i];
+  }
+  std::string tmp;
+  if(!path){
+    tmp = "reader_bench.csv";
+    FILE* w = fopen(tmp.c_str(), "w");
+    if(!w){ perror(tmp.c_str()); return 1; }
+    fprintf(w, "timestamp,budget_kwh,remaining_kwh,used_kwh\r\n");
+    for(long i = 0; i < rows; i++)
+      fprintf(w, "2025-01-%02ld %02ld:%02ld:%02ld,4.000000,%.6f,%.6f\r\n",
+              1 + i / 86400 % 28, i / 3600 % 24, i / 60 % 60, i % 60, 4.0 - i * 1e-5, i * 1e-5);
+    fclose(w);
+    path = tmp.c_str();
+  }
+  FILE* f = fopen(path, "rb");
+  if(!f){ perror(path); return 1; }
+  fseek(f, 0, SEEK_END);
+  double mb = ftell(f) / 1e6;
+
+  double best[2] = { 1e9, 1e9 };
+  size_t lines[2] = { 0, 0 };
+  for(int r = 0; r < repeat; r++){
+    for(int k = 0; k < 2; k++){
+      fseek(f, 0, SEEK_SET);
+      auto t0 = std::chrono::steady_clock::now();
+      lines[k] = k ? blockLines(f) : legacyLines(f);
+      double s = seconds(t0);
+      if(s < best[k]) best[k] = s;
+    }
+  }
+  fclose(f);
+  if(!tmp.empty()) remove(tmp.c_str());
+
+  printf("%s: %.2f MB, best of %d\n", path, mb, repeat);
+  printf("  legacy (byte path)  %8zu lines  %8.1f MB/s\n", lines[0], mb / best[0]);
+  printf("  block  (%5zu B)    %8zu lines  %8.1f MB/s  (x%.1f)\n", BLOCK_READ_SIZE, lines[1], mb / best[1], best[0] / best[1]);
+  return lines[0] == lines[1] ? 0 : 1;
+}
@@ -0,0 +1,108 @@
+"""Heap/arena soak against a running controller.
+
+Drives a steady mix of the handlers that use request arenas (status, memory,
+history, config, logs, relays) and samples /api/mem every --sample seconds
+into a CSV. At the end it fits a line through the samples after the warm-up
+(first 10%) and reports the drift per day of free heap and of the largest
+free block; a shrinking largest block is the fragmentation the arenas exist
+to prevent. Exit status 1 when either declines faster than --max-drift.
+
+    python3 tools/soak.py 192.168.4.1 --hours 720 --out soak.csv
+
+Ctrl-C ends the run early and still prints the summary.
+"""
+import argparse
+import csv
+import sys
+import time
+
+from devhttp import Device
+
+MIX = [
+    ("GET", "/api/status", None),
+    ("GET", "/api/mem", None),
+    ("GET", "/api/history/recent?since=0&max=600", None),
+    ("GET", "/api/config", None),
+    ("GET", "/api/relays", None),
+    ("GET", "/api/logs/query?limit=200", None),
+    ("GET", "/api/logs/query?res=hour", None),
+    ("GET", "/api/events/summary", None),
+]
+FIELDS = ["t_s", "heap_free", "heap_largest_block", "heap_min_free",
+          "arena_high_water", "arena_overflows", "arena_fallbacks", "errors"]
+
+
+def slope_per_day(ts, ys):
+    n = len(ts)
+    if n < 2:
+        return 0.0
+    mt, my = sum(ts) / n, sum(ys) / n
+    var = sum((t - mt) ** 2 for t in ts)
+    if not var:
+        return 0.0
+    return sum((t - mt) * (y - my) for t, y in zip(ts, ys)) / var * 86400.0
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    ap.add_argument("host")
+    ap.add_argument("-u", "--user", default="admin")
+    ap.add_argument("-p", "--password", default="admin")
+    ap.add_argument("--hours", type=float, default=24.0)
+    ap.add_argument("--sample", type=float, default=60.0, help="seconds between /api/mem samples")
+    ap.add_argument("--rate", type=float, default=5.0, help="mix requests per second")
+    ap.add_argument("--out", default="soak.csv")
+    ap.add_argument("--max-drift", type=float, default=1024.0, help="allowed decline, bytes/day")
+    a = ap.parse_args()
+
+    dev = Device(a.host, a.user, a.password)
+    rows, errors, i = [], 0, 0
+    start = time.monotonic()
+    next_sample = start
+    with open(a.out, "w", newline="") as f:
+        w = csv.writer(f)
+        w.writerow(FIELDS)
+        try:
+            while time.monotonic() - start < a.hours * 3600:
+                now = time.monotonic()
+                if now >= next_sample:
+                    try:
+                        m = dev.get_json("/api/mem")
+                        row = [round(now - start, 1)] + [m.get(k, 0) for k in FIELDS[1:-1]] + [errors]
+                        rows.append(row)
+                        w.writerow(row)
+                        f.flush()
+                    except (OSError, RuntimeError, ValueError) as e:
+                        print("sample failed: %s" % e, file=sys.stderr)
+                    next_sample += a.sample
+                method, path, body = MIX[i % len(MIX)]
+                i += 1
+                try:
+                    status, _, _ = dev.request(method, path, body, sink=lambda _: None)
+                    if status >= 500 and status != 503:
+                        errors += 1
+                except OSError:
+                    errors += 1
+                time.sleep(max(0.0, 1.0 / a.rate - (time.monotonic() - now)))
+        except KeyboardInterrupt:
+            pass
+
+    steady = rows[len(rows) // 10:]
+    if len(steady) < 2:
+        print("soak: too few samples (%d)" % len(rows))
+        return 1
+    ts = [r[0] for r in steady]
+    free = slope_per_day(ts, [r[1] for r in steady])
+    largest = slope_per_day(ts, [r[2] for r in steady])
+    last = rows[-1]
+    print("soak: %.1f h, %d requests, %d errors, %d samples" % (last[0] / 3600, i, errors, len(rows)))
+    print("  heap_free           %+9.0f B/day (now %d, min %d)" % (free, last[1], last[3]))
+    print("  heap_largest_block  %+9.0f B/day (now %d, min %d)" % (largest, last[2], min(r[2] for r in rows)))
+    print("  arena high water %d B, overflows %d, fallbacks %d" % (last[4], last[5], last[6]))
+    ok = free > -a.max_drift and largest > -a.max_drift
+    print("soak: %s" % ("flat" if ok else "DRIFTING"))
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,191 @@
+"""Stand-in controller for testing tools/collector.cpp without hardware.
+
+Serves POST /api/login and GET /api/replicate?cursor=&max= the way the
+firmware does: chunked responses of ReplFrame-framed archive blocks, then a
+ReplCursor frame (src/log_format.h). The log is synthetic: --per-second rows
+every second from --hours ago up to now, growing live. Row i has
+used = i * 10 (micro-kWh), so a store with a gap or a duplicate shows up as a
+step other than 10 in used.i64.
+
+Closed days start out as hourly files and are folded into day archives
+--fold-after seconds after start-up, renumbering positions exactly like the
+firmware's compaction does, so a collector that is running across the fold
+exercises the cursor resync on (epoch, dup).
+
+    python3 tools/standin.py --port 8099 --hours 30 --fold-after 20 &
+    ./collector -d ./store dev1=127.0.0.1:8099
+"""
+import argparse
+import http.server
+import struct
+import threading
+import time
+import urllib.parse
+import zlib
+
+REPL_MAGIC = 0x31524C53
+BLOCK_ROWS = 256
+BLOCK_BYTES = 2048
+SID = "SID=standin"
+
+
+def varint(v):
+    out = bytearray()
+    while v >= 0x80:
+        out.append((v & 0x7F) | 0x80)
+        v >>= 7
+    out.append(v)
+    return bytes(out)
+
+
+def zigzag(v):
+    return ((v << 1) ^ (v >> 63)) & 0xFFFFFFFFFFFFFFFF
+
+
+def frame(payload, rows):
+    return struct.pack("<IHHI", REPL_MAGIC, rows, len(payload), zlib.crc32(payload)) + payload
+
+
+def hour_key(epoch):
+    t = time.gmtime(epoch)   # epochs are local wall time read as UTC, as on the device
+    return ((t.tm_year * 100 + t.tm_mon) * 100 + t.tm_mday) * 100 + t.tm_hour
+
+
+class Log:
+    def __init__(self, start, per_second, fold_at):
+        self.start, self.per_second, self.fold_at = start, per_second, fold_at
+
+    def size(self):
+        return (int(time.time()) - self.start + 1) * self.per_second
+
+    def row(self, i):
+        used = i * 10
+        return (self.start + i // self.per_second, 5000000, 5000000 - used, used)
+
+    def first_at(self, epoch):
+        return max(0, (epoch - self.start) * self.per_second)
+
+    def folded(self, epoch):
+        """True once the day holding `epoch` has been folded into its archive."""
+        day_end = epoch - epoch % 86400 + 86400
+        return time.time() >= self.fold_at and day_end <= int(time.time())
+
+    def locate(self, i):
+        """(key, pos, archive) of row i in the current file layout."""
+        e = self.row(i)[0]
+        if self.folded(e):
+            day0 = e - e % 86400
+            return hour_key(day0), i - self.first_at(day0), 1
+        return hour_key(e), i - self.first_at(e - e % 3600), 0
+
+    def resume(self, key, pos, epoch, dup, archive):
+        """Index of the first row after the cursor, as handleReplicate finds it."""
+        if not epoch:
+            return 0
+        n = self.size()
+        # fast path: the cursor's file still exists and the row at pos checks out
+        e0 = epoch - epoch % (86400 if archive else 3600)
+        i = self.first_at(e0) + pos
+        if i < n and self.locate(i) == (key, pos, archive) and self.row(i)[0] == epoch:
+            return i + 1
+        # resync: skip rows before epoch, then the dup rows of that second already sent
+        i = self.first_at(epoch)
+        while i < n and self.row(i)[0] == epoch and dup:
+            i += 1
+            dup -= 1
+        return i
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    log = None
+    stats = {"requests": 0, "rows": 0}
+    lock = threading.Lock()
+
+    def do_POST(self):
+        self.rfile.read(int(self.headers.get("Content-Length") or 0))
+        if urllib.parse.urlparse(self.path).path != "/api/login":
+            return self.reply(404, b"")
+        self.reply(200, b'{"ok":true}', [("Set-Cookie", SID + "; Path=/; HttpOnly")])
+
+    def do_GET(self):
+        url = urllib.parse.urlparse(self.path)
+        if url.path != "/api/replicate":
+            return self.reply(404, b"")
+        if SID not in (self.headers.get("Cookie") or ""):
+            return self.reply(401, b"")
+        q = urllib.parse.parse_qs(url.query)
+        try:
+            cur = [int(x, 16) for x in q.get("cursor", ["0.0.0.0.0"])[0].split(".")]
+            key, pos, epoch, dup, archive = cur
+        except ValueError:
+            return self.reply(400, b"Invalid cursor")
+        limit = max(1, min(4096, int(q.get("max", ["2048"])[0])))
+
+        log = self.log
+        i = log.resume(key, pos, epoch, dup, archive)
+        end = min(log.size(), i + limit)
+        self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Transfer-Encoding", "chunked")
+        self.end_headers()
+
+        nxt = (key, pos, epoch, dup, archive)
+        block, rows, prev = bytearray(), 0, (0, 0, 0, 0)
+        for k in range(i, end):
+            r = log.row(k)
+            block += b"".join(varint(zigzag(r[f] - prev[f])) for f in range(4))
+            prev, rows = r, rows + 1
+            d = nxt[3] + 1 if r[0] == nxt[2] else 1
+            kk, pp, aa = log.locate(k)
+            nxt = (kk, pp, r[0], d, aa)
+            if rows >= BLOCK_ROWS or len(block) >= BLOCK_BYTES:
+                self.chunk(frame(bytes(block), rows))
+                block, rows, prev = bytearray(), 0, (0, 0, 0, 0)
+        if rows:
+            self.chunk(frame(bytes(block), rows))
+        more = 1 if end < log.size() else 0
+        self.chunk(frame(struct.pack("<IIIHBB", nxt[0], nxt[1], nxt[2], nxt[3], nxt[4], more), 0))
+        self.chunk(b"")
+        with self.lock:
+            self.stats["requests"] += 1
+            self.stats["rows"] += end - i
+
+    def chunk(self, data):
+        self.wfile.write(b"%x\r\n%s\r\n" % (len(data), data))
+
+    def reply(self, status, body, headers=()):
+        self.send_response(status)
+        for k, v in headers:
+            self.send_header(k, v)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, *args):
+        pass
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--port", type=int, default=8099)
+    ap.add_argument("--hours", type=float, default=30, help="history already on the card")
+    ap.add_argument("--per-second", type=int, default=1, help="rows per second (>1 exercises dup)")
+    ap.add_argument("--fold-after", type=float, default=0, help="seconds until closed days are archived")
+    a = ap.parse_args()
+
+    now = int(time.time())
+    Handler.log = Log(now - int(a.hours * 3600), a.per_second, time.time() + a.fold_after)
+    srv = http.server.ThreadingHTTPServer(("127.0.0.1", a.port), Handler)
+    threading.Thread(target=srv.serve_forever, daemon=True).start()
+    print("stand-in on 127.0.0.1:%d, %d rows" % (a.port, Handler.log.size()), flush=True)
+    try:
+        while True:
+            time.sleep(10)
+            print("%(requests)d requests, %(rows)d rows served" % Handler.stats, flush=True)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()